@@ -0,0 +1,224 @@
+#if !defined ATENGINE_H_DEFINED
+#define ATENGINE_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+
+#include "Hardplace705Plus.h"
+#include "Bluetooth.h"
+#include "TraceLog.h"
+
+/*
+   Non-blocking AT command engine
+
+   Commands are queued with a deadline and a completion callback and sent one at a time from Task(). The engine
+   switches the module to AT command mode (and lets it settle for ModeSettleMillis) before the first command, claims
+   the device so its onAvailable() doesn't eat the reply, assembles the reply a line at a time in a fixed buffer and
+   completes the command on "OK", "FAIL" or "ERROR", or when the deadline passes. The callback gets the whole reply
+   ("+BIND:...\r\nOK\r\n") and whether it ended in OK. Once the queue is empty the data transfer mode the module
+   was in is restored.
+
+   abort() completes everything queued as failed, for the synchronous SendATCmd() that needs the port. A command
+   already sent is first waited out, to its terminal line or its deadline, so its late reply isn't read as the
+   answer to SendATCmd()'s.
+*/
+
+class CATEngine {
+public:
+  typedef void (*ATCallback)(void* pContext, bool fOK, const char* pszResponse);
+
+  enum {
+    QueueDepth = 4,
+    CmdBytes = 48,
+    LineBytes = 64,
+    ResponseBytes = 160,
+    ModeSettleMillis = 100
+  };
+
+public:
+  CATEngine(CBluetoothDevice& rDevice, IBluetooth& rBluetooth, IBluetooth::TeensyBluetooth DeviceID)
+    : m_rDevice(rDevice), m_rBluetooth(rBluetooth), m_DeviceID(DeviceID), m_eState(Idle),
+      m_uHead(0), m_uCount(0), m_fActive(false), m_fRestoreData(false), m_fWasClaimed(false),
+      m_stLine(0), m_stResponse(0), m_ulCommands(0), m_ulTimeouts(0) {
+    m_achLine[0] = m_achResponse[0] = '\0';
+  }
+
+private:
+  CATEngine();
+  CATEngine(const CATEngine&);
+  CATEngine& operator=(const CATEngine&);
+
+public:
+  bool queue(const char* pszCmd, unsigned long ulTimeout, ATCallback pfnDone = 0, void* pContext = 0) {
+    if (m_uCount >= QueueDepth
+        || strlen(pszCmd) >= CmdBytes) {
+      return false;
+    }
+
+    SCommand& rCmd(m_aQueue[(m_uHead + m_uCount++) % QueueDepth]);
+
+    strcpy(rCmd.m_achCmd, pszCmd);
+    rCmd.m_ulTimeout = ulTimeout;
+    rCmd.m_pfnDone = pfnDone;
+    rCmd.m_pContext = pContext;
+    return true;
+  }
+
+  bool isBusy(void) const {
+    return m_uCount != 0;
+  }
+
+  void abort(void) {
+    while (m_eState == Waiting) {
+      if (m_rDevice.available() > 0) {
+        onChar(m_rDevice.read());
+      } else if (m_Timer >= m_aQueue[m_uHead].m_ulTimeout) {
+        m_ulTimeouts++;
+        complete(false);
+      } else {
+        Delay(1);
+      }
+    }
+    while (m_uCount) {
+      complete(false);
+    }
+  }
+
+  void Task(void) {
+    switch (m_eState) {
+      case Idle:
+        if (m_uCount) {
+          if (!m_fActive) {
+            m_fActive = true;
+            m_fWasClaimed = m_rDevice.isClaimed();
+            m_fRestoreData = false;
+            m_rDevice.claim(true);
+          }
+          if (!m_rBluetooth.BluetoothIsATCmdMode(m_DeviceID)) {
+            m_fRestoreData = m_rBluetooth.BluetoothIsDataTransferMode(m_DeviceID);
+            m_rBluetooth.BluetoothATCmdMode(m_DeviceID);
+            m_eState = Settling;
+            m_Timer = 0;
+          } else {
+            send();
+          }
+        }
+        break;
+
+      case Settling:
+        if (m_Timer >= ModeSettleMillis) {
+          send();
+        }
+        break;
+
+      case Waiting:
+        while (m_eState == Waiting
+               && m_rDevice.available() > 0) {
+          onChar(m_rDevice.read());
+        }
+        if (m_eState == Waiting
+            && m_Timer >= m_aQueue[m_uHead].m_ulTimeout) {
+          m_ulTimeouts++;
+          complete(false);
+        }
+        break;
+    }
+  }
+
+  void printStatus(Print& rDevice) const {
+    rDevice.printf("AT engine       %lu commands, %lu timed out, %u queued\r\n", m_ulCommands, m_ulTimeouts, m_uCount);
+  }
+
+private:
+  enum eState {
+    Idle,
+    Settling,
+    Waiting
+  };
+
+  struct SCommand {
+    char          m_achCmd[CmdBytes];
+    unsigned long m_ulTimeout;
+    ATCallback    m_pfnDone;
+    void*         m_pContext;
+  };
+
+  void send(void) {
+    const SCommand& rCmd(m_aQueue[m_uHead]);
+
+    while (m_rDevice.available() > 0) {
+      m_rDevice.read();
+    }
+    m_rDevice.write(rCmd.m_achCmd);
+    m_rDevice.write("\r\n");
+    m_stLine = m_stResponse = 0;
+    m_achResponse[0] = '\0';
+    m_Timer = 0;
+    m_eState = Waiting;
+    m_ulCommands++;
+    TRACE_DATA(TraceBluetooth, TraceDebug, ATCommand, reinterpret_cast<const uint8_t*>(rCmd.m_achCmd), strlen(rCmd.m_achCmd));
+  }
+
+  void onChar(int iChar) {
+    if (iChar == '\n') {
+      m_achLine[m_stLine] = '\0';
+      for (size_t nChar(0); nChar < m_stLine && m_stResponse < sizeof m_achResponse - 3; nChar++) {
+        m_achResponse[m_stResponse++] = m_achLine[nChar];
+      }
+      m_achResponse[m_stResponse++] = '\r', m_achResponse[m_stResponse++] = '\n';
+      m_achResponse[m_stResponse] = '\0';
+      m_stLine = 0;
+      if (strcmp(m_achLine, "OK") == 0) {
+        complete(true);
+      } else if (strncmp(m_achLine, "FAIL", 4) == 0
+                 || strncmp(m_achLine, "ERROR", 5) == 0) {
+        complete(false);
+      }
+    } else if (iChar != '\r'
+               && m_stLine < sizeof m_achLine - 1) {
+      m_achLine[m_stLine++] = static_cast<char>(iChar);
+    }
+  }
+
+  void complete(bool fOK) {
+    const SCommand Cmd(m_aQueue[m_uHead]);
+    const bool     fSent(m_eState == Waiting);
+
+    m_uHead = (m_uHead + 1) % QueueDepth;
+    m_uCount--;
+    m_eState = Idle;  // Still in AT command mode, the next one goes out on the next Task()
+    if (!m_uCount
+        && m_fActive) {
+      if (m_fRestoreData) {
+        m_rBluetooth.BluetoothDataTransferMode(m_DeviceID);
+      }
+      m_rDevice.claim(m_fWasClaimed);
+      m_fActive = false;
+    }
+    if (Cmd.m_pfnDone) {
+      Cmd.m_pfnDone(Cmd.m_pContext, fOK, (fSent) ? m_achResponse : "");
+    }
+  }
+
+private:
+  CBluetoothDevice&           m_rDevice;
+  IBluetooth&                 m_rBluetooth;
+  IBluetooth::TeensyBluetooth m_DeviceID;
+  eState                      m_eState;
+  SCommand                    m_aQueue[QueueDepth];
+  unsigned                    m_uHead;
+  unsigned                    m_uCount;
+  bool                        m_fActive;  // Claimed, the mode to restore is saved
+  bool                        m_fRestoreData;
+  bool                        m_fWasClaimed;
+  elapsedMillis               m_Timer;
+  char                        m_achLine[LineBytes];
+  size_t                      m_stLine;
+  char                        m_achResponse[ResponseBytes];
+  size_t                      m_stResponse;
+  uint32_t                    m_ulCommands;
+  uint32_t                    m_ulTimeouts;
+};
+#endif
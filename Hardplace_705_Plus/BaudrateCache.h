@@ -0,0 +1,364 @@
+#if !defined BAUDRATECACHE_H_DEFINED
+#define BAUDRATECACHE_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+
+#include "Hardplace705Plus.h"
+#include "Teensy41.h"
+#include "EEPromStream.h"
+
+/*
+   Where the Bluetooth modules were last found
+
+   One record for all of them, a slot per module keyed by a hash of its device name. A slot keeps the rate the module
+   last answered at and how often a search ended at each rate, order() puts the last good rate first and the rest by
+   that count, so a module that hasn't moved answers on the first probe and one that has is found where modules
+   usually end up. found() only dirties the record when the module has moved, a normal boot doesn't write.
+
+   negotiate() steps a module that's answering AT commands up from its configured rate, one rate at a time, as far as
+   its ceiling. Each step has to pass IntegrityPings pings in a row at the new rate or the module is put back and the
+   ceiling comes down to where it was, so a rate that failed isn't tried again every boot. An error burst on a
+   negotiated link, demote(), lowers the ceiling below the rate in use. The module keeps its AT+BAUD rate, so the
+   next negotiate() first steps it down to the ceiling, with the same integrity test, before stepping up.
+
+   CSPPTrafficDetector listens before probing, a module with a live SPP link passes "AT" through to the far end and
+   never answers, the bytes that do arrive (CI-V frames, Hardrock ';' commands) say the link and the rate are good.
+*/
+
+#define VER_BAUDRATECACHE 1
+
+class CBaudrateCache : public CEEPROMStream {
+public:
+  enum {
+    Modules = 4,
+    Rates = 12,
+    Unknown = 0xFF,
+    MaxHits = 0xFFFF,
+    NegotiateCeiling = 10,  // 921600, 1382400 is too close to the edge of the HC-06 clock
+    IntegrityPings = 8,
+    FrameBytes = 11         // A frequency broadcast, for the serialisation time
+  };
+
+public:
+  static CBaudrateCache& Cache(void) {
+    static CBaudrateCache Cache;
+
+    return Cache;
+  }
+
+private:
+  CBaudrateCache()
+    : CEEPROMStream(CTeensy::eEEPromRecordTypes::BaudrateCacheType, VER_BAUDRATECACHE) {
+    memset(m_aModules, 0, sizeof m_aModules);
+    for (size_t nModule(0); nModule < Modules; nModule++) {
+      m_aModules[nModule].m_uchLastGood = Unknown;
+      m_aModules[nModule].m_uchCeiling = NegotiateCeiling;
+    }
+    if (haveRecord()) {
+      Serialize(true);
+    }
+  }
+  CBaudrateCache(const CBaudrateCache&);
+  CBaudrateCache& operator=(const CBaudrateCache&);
+
+  virtual void Commit(void) {
+    Serialize();
+  }
+
+public:
+  static const uint32_t* rates(void) {  // Every rate an HC-05 or HC-06 can be set to
+    static const uint32_t aulRates[Rates] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1382400 };
+
+    return aulRates;
+  }
+
+  size_t order(const String& sModule, const uint32_t* pulRates, size_t cRates, uint32_t* pulOrdered) {  // Best guess first
+    const SModule* pModule(find(sModule, false));
+    size_t         cOrdered(0);
+
+    if (pModule
+        && pModule->m_uchLastGood < Rates) {
+      pulOrdered[cOrdered++] = rates()[pModule->m_uchLastGood];
+    }
+    for (size_t nRate(0); nRate < cRates; nRate++) {  // Insertion by hits, the caller's order breaks ties
+      const uint16_t uHits(hits(pModule, pulRates[nRate]));
+      size_t         nAt(cOrdered);
+
+      if (cOrdered && pulOrdered[0] == pulRates[nRate]) {
+        continue;
+      }
+      while (nAt > ((pModule && pModule->m_uchLastGood < Rates) ? 1 : 0)
+             && hits(pModule, pulOrdered[nAt - 1]) < uHits) {
+        pulOrdered[nAt] = pulOrdered[nAt - 1];
+        nAt--;
+      }
+      pulOrdered[nAt] = pulRates[nRate];
+      cOrdered++;
+    }
+    return cOrdered;
+  }
+
+  void found(const String& sModule, uint32_t ulBaudrate) {
+    SModule*      pModule(find(sModule, true));
+    const uint8_t uchRate(rateIndex(ulBaudrate));
+
+    if (uchRate < Rates
+        && pModule->m_uchLastGood != uchRate) {
+      pModule->m_uchLastGood = uchRate;
+      if (pModule->m_auHits[uchRate] < MaxHits) {
+        pModule->m_auHits[uchRate]++;
+      }
+      setDirty();
+    }
+  }
+
+  template< typename TDevice > uint32_t negotiate(TDevice& rDevice) {  // The module is answering at lineBaudrate()
+    SModule* pModule(find(rDevice.deviceName(), true));
+    uint8_t  uchRate(rateIndex(rDevice.lineBaudrate()));
+    uint32_t ulMicros(0);
+
+    if (uchRate >= Rates) {
+      return rDevice.lineBaudrate();
+    }
+    if (rDevice.integrityTest(ulMicros)) {
+      pModule->m_aulPingMicros[uchRate] = ulMicros;
+    }
+    if (uchRate > pModule->m_uchCeiling) {  // Demoted, down to the ceiling
+      const uint32_t ulFrom(rates()[uchRate]);
+      const uint32_t ulTo(rates()[pModule->m_uchCeiling]);
+
+      if (rDevice.setModuleBaudrate(ulTo)) {
+        rDevice.begin(ulTo);
+        if (rDevice.integrityTest(ulMicros)) {
+          uchRate = pModule->m_uchCeiling;
+          pModule->m_aulPingMicros[uchRate] = ulMicros;
+        } else {
+          rDevice.setModuleBaudrate(ulFrom);
+          rDevice.begin(ulFrom);
+          if (!rDevice.integrityTest(ulMicros)) {
+            rDevice.discoverBaudrate();
+          }
+          uchRate = rateIndex(rDevice.lineBaudrate());
+        }
+      }
+    }
+    while (uchRate < pModule->m_uchCeiling
+           && uchRate < NegotiateCeiling) {
+      const uint32_t ulFrom(rates()[uchRate]);
+      const uint32_t ulTo(rates()[uchRate + 1]);
+
+      if (!rDevice.setModuleBaudrate(ulTo)) {
+        break;
+      }
+      rDevice.begin(ulTo);
+      if (rDevice.integrityTest(ulMicros)) {
+        pModule->m_aulPingMicros[++uchRate] = ulMicros;
+        continue;
+      }
+      pModule->m_uchCeiling = uchRate;  // Put it back, and don't try that again
+      setDirty();
+      rDevice.setModuleBaudrate(ulFrom);
+      rDevice.begin(ulFrom);
+      if (!rDevice.integrityTest(ulMicros)) {
+        rDevice.discoverBaudrate();
+      }
+      break;
+    }
+    found(rDevice.deviceName(), rDevice.lineBaudrate());
+    rDevice.setBaudrate(rDevice.lineBaudrate());  // begin() stays here from now on
+    return rDevice.lineBaudrate();
+  }
+
+  void demote(const String& sModule, uint32_t ulFloor) {  // An error burst, settle lower next time
+    SModule* pModule(find(sModule, false));
+
+    if (pModule
+        && pModule->m_uchLastGood < Rates
+        && rates()[pModule->m_uchLastGood] > ulFloor
+        && pModule->m_uchCeiling >= pModule->m_uchLastGood) {
+      pModule->m_uchCeiling = pModule->m_uchLastGood - 1;
+      pModule->m_ulDemotions++;
+      setDirty();
+    }
+  }
+
+  void printStatus(Print& rDevice) const {
+    for (size_t nModule(0); nModule < Modules; nModule++) {
+      const SModule& rModule(m_aModules[nModule]);
+
+      if (rModule.m_uKey
+          && rModule.m_uchLastGood < Rates) {
+        const uint32_t ulBaud(rates()[rModule.m_uchLastGood]);
+
+        rDevice.printf("Baudrate %08lX %lu, ceiling %lu, ping %lu us, frame %lu us, %lu demotions\r\n",
+                       rModule.m_uKey, ulBaud, rates()[(rModule.m_uchCeiling < Rates) ? rModule.m_uchCeiling : NegotiateCeiling],
+                       rModule.m_aulPingMicros[rModule.m_uchLastGood],
+                       (FrameBytes * 10UL * 1000000UL) / ulBaud, rModule.m_ulDemotions);
+      }
+    }
+  }
+
+  uint32_t lastGood(const String& sModule) {
+    const SModule* pModule(find(sModule, false));
+
+    return (pModule && pModule->m_uchLastGood < Rates) ? rates()[pModule->m_uchLastGood] : 0;
+  }
+
+private:
+  struct SModule {
+    uint32_t m_uKey;  // Hash of the device name, 0 for an empty slot
+    uint8_t  m_uchLastGood;
+    uint8_t  m_uchCeiling;  // Highest rate negotiate() may use
+    uint16_t m_auHits[Rates];
+    uint32_t m_aulPingMicros[Rates];  // Not stored, this boot's measurements
+    uint32_t m_ulDemotions;           // Not stored
+  };
+
+  void Serialize(bool bLoad = false) {
+    SField aFields[Modules * 4];
+
+    for (size_t nModule(0); nModule < Modules; nModule++) {
+      aFields[4 * nModule + 0] = field(8 * nModule + 1, m_aModules[nModule].m_uKey);
+      aFields[4 * nModule + 1] = field(8 * nModule + 2, m_aModules[nModule].m_uchLastGood);
+      aFields[4 * nModule + 2] = field(8 * nModule + 3, m_aModules[nModule].m_auHits);
+      aFields[4 * nModule + 3] = field(8 * nModule + 4, m_aModules[nModule].m_uchCeiling);
+    }
+    if (bLoad) {
+      getFields(aFields, sizeof aFields / sizeof aFields[0]);
+    } else {
+      putFields(aFields, sizeof aFields / sizeof aFields[0]);
+    }
+  }
+
+  static uint32_t key(const String& sModule) {  // FNV-1a, never 0
+    uint32_t uKey(2166136261UL);
+
+    for (size_t nChar(0); nChar < sModule.length(); nChar++) {
+      uKey = (uKey ^ static_cast<uint8_t>(sModule.charAt(nChar))) * 16777619UL;
+    }
+    return (uKey) ? uKey : 1;
+  }
+
+  static uint8_t rateIndex(uint32_t ulBaudrate) {
+    for (uint8_t uchRate(0); uchRate < Rates; uchRate++) {
+      if (rates()[uchRate] == ulBaudrate) {
+        return uchRate;
+      }
+    }
+    return Unknown;
+  }
+
+  static uint16_t hits(const SModule* pModule, uint32_t ulBaudrate) {
+    const uint8_t uchRate(rateIndex(ulBaudrate));
+
+    return (pModule && uchRate < Rates) ? pModule->m_auHits[uchRate] : 0;
+  }
+
+  SModule* find(const String& sModule, bool fAdd) {
+    const uint32_t uKey(key(sModule));
+    SModule*       pFree(0);
+
+    for (size_t nModule(0); nModule < Modules; nModule++) {
+      if (m_aModules[nModule].m_uKey == uKey) {
+        return &m_aModules[nModule];
+      } else if (!pFree
+                 && m_aModules[nModule].m_uKey == 0) {
+        pFree = &m_aModules[nModule];
+      }
+    }
+    if (fAdd) {
+      if (!pFree) {
+        pFree = &m_aModules[Modules - 1];  // A module that's gone, more than likely
+      }
+      memset(pFree, 0, sizeof *pFree);
+      pFree->m_uKey = uKey;
+      pFree->m_uchLastGood = Unknown;
+      pFree->m_uchCeiling = NegotiateCeiling;
+    }
+    return pFree;
+  }
+
+private:
+  SModule m_aModules[Modules];
+};
+
+class CErrorBurst {  // Errors close together, a line at its limit rather than the odd bad frame
+public:
+  enum {
+    Burst = 8,
+    WindowMillis = 1000
+  };
+
+public:
+  CErrorBurst()
+    : m_cErrors(0), m_ulErrors(0), m_ulBursts(0) {}
+
+  bool onError(void) {
+    m_ulErrors++;
+    if (m_Window > WindowMillis) {
+      m_Window = 0;
+      m_cErrors = 0;
+    }
+    if (++m_cErrors >= Burst) {
+      m_cErrors = 0;
+      m_ulBursts++;
+      return true;
+    }
+    return false;
+  }
+  uint32_t errors(void) const {
+    return m_ulErrors;
+  }
+  uint32_t bursts(void) const {
+    return m_ulBursts;
+  }
+
+private:
+  elapsedMillis m_Window;
+  unsigned      m_cErrors;
+  uint32_t      m_ulErrors;
+  uint32_t      m_ulBursts;
+};
+
+class CSPPTrafficDetector {
+public:
+  enum {
+    ListenMillis = 150,
+    Evidence = 2  // Frames before we believe it
+  };
+
+public:
+  static bool isLive(Stream& rDevice, unsigned long ulListenMillis = ListenMillis) {  // Reads what arrives, it's boot
+    unsigned cFrames(0);
+    unsigned cCIVPreamble(0);
+    size_t   cText(0);
+
+    for (elapsedMillis Listen(0); cFrames < Evidence && Listen < ulListenMillis;) {
+      const int iChar(rDevice.read());
+
+      if (iChar < 0) {
+        Delay(1);
+        continue;
+      }
+      if (iChar == 0xFE) {  // CI-V, FE FE ... FD
+        cCIVPreamble++;
+        cText = 0;
+      } else if (iChar == 0xFD) {
+        cFrames += (cCIVPreamble >= 2) ? 1 : 0;
+        cCIVPreamble = 0;
+      } else if (iChar == ';') {  // Hardrock, printable text up to ';'
+        cFrames += (cText > 0) ? 1 : 0;
+        cText = 0;
+      } else if (iChar >= ' ' && iChar < 0x7F) {
+        cText++;
+      } else if (cCIVPreamble < 2) {
+        cText = 0;
+      }
+    }
+    return cFrames >= Evidence;
+  }
+};
+#endif
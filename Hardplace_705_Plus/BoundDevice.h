@@ -6,6 +6,8 @@
 #include "Hardplace705Plus.h"
 #include "SerialDevice.h"
 
+class CICOMResp;
+
 class CBoundDevice {
 public:
   enum eDeviceClass {
@@ -37,6 +39,16 @@ public:
   virtual void onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice) {}
   virtual void onNewPacket(const String& rsPacket, CSerialDevice& rSrcDevice) {}
   virtual void onReceive(uint8_t uchChar, CSerialDevice& rSrcDevice) {}
+  virtual void onTextFrame(const char* pchFrame, size_t stFrame, CSerialDevice& rSrcDevice) {  // "HRBN;" NUL terminated,
+    String sPacket(pchFrame);                                                                  // onNewPacket() without the ';'
+
+    sPacket.remove(stFrame - 1);
+    onNewPacket(sPacket, rSrcDevice);
+  }
+  virtual void onBurstEnd(CSerialDevice& rSrcDevice) {}  // The source has handed on every frame that arrived
+  virtual bool onNewFrame(const CICOMResp& rFrame, CSerialDevice& rSrcDevice) {  // Decoded CI-V frame from the radio,
+    return false;                                                                 // false delivers it to onNewPacket()
+  }
 
 private:
   eDeviceClass m_eDeviceClass;
@@ -0,0 +1,266 @@
+#if !defined CIVBRIDGE_H_DEFINED
+#define CIVBRIDGE_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+
+#include "Hardplace705Plus.h"
+#include "SerialDevice.h"
+#include "ICOM.h"
+
+/*
+   Transparent CI-V bridge
+
+   A client port that issues "HPBR1;" becomes a raw, full duplex CI-V pipe to the IC-705. The bridge claims the port
+   (its own onAvailable() no longer runs) and from CIC_705MasterDevice::Task() frames the client's bytes in-stream
+   and writes each complete frame to the radio through CIC_705MasterDevice::write(), without waiting for a reply.
+   Each frame goes out from the client's link address (LinkAddressBase + client slot) rather than its own, so the
+   reply is marked as the bridge's and the Hardplace's own requests waiting in CICOMReq::getResponse() skip it.
+   The client's address is kept, in order, until the reply comes back and is put back in the reply's to address.
+   Frames from the radio are handed to the bridge before the bound device fan-out: replies to a link address go to
+   that client, broadcasts (to address 0x00) go to every bridge client, anything else goes to the clients that
+   have sent from the frame's to address, the same as clients sharing a CI-V bus. A client may use any number of
+   controller addresses, each one it sends from is added to its routes.
+
+   Text outside a CI-V frame is ignored except "HPBR0;", which hands the port back to the command processor.
+   A USB client that drops DTR is released as well.
+*/
+
+class CCIVBridge {
+public:
+  enum {
+    MaxClients = 4,  // At most 8, routes are a client bit mask
+    FrameBytes = 128,
+    BudgetMicros = 250,
+    PendingFrames = 8,  // Requests a client can have outstanding before the oldest address is forgotten
+    LinkAddressBase = 0xC0
+  };
+
+public:
+  CCIVBridge(CSerialDevice& rRadio)
+    : m_rRadio(rRadio) {
+    memset(m_aClients, 0, sizeof m_aClients);
+    memset(m_auchRoutes, 0, sizeof m_auchRoutes);
+  }
+
+private:
+  CCIVBridge();
+  CCIVBridge(const CCIVBridge&);
+  CCIVBridge& operator=(const CCIVBridge&);
+
+public:
+  bool attach(CSerialDevice& rClient) {
+    if (isAttached(rClient)) {
+      return true;
+    }
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      SClient& rSlot(m_aClients[nIndex]);
+
+      if (!rSlot.m_pDevice) {
+        memset(&rSlot, 0, sizeof rSlot);
+        rSlot.m_pDevice = &rClient;
+        rClient.claim(true);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void detach(CSerialDevice& rClient) {
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      if (m_aClients[nIndex].m_pDevice == &rClient) {
+        rClient.claim(false);
+        m_aClients[nIndex].m_pDevice = 0;
+        for (size_t nAddress(0); nAddress < sizeof m_auchRoutes; nAddress++) {
+          m_auchRoutes[nAddress] &= ~(1 << nIndex);
+        }
+      }
+    }
+  }
+
+  bool isAttached(const CSerialDevice& rClient) const {
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      if (m_aClients[nIndex].m_pDevice == &rClient) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool isActive(void) const {
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      if (m_aClients[nIndex].m_pDevice) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Task(void) {  // Client to radio
+    const uint32_t uStart(micros());
+
+    for (size_t nIndex(0); nIndex < MaxClients && micros() - uStart < BudgetMicros; nIndex++) {
+      SClient& rClient(m_aClients[nIndex]);
+
+      if (!rClient.m_pDevice) {
+        continue;
+      }
+      if (!*rClient.m_pDevice) {  // USB client went away
+        detach(*rClient.m_pDevice);
+        continue;
+      }
+
+      Stream& rStream(rClient.m_pDevice->stream());
+
+      for (int iAvailable(rStream.available()); rClient.m_pDevice && iAvailable > 0; iAvailable = rStream.available()) {
+        uint8_t auchRead[64];
+        size_t  stRead(rStream.readBytes(reinterpret_cast<char*>(auchRead),
+                                         (size_t(iAvailable) < sizeof auchRead) ? iAvailable : sizeof auchRead));
+
+        for (size_t nByte(0); rClient.m_pDevice && nByte < stRead; nByte++) {
+          onClientByte(rClient, auchRead[nByte]);
+        }
+        if (micros() - uStart >= BudgetMicros) {
+          break;
+        }
+      }
+    }
+  }
+
+  bool onFrame(const CICOMResp& rFrame) {  // Radio to client(s), true if a client took it
+    const uint8_t* puchFrame(rFrame);
+    const size_t   stFrame(rFrame);
+    const uint8_t  uchTo(rFrame.ToAddress());
+
+    if (uchTo >= LinkAddressBase
+        && uchTo < LinkAddressBase + MaxClients) {
+      return onReply(m_aClients[uchTo - LinkAddressBase], puchFrame, stFrame);
+    }
+
+    const uint8_t uchClients((rFrame.isBroadcast()) ? 0xFF : m_auchRoutes[uchTo]);
+    bool          fDelivered(false);
+
+    for (size_t nIndex(0); uchClients && nIndex < MaxClients; nIndex++) {
+      SClient& rClient(m_aClients[nIndex]);
+
+      if (rClient.m_pDevice
+          && (uchClients & (1 << nIndex))) {
+        Stream& rStream(rClient.m_pDevice->stream());
+
+        if (rStream.availableForWrite() >= int(stFrame)) {
+          rStream.write(puchFrame, stFrame);
+          rClient.m_ulFromRadio++;
+        } else {
+          rClient.m_ulDropped++;  // Never block the radio on a slow client
+        }
+        fDelivered = true;
+      }
+    }
+    return fDelivered;
+  }
+
+  bool isRouted(uint8_t uchAddress) const {
+    return m_auchRoutes[uchAddress] != 0;
+  }
+
+  void printStatus(Print& rDevice) const {
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      const SClient& rClient(m_aClients[nIndex]);
+
+      if (rClient.m_pDevice) {
+        rDevice.printf("Bridge %-8s to radio %lu, from radio %lu, dropped %lu\r\n",
+                       rClient.m_pDevice->deviceName().c_str(),
+                       rClient.m_ulToRadio, rClient.m_ulFromRadio, rClient.m_ulDropped);
+      }
+    }
+  }
+
+private:
+  struct SClient {
+    CSerialDevice* m_pDevice;
+    uint8_t        m_auchFrame[FrameBytes];
+    size_t         m_stFrame;
+    bool           m_fInFrame;
+    char           m_achText[8];
+    size_t         m_stText;
+    uint8_t        m_auchPending[PendingFrames];  // The client's from address of each frame sent, oldest first
+    unsigned       m_uPendingHead;
+    unsigned       m_uPendingCount;
+    uint8_t        m_uchAddress;  // Last from address, for a reply with nothing pending
+    uint32_t       m_ulToRadio;
+    uint32_t       m_ulFromRadio;
+    uint32_t       m_ulDropped;
+  };
+
+  bool onReply(SClient& rClient, const uint8_t* puchFrame, size_t stFrame) {
+    if (!rClient.m_pDevice
+        || stFrame > FrameBytes) {
+      return true;  // Its client has gone, nobody else wants it
+    }
+
+    uint8_t auchFrame[FrameBytes];
+    Stream& rStream(rClient.m_pDevice->stream());
+
+    memcpy(auchFrame, puchFrame, stFrame);
+    auchFrame[2] = rClient.m_uchAddress;
+    if (rClient.m_uPendingCount) {
+      auchFrame[2] = rClient.m_auchPending[rClient.m_uPendingHead];
+      rClient.m_uPendingHead = (rClient.m_uPendingHead + 1) % PendingFrames;
+      rClient.m_uPendingCount--;
+    }
+    if (rStream.availableForWrite() >= int(stFrame)) {
+      rStream.write(auchFrame, stFrame);
+      rClient.m_ulFromRadio++;
+    } else {
+      rClient.m_ulDropped++;
+    }
+    return true;
+  }
+
+  void onClientByte(SClient& rClient, uint8_t uchByte) {
+    if (!rClient.m_fInFrame) {
+      if (uchByte == 0xFE) {
+        rClient.m_fInFrame = true;
+        rClient.m_auchFrame[0] = uchByte;
+        rClient.m_stFrame = 1;
+        rClient.m_stText = 0;
+      } else if (uchByte == ';') {
+        rClient.m_achText[rClient.m_stText] = '\0';
+        rClient.m_stText = 0;
+        if (strcasecmp(rClient.m_achText, "HPBR0") == 0) {
+          detach(*rClient.m_pDevice);
+        }
+      } else if (rClient.m_stText < sizeof rClient.m_achText - 1) {
+        rClient.m_achText[rClient.m_stText++] = static_cast<char>(uchByte);
+      }
+    } else if (rClient.m_stFrame >= FrameBytes) {
+      rClient.m_fInFrame = false;  // Not CI-V, drop it
+    } else {
+      rClient.m_auchFrame[rClient.m_stFrame++] = uchByte;
+      if (uchByte == 0xFD) {
+        rClient.m_fInFrame = false;
+        if (rClient.m_stFrame >= 6) {
+          const unsigned uSlot(&rClient - m_aClients);
+
+          m_auchRoutes[rClient.m_auchFrame[3]] |= 1 << uSlot;  // Frames the radio sends it unasked come back here
+          if (rClient.m_uPendingCount == PendingFrames) {      // Unanswered, forget the oldest
+            rClient.m_uPendingHead = (rClient.m_uPendingHead + 1) % PendingFrames;
+            rClient.m_uPendingCount--;
+          }
+          rClient.m_auchPending[(rClient.m_uPendingHead + rClient.m_uPendingCount++) % PendingFrames] = rClient.m_auchFrame[3];
+          rClient.m_uchAddress = rClient.m_auchFrame[3];
+          rClient.m_auchFrame[3] = LinkAddressBase + uSlot;
+          m_rRadio.write(rClient.m_auchFrame, rClient.m_stFrame);  // Virtual, the master's clone guard, trace and capture
+          rClient.m_ulToRadio++;
+        }
+      }
+    }
+  }
+
+private:
+  CSerialDevice& m_rRadio;
+  SClient        m_aClients[MaxClients];
+  uint8_t        m_auchRoutes[256];  // Client bit mask per CI-V address
+};
+#endif
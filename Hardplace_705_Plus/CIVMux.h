@@ -0,0 +1,248 @@
+#if !defined CIVMUX_H_DEFINED
+#define CIVMUX_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+#include <TeensyThreads.h>
+
+#include "Hardplace705Plus.h"
+#include "SerialDevice.h"
+#include "ICOM.h"
+#include "Capture.h"
+
+/*
+   CI-V bus multiplexer
+
+   Each client port (USB Serial, SerialUSB1, the Bluetooth slaves) is its own CI-V bus segment. A request from a
+   client is queued on that client's queue (submit()) and the client's task returns at once. From
+   CIC_705MasterDevice::Task() the queues are served round robin, one request per client per turn, with a single
+   request outstanding on the radio link at a time. The request's from address is rewritten to an address owned
+   by the client (AddressBase + client slot), so the reply is matched to its client even when several programs
+   use the same controller address, and the reply's to address is restored before it is written back.
+   The IC-705 device mutex is only held while a request is written, the request stays in flight here until its
+   reply or the timeout. The next request is dispatched as soon as the mutex is free. The Hardplace's own requests
+   queue behind the one in flight but ahead of the queued ones: a waiting caller takes the mutex, so nothing else
+   is dispatched, and reads the reply in flight itself; a try-lock caller is refused and retries later. A request
+   the radio doesn't answer within TimeoutMillis is dropped and the next one goes out.
+
+   Per client it keeps the queue wait and round trip latency (minimum, average, maximum), printed by HPPS.
+*/
+
+class CCIVMux {
+public:
+  enum {
+    MaxClients = 6,
+    QueueDepth = 4,
+    FrameBytes = 64,
+    TimeoutMillis = 500,
+    AddressBase = 0xD0
+  };
+
+public:
+  CCIVMux(CSerialDevice& rRadio)
+    : m_rRadio(rRadio), m_uNext(0), m_pOutstanding(0), m_ulLate(0) {
+    memset(m_aClients, 0, sizeof m_aClients);
+  }
+
+private:
+  CCIVMux();
+  CCIVMux(const CCIVMux&);
+  CCIVMux& operator=(const CCIVMux&);
+
+public:
+  bool submit(CSerialDevice& rClient, const uint8_t* puchFrame, size_t stFrame) {  // Any client thread
+    Threads::Scope wait(m_Mutex);
+    SClient*       pClient(client(rClient));
+
+    if (!pClient) {
+      return false;
+    }
+    if (stFrame < 6
+        || stFrame > FrameBytes
+        || pClient->m_uCount >= QueueDepth) {
+      pClient->m_ulRejected++;
+      return false;
+    }
+
+    SRequest& rRequest(pClient->m_aQueue[(pClient->m_uHead + pClient->m_uCount++) % QueueDepth]);
+
+    memcpy(rRequest.m_auchFrame, puchFrame, stFrame);
+    rRequest.m_stFrame = stFrame;
+    rRequest.m_uQueued = micros();
+    return true;
+  }
+
+  bool isBusy(void) const {  // A request is outstanding on the radio link
+    return m_pOutstanding != 0;
+  }
+
+  bool isPending(void) const {
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      if (m_aClients[nIndex].m_uCount) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool expire(void) {  // True if the outstanding request timed out
+    if (m_pOutstanding
+        && m_Outstanding >= TimeoutMillis) {
+      m_pOutstanding->m_ulTimeouts++;
+      m_pOutstanding = 0;
+      return true;
+    }
+    return false;
+  }
+
+  bool dispatch(void) {  // Next client's request to the radio, the caller holds the radio while it's written
+    Threads::Scope wait(m_Mutex);
+
+    for (size_t nTurn(0); !m_pOutstanding && nTurn < MaxClients; nTurn++) {
+      SClient& rClient(m_aClients[m_uNext]);
+
+      m_uNext = (m_uNext + 1) % MaxClients;
+      if (rClient.m_pDevice
+          && rClient.m_uCount) {
+        send(rClient);
+      }
+    }
+    return m_pOutstanding != 0;
+  }
+
+  bool onFrame(const CICOMResp& rFrame) {  // True if the frame was a reply to a client request
+    const uint8_t uchTo(rFrame.ToAddress());
+
+    if (uchTo < AddressBase
+        || uchTo >= AddressBase + MaxClients) {
+      return false;
+    }
+
+    SClient& rClient(m_aClients[uchTo - AddressBase]);
+
+    if (m_pOutstanding != &rClient) {
+      m_ulLate++;  // Reply to a request that already timed out
+      return true;
+    }
+
+    const uint32_t uNow(micros());
+    const size_t   stFrame(rFrame);
+    uint8_t        auchFrame[FrameBytes];
+
+    if (stFrame <= sizeof auchFrame) {
+      memcpy(auchFrame, static_cast<const uint8_t*>(rFrame), stFrame);
+      auchFrame[2] = rClient.m_uchAddress;
+      rClient.m_pDevice->write(auchFrame, stFrame);
+      CAPTURE_FRAME(*rClient.m_pDevice, CaptureTx, auchFrame, stFrame);
+    }
+    rClient.m_ulResponses++;
+    rClient.m_Wait.add(m_uSent - m_uQueued);
+    rClient.m_RoundTrip.add(uNow - m_uSent);
+    m_pOutstanding = 0;
+    return true;
+  }
+
+  void printStatus(Print& rDevice) const {
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      const SClient& rClient(m_aClients[nIndex]);
+
+      if (rClient.m_pDevice) {
+        rDevice.printf("CI-V %-8s    %02X as %02X, %lu requests %lu replies %lu timeouts %lu rejected\r\n",
+                       rClient.m_pDevice->deviceName().c_str(), rClient.m_uchAddress, unsigned(AddressBase + nIndex),
+                       rClient.m_ulRequests, rClient.m_ulResponses, rClient.m_ulTimeouts, rClient.m_ulRejected);
+        rDevice.printf("                queued us %lu/%lu/%lu, round trip us %lu/%lu/%lu (min/avg/max)\r\n",
+                       rClient.m_Wait.m_ulMin, rClient.m_Wait.average(), rClient.m_Wait.m_ulMax,
+                       rClient.m_RoundTrip.m_ulMin, rClient.m_RoundTrip.average(), rClient.m_RoundTrip.m_ulMax);
+      }
+    }
+    if (m_ulLate) {
+      rDevice.printf("CI-V late       %lu replies\r\n", m_ulLate);
+    }
+  }
+
+private:
+  struct SLatency {
+    uint32_t m_ulMin;
+    uint32_t m_ulMax;
+    uint64_t m_ullTotal;
+    uint32_t m_ulCount;
+
+    void add(uint32_t ulMicros) {
+      if (!m_ulCount || ulMicros < m_ulMin) {
+        m_ulMin = ulMicros;
+      }
+      if (ulMicros > m_ulMax) {
+        m_ulMax = ulMicros;
+      }
+      m_ullTotal += ulMicros;
+      m_ulCount++;
+    }
+    uint32_t average(void) const {
+      return (m_ulCount) ? uint32_t(m_ullTotal / m_ulCount) : 0;
+    }
+  };
+
+  struct SRequest {
+    uint8_t  m_auchFrame[FrameBytes];
+    size_t   m_stFrame;
+    uint32_t m_uQueued;
+  };
+
+  struct SClient {
+    CSerialDevice* m_pDevice;
+    SRequest       m_aQueue[QueueDepth];
+    unsigned       m_uHead;
+    unsigned       m_uCount;
+    uint8_t        m_uchAddress;  // Controller address of the request on the link, restored in its reply
+    uint32_t       m_ulRequests;
+    uint32_t       m_ulResponses;
+    uint32_t       m_ulTimeouts;
+    uint32_t       m_ulRejected;
+    SLatency       m_Wait;
+    SLatency       m_RoundTrip;
+  };
+
+  SClient* client(CSerialDevice& rDevice) {
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      if (m_aClients[nIndex].m_pDevice == &rDevice) {
+        return &m_aClients[nIndex];
+      }
+    }
+    for (size_t nIndex(0); nIndex < MaxClients; nIndex++) {
+      if (!m_aClients[nIndex].m_pDevice) {
+        m_aClients[nIndex].m_pDevice = &rDevice;
+        return &m_aClients[nIndex];
+      }
+    }
+    return 0;
+  }
+
+  void send(SClient& rClient) {
+    SRequest& rRequest(rClient.m_aQueue[rClient.m_uHead]);
+
+    rClient.m_uHead = (rClient.m_uHead + 1) % QueueDepth;
+    rClient.m_uCount--;
+    rClient.m_uchAddress = rRequest.m_auchFrame[3];
+    rRequest.m_auchFrame[3] = AddressBase + (&rClient - m_aClients);
+    rClient.m_ulRequests++;
+    m_uQueued = rRequest.m_uQueued;
+    m_uSent = micros();
+    m_Outstanding = 0;
+    m_pOutstanding = &rClient;
+    m_rRadio.write(rRequest.m_auchFrame, rRequest.m_stFrame);
+  }
+
+private:
+  CSerialDevice& m_rRadio;
+  SClient        m_aClients[MaxClients];
+  size_t         m_uNext;
+  SClient*       m_pOutstanding;
+  elapsedMillis  m_Outstanding;
+  uint32_t       m_uQueued;
+  uint32_t       m_uSent;
+  uint32_t       m_ulLate;
+  Threads::Mutex m_Mutex;
+};
+#endif
@@ -0,0 +1,209 @@
+#include <Arduino.h>
+
+#include "Capture.h"
+
+static DMAMEM uint8_t aCaptureBuffer[CCapture::BufferBytes];
+
+volatile bool            CCapture::m_fCapturing(false);
+size_t                   CCapture::m_stUsed(0);
+size_t                   CCapture::m_stSent(0);
+uint32_t                 CCapture::m_uDropped(0);
+uint32_t                 CCapture::m_uFrames(0);
+Print*                   CCapture::m_pStreamDevice(0);
+CCapture::ReplayHandler  CCapture::m_pReplayHandler(0);
+uint8_t                  CCapture::m_uchReplayPort(CCapture::PortUnknown);
+#if defined USE_THREADS
+Threads::Mutex CCapture::m_Mutex;
+#endif
+
+CCapture::ePort CCapture::port(const Stream& rStream) {
+  static const Stream* const apStreams[] = {
+    &Serial1, &Serial2, &Serial3, &Serial4, &Serial5, &Serial6, &Serial7, &Serial8,
+    &Serial,
+#if defined DUAL_SERIAL
+    &SerialUSB1,
+#else
+    0,
+#endif
+  };
+  const int iUSBHostPort(CHardplaceUSBHost::serialPortIndex(rStream));
+
+  for (size_t nIndex(0); nIndex < sizeof apStreams / sizeof apStreams[0]; nIndex++) {
+    if (apStreams[nIndex] == &rStream) {
+      return ePort(PortSerial1 + nIndex);
+    }
+  }
+  return (iUSBHostPort >= 0) ? ePort(PortUSBHost1 + iUSBHostPort) : PortUnknown;
+}
+
+bool CCapture::append(const void* pvData, size_t stData) {
+  if (m_stUsed + stData > BufferBytes) {
+    return false;
+  }
+  memcpy(&aCaptureBuffer[m_stUsed], pvData, stData);
+  m_stUsed += stData;
+  return true;
+}
+
+void CCapture::capture(const CSerialStream& rDevice, eDirection eDir, const uint8_t* puchData, size_t stData) {
+  SCaptureRecord Record;
+
+  if (!puchData || !stData) {
+    return;
+  }
+  Record.m_uTimestamp = micros();
+  Record.m_uchPort = port(rDevice.stream());
+  Record.m_uchFlags = eDir;
+  Record.m_uLength = (stData > UINT16_MAX) ? UINT16_MAX : stData;
+
+#if defined USE_THREADS
+  Threads::Scope wait(m_Mutex);
+#endif
+  if (!m_fCapturing) {
+    return;
+  }
+  if (m_stUsed + sizeof Record + Record.m_uLength > BufferBytes
+      && m_pStreamDevice
+      && m_stSent == m_stUsed) {  // Everything streamed, start over after the stream header
+    m_stUsed = m_stSent = HeaderBytes;
+  }
+  if (m_stUsed + sizeof Record + Record.m_uLength > BufferBytes) {
+    m_uDropped++;
+  } else {
+    append(&Record, sizeof Record);
+    append(puchData, Record.m_uLength);
+    m_uFrames++;
+  }
+}
+
+void CCapture::start(Print* pStreamDevice) {
+  const uint16_t uRecordSize(sizeof(SCaptureRecord));
+  const uint8_t  auchVersion[2] = { Version, 0 };
+
+  stop();
+  m_fCapturing = false;
+  m_stUsed = m_stSent = 0;
+  m_uDropped = m_uFrames = 0;
+  m_pStreamDevice = pStreamDevice;
+  append("HPCP", 4);
+  append(auchVersion, sizeof auchVersion);
+  append(&uRecordSize, sizeof uRecordSize);
+  m_fCapturing = true;
+}
+
+void CCapture::stop(void) {
+  if (m_fCapturing) {
+#if defined USE_THREADS
+    Threads::Scope wait(m_Mutex);
+#endif
+    m_fCapturing = false;
+    if (m_uDropped) {
+      SCaptureRecord Record;
+
+      Record.m_uTimestamp = micros();
+      Record.m_uchPort = PortMarker;
+      Record.m_uchFlags = 0;
+      Record.m_uLength = sizeof m_uDropped;
+      if (m_stUsed + sizeof Record + sizeof m_uDropped <= BufferBytes) {
+        append(&Record, sizeof Record);
+        append(&m_uDropped, sizeof m_uDropped);
+      }
+    }
+  }
+}
+
+void CCapture::Task(void) {
+  size_t stUsed;
+
+  if (!m_pStreamDevice) {
+    return;
+  }
+  {
+#if defined USE_THREADS
+    Threads::Scope wait(m_Mutex);  // capture() moves m_stUsed, and wraps it when everything was streamed
+#endif
+    stUsed = m_stUsed;
+  }
+  if (m_stSent < stUsed) {
+    size_t stSend(stUsed - m_stSent);
+    int    iRoom(m_pStreamDevice->availableForWrite());
+
+    if (iRoom > 0) {
+      if (stSend > size_t(iRoom)) {
+        stSend = iRoom;
+      }
+      m_stSent += m_pStreamDevice->write(&aCaptureBuffer[m_stSent], stSend);
+    }
+  } else if (!m_fCapturing) {
+    m_pStreamDevice->flush();
+    m_pStreamDevice = 0;  // Streamed the end of the capture
+  }
+}
+
+void CCapture::dump(Print& rDevice) {
+  stop();
+  for (size_t stOffset(0); stOffset < m_stUsed;) {
+    const size_t stChunk((m_stUsed - stOffset > 512) ? 512 : m_stUsed - stOffset);
+
+    stOffset += rDevice.write(&aCaptureBuffer[stOffset], stChunk);
+    Delay(0);
+  }
+  rDevice.flush();
+}
+
+void CCapture::status(Print& rDevice) {
+  rDevice.printf("Capture %s, %lu frames, %lu dropped, %lu of %lu bytes used, %lu streamed\r\n",
+                 (m_fCapturing) ? "running" : "stopped", m_uFrames, m_uDropped,
+                 uint32_t(m_stUsed), uint32_t(BufferBytes), uint32_t(m_stSent));
+}
+
+void CCapture::setReplayHandler(ReplayHandler pHandler, const CSerialStream& rFrom) {
+  m_pReplayHandler = pHandler;
+  m_uchReplayPort = port(rFrom.stream());
+}
+
+void CCapture::dispatch(size_t stOffset, uint32_t& ruFrames, uint32_t& ruBytes) {
+  SCaptureRecord Record;
+
+  memcpy(&Record, &aCaptureBuffer[stOffset], sizeof Record);
+  if (Record.m_uchPort == m_uchReplayPort
+      && Record.m_uchFlags == CaptureRx
+      && stOffset + sizeof Record + Record.m_uLength <= m_stUsed) {
+    m_pReplayHandler(&aCaptureBuffer[stOffset + sizeof Record], Record.m_uLength);
+    ruFrames++, ruBytes += Record.m_uLength;
+  }
+}
+
+void CCapture::replay(Print& rDevice) {
+  const size_t   stFirst(HeaderBytes);
+  uint32_t       uFrames(0);
+  uint32_t       uBytes(0);
+  uint32_t       uStart;
+  uint32_t       uMicros;
+
+  if (m_fCapturing) {
+    rDevice.println("Stop the capture before replaying it");
+    return;
+  }
+  if (!m_pReplayHandler
+      || m_stUsed <= stFirst) {
+    rDevice.println("Nothing to replay");
+    return;
+  }
+  uStart = micros();
+  for (size_t stOffset(stFirst); stOffset + sizeof(SCaptureRecord) <= m_stUsed;) {
+    SCaptureRecord Record;
+
+    memcpy(&Record, &aCaptureBuffer[stOffset], sizeof Record);
+    dispatch(stOffset, uFrames, uBytes);
+    stOffset += sizeof Record + Record.m_uLength;
+  }
+  uMicros = micros() - uStart;
+  rDevice.printf("Replayed %lu frames %lu bytes in %lu us", uFrames, uBytes, uMicros);
+  if (uMicros) {
+    rDevice.printf(", %lu frames/s %lu bytes/s",
+                   uint32_t((uint64_t(uFrames) * 1000000) / uMicros),
+                   uint32_t((uint64_t(uBytes) * 1000000) / uMicros));
+  }
+  rDevice.printf("\r\n");
+}
@@ -0,0 +1,121 @@
+#if !defined CAPTURE_H_DEFINED
+#define CAPTURE_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <Print.h>
+
+#include "Hardplace705Plus.h"
+#include "SerialDevice.h"
+
+/*
+   Packet capture and replay
+
+   Every CI-V and Hardrock frame crossing the IC-705 link, the Hardrock serial ports, the USB host ports and
+   the Bluetooth slaves is time stamped into a DMAMEM capture buffer while a capture is running, and streamed
+   to the device that started the capture as room allows (CCapture::Task()).
+
+   Stream layout, little endian:
+     Header  "HPCP", version (uint8_t), reserved (uint8_t), record header size (uint16_t)
+     Record  micros() (uint32_t), port (ePort), flags (uint8_t, CaptureTx when sent by the Hardplace),
+             length (uint16_t), frame bytes
+   A capture stopped with frames dropped ends with a PortMarker record holding the dropped count (uint32_t).
+
+   "HPCAS;" starts a capture streamed to the issuing port, "HPCAC;" starts one kept in the buffer only,
+   "HPCAE;" ends it, "HPCAD;" dumps the buffer, "HPCA;" reports its status.
+   "HPCAR;" replays the radio frames in the buffer through the IC-705 fan-out back to back and reports the
+   dispatch throughput. The replay is a routing check, frames are decoded and routed but not delivered, so it
+   never sets the PTT enables or writes to the radio or a client, and the captured timing is not reproduced;
+   "HPPS;" then shows how many frames each route would have been handed.
+*/
+
+class CCapture {
+public:
+  enum ePort {
+    PortUnknown,
+    PortSerial1,
+    PortSerial2,
+    PortSerial3,
+    PortSerial4,
+    PortSerial5,
+    PortSerial6,
+    PortSerial7,
+    PortSerial8,
+    PortSerial,
+    PortSerialUSB1,
+    PortUSBHost1,
+    PortUSBHost2,
+    PortUSBHost3,
+    PortUSBHost4,  // ... PortUSBHost1 + USB_SERIAL_PORTS - 1
+    PortMarker = 0xFF
+  };
+
+  enum eDirection {
+    CaptureRx,
+    CaptureTx
+  };
+
+  enum {
+    Version = 1,
+    HeaderBytes = 8,
+    BufferBytes = 64 * 1024
+  };
+
+  struct SCaptureRecord {
+    uint32_t m_uTimestamp;
+    uint8_t  m_uchPort;
+    uint8_t  m_uchFlags;
+    uint16_t m_uLength;
+  };
+
+  typedef void (*ReplayHandler)(const uint8_t* puchFrame, size_t stFrame);
+
+private:
+  CCapture();
+  CCapture(const CCapture&);
+  CCapture& operator=(const CCapture&);
+
+public:
+  static bool capturing(void) {
+    return m_fCapturing;
+  }
+  static void capture(const CSerialStream& rDevice, eDirection eDir, const uint8_t* puchData, size_t stData);
+
+  static void start(Print* pStreamDevice);
+  static void stop(void);
+  static void dump(Print& rDevice);
+  static void status(Print& rDevice);
+  static void Task(void);
+
+  static void setReplayHandler(ReplayHandler pHandler, const CSerialStream& rFrom);
+  static void replay(Print& rDevice);
+
+  static ePort port(const Stream& rStream);
+
+private:
+  static bool append(const void* pvData, size_t stData);
+  static void dispatch(size_t stOffset, uint32_t& ruFrames, uint32_t& ruBytes);
+
+private:
+  static volatile bool m_fCapturing;
+  static size_t        m_stUsed;
+  static size_t        m_stSent;
+  static uint32_t      m_uDropped;
+  static uint32_t      m_uFrames;
+  static Print*        m_pStreamDevice;
+
+  static ReplayHandler m_pReplayHandler;
+  static uint8_t       m_uchReplayPort;
+#if defined USE_THREADS
+  static Threads::Mutex m_Mutex;
+#endif
+};
+
+#define CAPTURE_FRAME(_device_, _direction_, _data_, _length_) \
+  do { \
+    if (CCapture::capturing()) { \
+      CCapture::capture((_device_), CCapture::_direction_, (_data_), (_length_)); \
+    } \
+  } while (0)
+#endif
@@ -0,0 +1,216 @@
+#if !defined CLONEBRIDGE_H_DEFINED
+#define CLONEBRIDGE_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+
+#include "Hardplace705Plus.h"
+#include "SerialDevice.h"
+#include "TraceLog.h"
+
+/*
+   Clone (memory read/write) transfer engine
+
+   A clone read or write request from a client hands both serial devices to the bridge, which pumps the raw byte
+   stream in both directions from CIC_705MasterDevice::Task() until the transfer goes quiet. Each direction is
+   double buffered, one buffer fills from the input while the other drains to the output as fast as the output
+   will take it, so neither side waits on a frame at a time. Frames are counted in-stream (0xFD), the clone end
+   command (0xE5) shortens the idle timeout. Each Task() call is limited to BudgetMicros so PTT management and
+   the other devices keep running during a transfer.
+
+   While the bridge is active both devices are claimed, their own onAvailable() handlers don't run.
+*/
+
+class CCloneBridge {
+public:
+  enum {
+    BufferBytes = 256,
+    BudgetMicros = 500,
+    IdleMillis = 1000,
+    EndIdleMillis = 250
+  };
+
+  enum eCloneCmds {
+    getCloneInfo = 0xE0,
+    CloneInfo,
+    CloneRead,
+    CloneWrite,
+    CloneRecord,
+    CloneEnd
+  };
+
+public:
+  CCloneBridge(CSerialDevice& rRadio)
+    : m_rRadio(rRadio), m_pClient(0), m_ulLastBytes(0), m_ulLastFrames(0), m_ulLastMillis(0) {
+  }
+
+private:
+  CCloneBridge();
+  CCloneBridge(const CCloneBridge&);
+  CCloneBridge& operator=(const CCloneBridge&);
+
+public:
+  static bool isCloneTransfer(const uint8_t* puPacket, size_t stPacket) {
+    return stPacket > 5
+           && puPacket[0] == 0xFE
+           && puPacket[1] == 0xFE
+           && ((puPacket[2] == 0xEF && puPacket[3] == 0xEE)
+               || (puPacket[2] == 0xEE && puPacket[3] == 0xEF))
+           && (puPacket[4] == CloneRead
+               || puPacket[4] == CloneWrite);
+  }
+
+  bool isActive(void) const {
+    return m_pClient != 0;
+  }
+
+  bool start(CSerialDevice& rClient, const uint8_t* puchCmd, size_t stCmd) {
+    if (isActive()) {
+      return false;
+    }
+    m_ToRadio.reset();
+    m_FromRadio.reset();
+    m_pClient = &rClient;
+    m_pClient->claim(true);
+    m_rRadio.claim(true);
+    m_rRadio.stream().write(puchCmd, stCmd);
+    m_ToRadio.m_ulBytes = stCmd, m_ToRadio.m_ulFrames = 1;
+    m_Duration = 0;
+    m_Idle = 0;
+    TRACE_EVENT(TraceCIV, TraceInfo, CloneStart, puchCmd[4], 0);
+    return true;
+  }
+
+  void Task(void) {
+    if (isActive()) {
+      const uint32_t uStart(micros());
+      bool           fMoved(false);
+
+      for (bool fPass(true); fPass && micros() - uStart < BudgetMicros;) {
+        fPass = m_ToRadio.pump(m_pClient->stream(), m_rRadio.stream());
+        fPass = m_FromRadio.pump(m_rRadio.stream(), m_pClient->stream()) || fPass;
+        fMoved = fMoved || fPass;
+      }
+      if (fMoved) {
+        m_Idle = 0;
+      } else if (m_ToRadio.isEmpty()
+                 && m_FromRadio.isEmpty()
+                 && m_Idle >= ((m_ToRadio.m_fEndSeen || m_FromRadio.m_fEndSeen) ? EndIdleMillis : IdleMillis)) {
+        stop();
+      }
+    }
+  }
+
+  void printStatus(Print& rDevice) const {
+    rDevice.printf("Clone           %s, last %lu bytes %lu frames in %lu ms",
+                   (isActive()) ? "active" : "idle", m_ulLastBytes, m_ulLastFrames, m_ulLastMillis);
+    if (m_ulLastMillis) {
+      rDevice.printf(" (%lu bytes/s)", (m_ulLastBytes * 1000) / m_ulLastMillis);
+    }
+    rDevice.printf("\r\n");
+  }
+
+private:
+  void stop(void) {
+    m_ulLastBytes = m_ToRadio.m_ulBytes + m_FromRadio.m_ulBytes;
+    m_ulLastFrames = m_ToRadio.m_ulFrames + m_FromRadio.m_ulFrames;
+    m_ulLastMillis = m_Duration - m_Idle;
+    m_rRadio.claim(false);
+    m_pClient->claim(false);
+    m_pClient = 0;
+    TRACE_EVENT(TraceCIV, TraceInfo, CloneComplete, m_ulLastBytes, m_ulLastMillis);
+  }
+
+  struct SPump {
+    uint8_t  m_aauchBuf[2][BufferBytes];
+    size_t   m_astFill[2];
+    unsigned m_uFill;      // Buffer being filled, the other one drains
+    size_t   m_stDrained;  // Bytes of the draining buffer already written
+    unsigned m_uFramePos;  // Bytes since the last 0xFD
+    uint32_t m_ulBytes;
+    uint32_t m_ulFrames;
+    bool     m_fEndSeen;
+
+    void reset(void) {
+      m_astFill[0] = m_astFill[1] = 0;
+      m_uFill = 0, m_stDrained = 0, m_uFramePos = 0;
+      m_ulBytes = m_ulFrames = 0;
+      m_fEndSeen = false;
+    }
+    bool isEmpty(void) const {
+      return m_astFill[0] == 0 && m_astFill[1] == 0;
+    }
+    bool pump(Stream& rIn, Stream& rOut) {
+      const unsigned uDrain(m_uFill ^ 1);
+      bool           fMoved(false);
+
+      if (m_stDrained < m_astFill[uDrain]) {
+        const int iRoom(rOut.availableForWrite());
+
+        if (iRoom > 0) {
+          size_t stWrite(m_astFill[uDrain] - m_stDrained);
+
+          if (stWrite > size_t(iRoom)) {
+            stWrite = iRoom;
+          }
+          m_stDrained += rOut.write(&m_aauchBuf[uDrain][m_stDrained], stWrite);
+          fMoved = true;
+        }
+      }
+      if (m_stDrained >= m_astFill[uDrain]) {
+        m_astFill[uDrain] = 0, m_stDrained = 0;
+      }
+
+      const int iAvailable(rIn.available());
+
+      if (iAvailable > 0
+          && m_astFill[m_uFill] < BufferBytes) {
+        uint8_t* puchFill(&m_aauchBuf[m_uFill][m_astFill[m_uFill]]);
+        size_t   stRead(BufferBytes - m_astFill[m_uFill]);
+
+        if (stRead > size_t(iAvailable)) {
+          stRead = iAvailable;
+        }
+        stRead = rIn.readBytes(reinterpret_cast<char*>(puchFill), stRead);
+        scan(puchFill, stRead);
+        m_astFill[m_uFill] += stRead;
+        m_ulBytes += stRead;
+        fMoved = fMoved || stRead > 0;
+      }
+      if (m_astFill[uDrain] == 0
+          && m_astFill[m_uFill] > 0) {  // Swap, drain what was filled
+        m_uFill = uDrain;
+        m_astFill[m_uFill] = 0;
+      }
+      return fMoved;
+    }
+    void scan(const uint8_t* puchData, size_t stData) {  // Frame boundaries, in-stream
+      for (size_t nIndex(0); nIndex < stData; nIndex++) {
+        if (puchData[nIndex] == 0xFD) {
+          m_ulFrames++;
+          m_uFramePos = 0;
+        } else {
+          if (m_uFramePos == 4
+              && puchData[nIndex] == CloneEnd) {
+            m_fEndSeen = true;
+          }
+          m_uFramePos++;
+        }
+      }
+    }
+  };
+
+private:
+  CSerialDevice& m_rRadio;
+  CSerialDevice* m_pClient;
+  SPump          m_ToRadio;
+  SPump          m_FromRadio;
+  elapsedMillis  m_Duration;
+  elapsedMillis  m_Idle;
+  uint32_t       m_ulLastBytes;
+  uint32_t       m_ulLastFrames;
+  uint32_t       m_ulLastMillis;
+};
+#endif
@@ -1,56 +1,431 @@
 #include "EEPromStream.h"
 
-static class CEEPROMSCompactor : public CEEPROMStream {
-  public:
-  CEEPROMSCompactor() : CEEPROMStream(Master, VER_MASTER) {
-    compact();
-  }
-  
-} _compact;
-
-bool CEEPROMStream::compact(void) {
-  bool fCompacted(false);
-  size_t stLength(CEEPROMStream().end());
-
-  if (stLength) {
-    uint8_t* pBuffer(new uint8_t[stLength]);
-    uint8_t* pDest(pBuffer);
-    sHeader Header;
-
-    memset(pBuffer, 0xFF, stLength);
-    readHeader(0, Header);
-    if (Header.m_uchRecordType != Master) {
-      CEEPROMStream().clear();
-      stLength = CEEPROMStream().end();
-    }
-    for (int iAddress(0); iAddress < static_cast<int>(stLength);) {
-      readHeader(iAddress, Header);
-      if (Header.m_uchRecordType != Invalid
-          && Header.m_uchRecordType != Free
-          && Header.m_uchRecordType != Eof) {
-        for (int iIter(0); iIter < static_cast<int>(Header.m_usRecordLen); iIter++) {
-          *pDest++ = EEPROM.read(iAddress++);
-        }
+const size_t   CEEPROMStream::m_stHeader;
+const uint32_t CEEPROMStream::m_ulMagic;
+CEEPROMStream* CEEPROMStream::m_apStreams[CEEPROMStream::MaxStreams];
+size_t         CEEPROMStream::m_nStreams(0);
+uint8_t        CEEPROMStream::m_auchStage[CEEPROMStream::StageBytes];
+size_t         CEEPROMStream::m_stStage(0);
+uint8_t        CEEPROMStream::m_auchImage[CEEPROMStream::ImageBytes];
+uint32_t       CEEPROMStream::m_auWriteBack[(CEEPROMStream::ImageBytes + 31) / 32];
+uint32_t       CEEPROMStream::m_auLate[(CEEPROMStream::ImageBytes + 31) / 32];
+size_t         CEEPROMStream::m_cWriteBack(0);
+size_t         CEEPROMStream::m_cLate(0);
+bool           CEEPROMStream::m_fLoaded(false);
+int            CEEPROMStream::m_iLength(0);
+int16_t        CEEPROMStream::m_aiDirectory[256];
+int            CEEPROMStream::m_iEnd(0);
+size_t         CEEPROMStream::m_cRecords(0);
+bool           CEEPROMStream::m_fIndexed(false);
+elapsedMillis  CEEPROMStream::m_Compact;
+uint32_t       CEEPROMStream::m_ulLoadMicros(0);
+uint32_t       CEEPROMStream::m_ulIndexMicros(0);
+uint32_t       CEEPROMStream::m_ulIndexBuilds(0);
+uint32_t       CEEPROMStream::m_ulLookups(0);
+uint32_t       CEEPROMStream::m_ulRequests(0);
+uint32_t       CEEPROMStream::m_ulCommits(0);
+uint32_t       CEEPROMStream::m_ulStores(0);
+uint32_t       CEEPROMStream::m_ulBytesWritten(0);
+uint32_t       CEEPROMStream::m_ulMoves(0);
+uint32_t       CEEPROMStream::m_ulCRCErrors(0);
+uint32_t       CEEPROMStream::m_ulOverflows(0);
+uint32_t       CEEPROMStream::m_ulFull(0);
+
+void CEEPROMStream::Task(void) {
+  bool fPending(false);
+
+  for (size_t nIndex(0); nIndex < m_nStreams; nIndex++) {
+    CEEPROMStream& rStream(*m_apStreams[nIndex]);
+
+    if (rStream.m_fDirty) {
+      if (rStream.m_Quiet >= QuietMillis
+          || rStream.m_Deferred >= MaxDeferMillis) {
+        rStream.commit();
+        return;  // One commit per pass
+      }
+      fPending = true;
+    }
+  }
+  if (m_cWriteBack || m_cLate) {
+    writeBack(WriteBackBytes);
+  } else if (!fPending
+             && m_Compact >= CompactMillis) {
+    m_Compact = 0;
+    compactStep();
+  }
+}
+
+void CEEPROMStream::commitAll(void) {
+  for (size_t nIndex(0); nIndex < m_nStreams; nIndex++) {
+    if (m_apStreams[nIndex]->m_fDirty) {
+      m_apStreams[nIndex]->commit();
+    }
+  }
+  while (writeBack(ImageBytes)) {
+  }
+}
+
+void CEEPROMStream::discardAll(void) {
+  for (size_t nIndex(0); nIndex < m_nStreams; nIndex++) {
+    m_apStreams[nIndex]->m_fDirty = false;
+  }
+}
+
+void CEEPROMStream::erase(void) {
+  for (int iAddress(0); iAddress < length(); iAddress++) {
+    update(iAddress, 0xFF);
+  }
+  m_fIndexed = false;
+}
+
+void CEEPROMStream::load(void) {  // Once, by the first stream
+  const uint32_t uStart(micros());
+
+  m_iLength = (EEPROM.length() < ImageBytes) ? EEPROM.length() : ImageBytes;
+  for (int iAddress(0); iAddress < m_iLength; iAddress++) {
+    m_auchImage[iAddress] = EEPROM.read(iAddress);
+  }
+  m_fLoaded = true;
+  m_ulLoadMicros = micros() - uStart;
+}
+
+void CEEPROMStream::index(void) {  // One pass over the image
+  const uint32_t uStart(micros());
+  sHeader        Header;
+  int            iAddress(0);
+
+  for (size_t nType(0); nType < sizeof m_aiDirectory / sizeof m_aiDirectory[0]; nType++) {
+    m_aiDirectory[nType] = -1;
+  }
+  m_cRecords = 0;
+  for (; iAddress < length(); iAddress += Header.m_usRecordLen) {
+    readHeader(iAddress, Header);
+    if (!isRecord(Header)
+        || iAddress + Header.m_usRecordLen > length()) {
+      break;
+    }
+    m_cRecords++;
+    if (Header.m_uchRecordType != Free
+        && Header.m_uchRecordType != Invalid) {
+      if (!isIntact(iAddress, Header)) {
+        m_ulCRCErrors++;
+        update(iAddress + sizeof m_ulMagic, Free, true);  // A copy cut short, the one before it stands
       } else {
-        fCompacted = true;
-        iAddress += static_cast<int>(Header.m_usRecordLen);
+        if (m_aiDirectory[Header.m_uchRecordType] >= 0) {  // Its replacement made it, the cut came before it was freed
+          update(m_aiDirectory[Header.m_uchRecordType] + sizeof m_ulMagic, Free, true);
+        }
+        m_aiDirectory[Header.m_uchRecordType] = iAddress;
+      }
+    }
+  }
+  m_iEnd = iAddress;
+  m_fIndexed = true;
+  m_ulIndexBuilds++;
+  m_ulIndexMicros = micros() - uStart;
+}
+
+size_t CEEPROMStream::writeBack(size_t stMaxBytes) {  // Marked bytes to the EEPROM, the late ones last
+  size_t stWritten(0);
+
+  for (uint32_t* puMarks(m_auWriteBack); puMarks; puMarks = (puMarks == m_auWriteBack && !m_cWriteBack) ? m_auLate : 0) {
+    size_t& rcMarked((puMarks == m_auWriteBack) ? m_cWriteBack : m_cLate);
+
+    for (size_t nWord(0); rcMarked && nWord < (ImageBytes + 31) / 32; nWord++) {
+      for (uint32_t uMarks(puMarks[nWord]); uMarks; uMarks &= uMarks - 1) {
+        const int iAddress(nWord * 32 + __builtin_ctz(uMarks));
+
+        if (stWritten >= stMaxBytes) {
+          return stWritten;
+        }
+        if (EEPROM.read(iAddress) != m_auchImage[iAddress]) {
+          EEPROM.write(iAddress, m_auchImage[iAddress]);
+          m_ulBytesWritten++;
+        }
+        puMarks[nWord] &= ~(uint32_t(1) << (iAddress % 32));
+        rcMarked--;
+        stWritten++;
+      }
+    }
+  }
+  return stWritten;
+}
+
+void CEEPROMStream::putFields(const SField* pFields, size_t cFields) {
+  rewind();
+  for (size_t nField(0); nField < cFields; nField++) {
+    const SField& rField(pFields[nField]);
+
+    put(rField.m_uchId);
+    if (rField.m_uchSize) {
+      put(rField.m_uchSize);
+      for (size_t nByte(0); nByte < rField.m_uchSize; nByte++) {
+        put(static_cast<const uint8_t*>(rField.m_pData)[nByte]);
+      }
+    } else {
+      const String& sString(*static_cast<const String*>(rField.m_pData));
+      const uint8_t uchLength((sString.length() < 255) ? sString.length() : 255);
+
+      put(uchLength);
+      for (size_t nByte(0); nByte < uchLength; nByte++) {
+        put(sString.charAt(nByte));
       }
     }
-    if (fCompacted) {
-      for (int iAddress(0); iAddress < static_cast<int>(stLength); iAddress++) {
-        EEPROM.update(iAddress, pBuffer[iAddress]);
+  }
+  flush();
+}
+
+void CEEPROMStream::getFields(const SField* pFields, size_t cFields) {
+  sHeader Header;
+
+  if (!m_fHeader) {
+    return;
+  }
+  readHeader(m_iIndexHeader, Header);
+  rewind();
+
+  const int iEnd(m_iIndexHeader + Header.m_usRecordLen - ((Header.m_uchVersion & CRCFlag) ? sizeof(uint16_t) : 0));
+
+  while (m_iIndexNext + 2 <= iEnd) {
+    const uint8_t uchId(read(m_iIndexNext++));
+
+    if (uchId == EndOfFields) {
+      break;
+    }
+
+    const uint8_t uchLength(read(m_iIndexNext++));
+    const int     iNext(m_iIndexNext + uchLength);
+
+    if (iNext > iEnd) {
+      break;
+    }
+    for (size_t nField(0); nField < cFields; nField++) {
+      const SField& rField(pFields[nField]);
+
+      if (rField.m_uchId == uchId) {
+        if (rField.m_uchSize) {
+          for (size_t nByte(0); nByte < uchLength && nByte < rField.m_uchSize; nByte++) {
+            static_cast<uint8_t*>(rField.m_pData)[nByte] = read(m_iIndexNext + nByte);
+          }
+        } else {
+          String& sString(*static_cast<String*>(rField.m_pData));
+
+          sString = String();
+          for (size_t nByte(0); nByte < uchLength && read(m_iIndexNext + nByte); nByte++) {
+            sString += char(read(m_iIndexNext + nByte));
+          }
+        }
+        break;
       }
     }
+    m_iIndexNext = iNext;
+  }
+}
+
+void CEEPROMStream::store(void) {  // A new copy after the chain, the old one is freed once it's written back
+  const uint16_t uNeeded(m_stHeader + m_stStage + sizeof(uint16_t));
+  const uint8_t  uchVersion(m_uchVersion | CRCFlag);
+  uint16_t       uCRC(0xFFFF);
+
+  for (size_t nIndex(0); nIndex < m_stStage; nIndex++) {
+    uCRC = crc16(uCRC, m_auchStage[nIndex]);
+  }
+  if (isUnchanged(uNeeded, uchVersion, uCRC)) {
+    m_iIndexNext = m_iIndexHeader + m_stHeader;
+    return;
+  }
+  for (bool fMoved(true); fMoved && end() + uNeeded + sizeof(uint32_t) > size_t(length());) {
+    while (writeBack(ImageBytes)) {  // Each step is on the EEPROM before the next one reuses its space
+    }
+    fMoved = compactStep();
+  }
+
+  const int iAddress(end());
+
+  if (iAddress + uNeeded + sizeof(uint32_t) > size_t(length())) {
+    m_ulFull++;
+    TRACE_EVENT(TraceConfig, TraceError, EEPROMCommitFailed, m_uchRecordType, uNeeded);
+    return;
+  }
+  endChain(iAddress + uNeeded);
+
+  const int iCRC(iAddress + uNeeded - sizeof(uint16_t));
+
+  for (size_t nIndex(0); nIndex < m_stStage; nIndex++) {
+    update(iAddress + m_stHeader + nIndex, m_auchStage[nIndex]);
+  }
+  update(iCRC, uCRC & 0xFF);
+  update(iCRC + 1, uCRC >> 8);
+
+  const int  iOld(m_iIndexHeader);
+  const bool fOld(m_fHeader);
+
+  writeHeader(iAddress, m_uchRecordType, uchVersion, uNeeded);
+  if (fOld) {
+    update(iOld + sizeof m_ulMagic, Free, true);  // Once the new copy is written back
+  }
+  m_fHeader = true;
+  m_iIndexNext = m_iIndexHeader + m_stHeader;
+  m_ulStores++;
+}
+
+bool CEEPROMStream::isUnchanged(uint16_t uRecordLen, uint8_t uchVersion, uint16_t uCRC) const {
+  sHeader Header;
+
+  if (!m_fHeader) {
+    return false;
+  }
+  readHeader(m_iIndexHeader, Header);
+  if (Header.m_uchVersion != uchVersion
+      || Header.m_usRecordLen != uRecordLen) {
+    return false;
+  }
+  for (size_t nIndex(0); nIndex < m_stStage; nIndex++) {
+    if (read(m_iIndexHeader + m_stHeader + nIndex) != m_auchStage[nIndex]) {
+      return false;
+    }
+  }
+
+  const int iCRC(m_iIndexHeader + uRecordLen - sizeof(uint16_t));
+
+  return (read(iCRC) | (read(iCRC + 1) << 8)) == uCRC;
+}
+
+void CEEPROMStream::endChain(int iAddress) {  // Erased on the EEPROM before a record is linked in front of it
+  bool fErased(true);
+
+  for (size_t nIndex(0); nIndex < sizeof(uint32_t); nIndex++) {
+    const int iByte(iAddress + nIndex);
+
+    if (iByte < length()
+        && (read(iByte) != 0xFF
+            || isMarked(m_auWriteBack, iByte))) {
+      update(iByte, 0xFF);
+      fErased = false;
+    }
+  }
+  if (!fErased) {  // Not yet, a cut after the copy but before its end was erased would link whatever was there
+    while (writeBack(ImageBytes)) {
+    }
+  }
+}
+
+void CEEPROMStream::copyRecord(int iFrom, const sHeader& rHeader, int iTo, uint16_t uRecordLen) {
+  // The body and version, padded to uRecordLen with its CRC redone, the caller links it in
+  const bool fCRC((rHeader.m_uchVersion & CRCFlag) != 0);
+  const int  iBody(rHeader.m_usRecordLen - m_stHeader - ((fCRC) ? sizeof(uint16_t) : 0));
+  const int  iCRC(iTo + uRecordLen - ((fCRC) ? sizeof(uint16_t) : 0));
+  uint16_t   uCRC(0xFFFF);
+
+  for (int iByte(iTo + m_stHeader), nIndex(0); iByte < iCRC; iByte++, nIndex++) {
+    const uint8_t uchByte((nIndex < iBody) ? read(iFrom + m_stHeader + nIndex) : 0xFF);
+
+    update(iByte, uchByte);
+    uCRC = crc16(uCRC, uchByte);
+  }
+  if (fCRC) {
+    update(iCRC, uCRC & 0xFF);
+    update(iCRC + 1, uCRC >> 8);
+  }
+  updateValue(iTo, m_ulMagic);
+  update(iTo + sizeof m_ulMagic + sizeof(uint8_t), rHeader.m_uchVersion);
+}
 
-    delete[] pBuffer;
+bool CEEPROMStream::compactStep(void) {  // The record after the first free one is copied down, then freed
+  sHeader Header;
+  sHeader Next;
+  int     iFree(0);
+
+  if (m_cWriteBack || m_cLate) {
+    return false;  // Space is only reused once the copy that freed it is on the EEPROM
+  }
+  for (;; iFree += Header.m_usRecordLen) {
+    readHeader(iFree, Header);
+    if (!isRecord(Header)) {
+      return false;  // Nothing to reclaim
+    }
+    if (Header.m_uchRecordType == Free
+        || Header.m_uchRecordType == Invalid) {
+      break;
+    }
   }
-  return fCompacted;
+
+  const int iNext(iFree + Header.m_usRecordLen);
+  const int iEnd(end());
+
+  m_fIndexed = false;
+  readHeader(iNext, Next);
+  if (!isRecord(Next)) {  // Free space at the end, erased from its magic on, the chain ends there
+    for (int iByte(iFree); iByte < iNext + int(sizeof(uint32_t)); iByte++) {
+      update(iByte, 0xFF);
+    }
+    return false;
+  }
+  if (Next.m_uchRecordType == Free
+      || Next.m_uchRecordType == Invalid) {  // Merge
+    updateValue(iFree + sizeof(uint32_t) + 2 * sizeof(uint8_t), uint16_t(Header.m_usRecordLen + Next.m_usRecordLen));
+    return true;
+  }
+
+  int iCopy(iFree);
+
+  if (Next.m_usRecordLen > Header.m_usRecordLen) {  // Doesn't fit the hole, to the end
+    iCopy = iEnd;
+    if (iCopy + Next.m_usRecordLen + sizeof(uint32_t) > size_t(length())) {
+      return false;
+    }
+    endChain(iCopy + Next.m_usRecordLen);
+    copyRecord(iNext, Next, iCopy, Next.m_usRecordLen);
+    update(iCopy + sizeof m_ulMagic, Next.m_uchRecordType);
+    updateValue(iCopy + sizeof m_ulMagic + 2 * sizeof(uint8_t), Next.m_usRecordLen);
+  } else if (Header.m_usRecordLen - Next.m_usRecordLen >= int(m_stHeader)
+             && (Header.m_usRecordLen >> 8) == (Next.m_usRecordLen >> 8)) {
+    // Into the front of the hole, the rest stays free. Only the type and the low length byte of the hole's
+    // header change, after the copy and the new free header are written back.
+    const int iRest(iFree + Next.m_usRecordLen);
+
+    copyRecord(iNext, Next, iCopy, Next.m_usRecordLen);
+    updateValue(iRest, m_ulMagic);
+    update(iRest + sizeof m_ulMagic, Free);
+    update(iRest + sizeof m_ulMagic + sizeof(uint8_t), 0);
+    updateValue(iRest + sizeof m_ulMagic + 2 * sizeof(uint8_t), uint16_t(Header.m_usRecordLen - Next.m_usRecordLen));
+    update(iCopy + sizeof m_ulMagic, Next.m_uchRecordType, true);
+    update(iCopy + sizeof m_ulMagic + 2 * sizeof(uint8_t), Next.m_usRecordLen & 0xFF, true);
+  } else {  // Padded out to the whole hole, only the type byte changes
+    copyRecord(iNext, Next, iCopy, Header.m_usRecordLen);
+    update(iCopy + sizeof m_ulMagic, Next.m_uchRecordType, true);
+  }
+  update(iNext + sizeof m_ulMagic, Free, true);  // Once the copy is written back
+
+  for (size_t nIndex(0); nIndex < m_nStreams; nIndex++) {
+    CEEPROMStream& rStream(*m_apStreams[nIndex]);
+
+    if (rStream.m_fHeader
+        && rStream.m_iIndexHeader == iNext) {
+      rStream.m_iIndexNext += iCopy - iNext;
+      rStream.m_iIndexHeader = iCopy;
+    }
+  }
+  m_ulMoves++;
+  return true;
+}
+
+void CEEPROMStream::printStatus(Print& rDevice) {
+  const uint64_t ullMillis(millis());
+  const uint32_t ulStoresHour((ullMillis) ? uint32_t((uint64_t(m_ulStores) * 3600000) / ullMillis) : 0);
+  const uint32_t ulBytesHour((ullMillis) ? uint32_t((uint64_t(m_ulBytesWritten) * 3600000) / ullMillis) : 0);
+
+  rDevice.printf("EEPROM          %lu changes, %lu commits, %lu stores, %lu bytes written (%lu stores/h %lu bytes/h)\r\n",
+                 m_ulRequests, m_ulCommits, m_ulStores, m_ulBytesWritten, ulStoresHour, ulBytesHour);
+  rDevice.printf("                %d of %d bytes used, %u records, %u bytes to write back, %lu moved, %lu CRC errors, %lu overflows, %lu full\r\n",
+                 end(), length(), unsigned(m_cRecords), unsigned(m_cWriteBack + m_cLate), m_ulMoves, m_ulCRCErrors, m_ulOverflows, m_ulFull);
+  rDevice.printf("                image loaded in %lu us, directory built in %lu us (%lu builds), %lu lookups\r\n",
+                 m_ulLoadMicros, m_ulIndexMicros, m_ulIndexBuilds, m_ulLookups);
 }
 
 int CEEPROMStream::readHeader(int iAddress, sHeader& rHeader) {
-  EEPROM.get(iAddress, rHeader.m_ulMagic),       iAddress += sizeof (uint32_t);
-  EEPROM.get(iAddress, rHeader.m_uchRecordType), iAddress += sizeof (uint8_t);
-  EEPROM.get(iAddress, rHeader.m_uchVersion),    iAddress += sizeof (uint8_t);
-  EEPROM.get(iAddress, rHeader.m_usRecordLen),   iAddress += sizeof (uint16_t);
+  read(iAddress, rHeader.m_ulMagic),       iAddress += sizeof (uint32_t);
+  read(iAddress, rHeader.m_uchRecordType), iAddress += sizeof (uint8_t);
+  read(iAddress, rHeader.m_uchVersion),    iAddress += sizeof (uint8_t);
+  read(iAddress, rHeader.m_usRecordLen),   iAddress += sizeof (uint16_t);
   return iAddress;
 }
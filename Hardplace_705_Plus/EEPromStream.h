@@ -2,58 +2,85 @@
 #define EEPROMSTREAM_H
 
 #include <EEPROM.h>
+#include <elapsedMillis.h>
 
 #include "Hardplace705Plus.h"
 #include "Tracer.h"
+#include "TraceLog.h"
 
 #define VER_MASTER 1
 
+/*
+   EEPROM record store
+
+   Records are chained from address 0: magic, record type, version, length (header included), the owner's fields
+   and, when the version carries CRCFlag, a CRC-16 of everything after the header in the last two bytes.
+   The owners describe their fields in a table, field(id, member), and putFields()/getFields() store them as
+   id, length, value. A field that grows reads its old, shorter value into the front of the member and keeps the
+   rest, an id the owner no longer knows is skipped, so a record can gain fields without a wipe. An owner whose
+   record version is older than its own reads the old layout and marks the record dirty, the commit rewrites it.
+
+   The EEPROM is read once, into a RAM image, by the first stream constructed. The same pass builds a directory of
+   the last intact record of each type and the end of the chain, so finding a record is one lookup. Every read
+   after that is served from the image. Writes change the image and mark the byte, Task() writes the marked bytes
+   back WriteBackBytes at a time. Marks made by freeing a record or switching the chain to a copy are written after
+   all the others, so an old copy stays valid until its replacement is on the EEPROM. A power cut before the old
+   copy is freed leaves two intact copies, the later one wins and the earlier is freed; one in the middle of a copy
+   leaves a copy that fails its CRC, it's freed and the old one stands.
+
+   A settings change calls setDirty(), which only marks the record. CEEPROMStream::Task() commits it once it has been
+   quiet for QuietMillis (or dirty for MaxDeferMillis), so a burst of changes costs one commit. A commit runs the
+   owner's Commit() (its Serialize()), put() stages the fields and flush() stores them: a new copy is appended at
+   the end of the chain and the old one freed, a record is never rewritten in place. A commit that changed nothing
+   stores nothing. A record that fails its CRC with no older copy is freed when the directory is built and the owner
+   starts from its defaults, a record written before CRCs were added is read as is and gets one on its next commit.
+
+   Freed records are reclaimed from Task() one step per CompactMillis, while nothing is waiting to be committed or
+   written back. A step copies the record after the first free one down into it, or to the end when it doesn't
+   fit, and frees the original once the copy is written back; adjacent free records are merged and free space at
+   the end is erased, so nothing stale is ever found after the chain.
+*/
+
 class CEEPROMStream {
 public:
-  CEEPROMStream(uint8_t uRecordType, uint8_t uVersion)
-    : m_stHeader(sizeof m_ulMagic + sizeof m_uchRecordType
-                 + sizeof m_uchVersion + sizeof(uint16_t)),
-      m_ulMagic(0xC0DEF00D), m_uchRecordType(uRecordType), m_uchVersion(uVersion),
-      m_iIndexHeader(0), m_iIndexNext(0), m_fHeader(false) {
-    sHeader Header;
+  enum {
+    ImageBytes = E2END + 1,
+    MaxStreams = 8,
+    StageBytes = ImageBytes,  // No record that fits the EEPROM overflows it
+    QuietMillis = 2000,
+    MaxDeferMillis = 30000,
+    CompactMillis = 1000,
+    WriteBackBytes = 32,
+    CRCFlag = 0x80,  // Version bit, the record ends with a CRC
+    EndOfFields = 0xFF  // Erased EEPROM, the padding after the last field
+  };
 
+public:
+  CEEPROMStream(uint8_t uRecordType, uint8_t uVersion)
+    : m_uchRecordType(uRecordType), m_uchVersion(uVersion),
+      m_iIndexHeader(0), m_iIndexNext(0), m_fHeader(false), m_fDirty(false) {
     if (end() == 0) {
       newRecord(Master, VER_MASTER);
       m_iIndexHeader = 0;
       m_iIndexNext = end();
     } else {
-      while (!m_fHeader) {
-        readHeader(m_iIndexHeader, Header);
-        if (Header.m_ulMagic == m_ulMagic) {
-          m_fHeader = Header.m_uchRecordType == m_uchRecordType;
-          if (!m_fHeader) {
-            int iIndexNext(nextRecord());
-
-            if (iIndexNext >= 0) {
-              m_iIndexHeader = iIndexNext;
-              m_iIndexNext = m_iIndexHeader + m_stHeader;
-            } else {
-              m_iIndexHeader = m_iIndexNext = end();
-              break;
-            }
-          }
-        } else {
-          m_iIndexHeader = m_iIndexNext = end();
-          break;
-        }
-      }
+      find();
+    }
+    if (m_nStreams < MaxStreams) {
+      m_apStreams[m_nStreams++] = this;
     }
   }
   virtual ~CEEPROMStream() {
-    flush();
+    for (size_t nIndex(0); nIndex < m_nStreams; nIndex++) {
+      if (m_apStreams[nIndex] == this) {
+        m_apStreams[nIndex] = m_apStreams[--m_nStreams];
+        break;
+      }
+    }
   }
 
 private:
-  CEEPROMStream()
-    : m_stHeader(sizeof m_ulMagic + sizeof m_uchRecordType
-                 + sizeof m_uchVersion + sizeof(uint16_t)),
-      m_ulMagic(0xC0DEF00D), m_uchRecordType(0), m_uchVersion(0),
-      m_iIndexHeader(0), m_iIndexNext(0), m_fHeader(false) {}
+  CEEPROMStream();
   CEEPROMStream(const CEEPROMStream&);
   CEEPROMStream& operator=(const CEEPROMStream&);
 
@@ -81,7 +108,7 @@ public:
       uint8_t* ptr((uint8_t*)&t);
 
       for (int count(sizeof(T)); count; --count) {
-        *ptr++ = EEPROM.read(m_iIndexNext++);
+        *ptr++ = read(m_iIndexNext++);
       }
     }
     return t;
@@ -100,15 +127,14 @@ public:
     return sString;
   }
 
-  template< typename T > const T& put(const T& t) {
+  template< typename T > const T& put(const T& t) {  // Staged, flush() stores the record
     const uint8_t* ptr((const uint8_t*)&t);
 
-    if (!m_fHeader) {
-      newRecord(m_uchRecordType, m_uchVersion);
-      m_fHeader = true;
-    }
     for (int count(sizeof(T)); count; --count) {
-      EEPROM.update(m_iIndexNext++, *ptr++);
+      if (m_stStage < StageBytes) {
+        m_auchStage[m_stStage] = *ptr;
+      }
+      m_stStage++, ptr++;
     }
     return t;
   }
@@ -120,25 +146,41 @@ public:
     return sString;
   }
 
-  void flush(void) {
-    if (m_fHeader) {
-      sHeader  Header;
-      uint16_t uRecordLen(m_iIndexNext - m_iIndexHeader);
+public:
+  struct SField {  // One field of a record's schema
+    uint8_t m_uchId;    // Never reused for anything else
+    uint8_t m_uchSize;  // Bytes, 0 for a String
+    void*   m_pData;
+  };
 
-      if (uRecordLen > m_stHeader) {
-        readHeader(m_iIndexHeader, Header);
+  template< typename T > static SField field(uint8_t uchId, T& t) {
+    static_assert(sizeof(T) <= 255, "A field is at most 255 bytes");
+    SField Field = { uchId, sizeof(T), &t };
 
-        if (uRecordLen > Header.m_usRecordLen) {
-          EEPROM.put(
-            m_iIndexHeader + sizeof m_ulMagic + sizeof m_uchRecordType + sizeof m_uchVersion,
-            uRecordLen);
-        }
-      }
+    return Field;
+  }
+  static SField field(uint8_t uchId, String& sString) {
+    SField Field = { uchId, 0, &sString };
+
+    return Field;
+  }
+
+  void putFields(const SField* pFields, size_t cFields);  // Stores the record, id, length and value per field
+  void getFields(const SField* pFields, size_t cFields);  // Unknown ids are skipped, missing fields keep their values
+
+  void flush(void) {  // Stores the staged fields
+    if (m_stStage > StageBytes) {
+      m_ulOverflows++;
+      TRACE_EVENT(TraceConfig, TraceError, EEPROMCommitFailed, m_uchRecordType, m_stStage);
+    } else if (m_stStage) {
+      store();
     }
+    m_stStage = 0;
   }
 
   void rewind(void) {
     m_iIndexNext = m_iIndexHeader + m_stHeader;
+    m_stStage = 0;
   }
 
   uint8_t Type(void) const {
@@ -152,7 +194,7 @@ public:
     sHeader Header;
 
     readHeader(m_iIndexHeader, Header);
-    return (Header.m_ulMagic == m_ulMagic) ? Header.m_uchVersion : 0;
+    return (Header.m_ulMagic == m_ulMagic) ? (Header.m_uchVersion & ~CRCFlag) : 0;
   }
 
 public:
@@ -161,96 +203,242 @@ public:
   }
 
   int recordLength(void) {
-    int iReturn(0);
+    sHeader Header;
 
     if (m_fHeader) {
-      EEPROM.get(
-        m_iIndexHeader + sizeof m_ulMagic + sizeof m_uchRecordType + sizeof m_uchVersion,
-        iReturn);
+      readHeader(m_iIndexHeader, Header);
     }
-    return iReturn;
+    return Header.m_usRecordLen;
   }
 
   void deleteRecord(void) {
     if (m_fHeader) {
-      EEPROM.update(m_iIndexHeader + sizeof m_ulMagic, Free);
+      update(m_iIndexHeader + sizeof m_ulMagic, Free, true);
+      m_fIndexed = false;
+    }
+  }
+
+  void setDirty(void) {  // Commit() runs from Task() once the record goes quiet
+    if (!m_fDirty) {
+      m_Deferred = 0;
+      m_fDirty = true;
     }
+    m_Quiet = 0;
+    m_ulRequests++;
+  }
+
+  bool isDirty(void) const {
+    return m_fDirty;
   }
 
 public:
   void clear(void) {
-    for (int iAddress = writeHeader(0, Master, 1); iAddress < EEPROM.length(); iAddress++) {
-      EEPROM.update(iAddress, 0xFF);
+    for (int iAddress = writeHeader(0, Master, 1); iAddress < length(); iAddress++) {
+      update(iAddress, 0xFF);
     }
     m_iIndexHeader = 0;
     m_iIndexNext = recordLength();
   }
 
-  static bool compact(void);
+  static void Task(void);
+  static void commitAll(void);   // Commits and writes back everything, before a reboot
+  static void discardAll(void);  // Before the EEPROM is erased
+  static void erase(void);
+  static bool compactStep(void);
+  static void printStatus(Print& rDevice);
+
+protected:
+  virtual void Commit(void) {}  // The owner's Serialize()
 
 private:
-  int end(void) const {
-    int     iAddress(0);
-    sHeader Header;
+  static int length(void) {
+    image();
+    return m_iLength;
+  }
 
-    for (;;) {
-      readHeader(iAddress, Header);
-      if (Header.m_ulMagic == m_ulMagic
-          && Header.m_uchRecordType != Eof) {
-        iAddress += Header.m_usRecordLen;
-      } else {
-        break;
+  static uint8_t* image(void) {
+    if (!m_fLoaded) {
+      load();
+    }
+    return m_auchImage;
+  }
+
+  static uint8_t read(int iAddress) {
+    return (iAddress >= 0 && iAddress < length()) ? image()[iAddress] : 0xFF;
+  }
+
+  template< typename T > static void read(int iAddress, T& t) {
+    uint8_t* ptr((uint8_t*)&t);
+
+    for (int count(sizeof(T)); count; --count) {
+      *ptr++ = read(iAddress++);
+    }
+  }
+
+  static void update(int iAddress, uint8_t uchByte, bool fLate = false) {  // Image now, the EEPROM from Task()
+    if (iAddress >= 0
+        && iAddress < length()
+        && m_auchImage[iAddress] != uchByte) {
+      uint32_t* puMarks((fLate) ? m_auLate : m_auWriteBack);
+
+      m_auchImage[iAddress] = uchByte;
+      if (!isMarked(m_auWriteBack, iAddress)
+          && !isMarked(m_auLate, iAddress)) {
+        puMarks[iAddress / 32] |= uint32_t(1) << (iAddress % 32);
+        ((fLate) ? m_cLate : m_cWriteBack)++;
       }
     }
-    return iAddress;
   }
 
-  int writeHeader(int iAddress, uint8_t uRecordType, uint8_t uVersion) {
-    m_iIndexHeader = m_iIndexNext = iAddress;
+  template< typename T > static void updateValue(int iAddress, const T& t) {
+    const uint8_t* ptr((const uint8_t*)&t);
 
-    EEPROM.put(m_iIndexNext, m_ulMagic), m_iIndexNext += sizeof m_ulMagic;
-    EEPROM.put(m_iIndexNext, uRecordType), m_iIndexNext += sizeof uRecordType;
-    EEPROM.put(m_iIndexNext, uVersion), m_iIndexNext += sizeof uVersion;
-    EEPROM.put(m_iIndexNext, uint16_t(m_stHeader)), m_iIndexNext += sizeof(uint16_t);
-    return m_iIndexNext;
+    for (int count(sizeof(T)); count; --count) {
+      update(iAddress++, *ptr++);
+    }
   }
 
-  static int readHeader(int iAddress, sHeader& rHeader);
+  static bool isMarked(const uint32_t* puMarks, int iAddress) {
+    return (puMarks[iAddress / 32] & (uint32_t(1) << (iAddress % 32))) != 0;
+  }
 
-  int nextRecord(void) const {
-    int     iAddress(m_iIndexHeader);
-    sHeader Header;
+  static void   load(void);
+  static void   index(void);
+  static size_t writeBack(size_t stMaxBytes);
 
-    readHeader(iAddress, Header);
-    if (Header.m_ulMagic == m_ulMagic) {
-      iAddress += Header.m_usRecordLen;
+  static int end(void) {
+    if (!m_fIndexed) {
+      index();
+    }
+    return m_iEnd;
+  }
+
+  void find(void) {
+    int iAddress;
+
+    end();
+    m_ulLookups++;
+    if ((iAddress = m_aiDirectory[m_uchRecordType]) >= 0) {
+      m_iIndexHeader = iAddress;
+      m_iIndexNext = m_iIndexHeader + m_stHeader;
+      m_fHeader = true;
     } else {
-      iAddress = -1;
+      m_iIndexHeader = m_iIndexNext = m_iEnd;
     }
-    return iAddress;
   }
 
+  static bool isIntact(int iAddress, const sHeader& rHeader) {
+    if (!(rHeader.m_uchVersion & CRCFlag)) {
+      return true;  // Written before CRCs
+    }
+    if (rHeader.m_usRecordLen < m_stHeader + sizeof(uint16_t)) {
+      return false;
+    }
+
+    const int iCRC(iAddress + rHeader.m_usRecordLen - sizeof(uint16_t));
+    uint16_t  uCRC(0xFFFF);
+
+    for (int iByte(iAddress + m_stHeader); iByte < iCRC; iByte++) {
+      uCRC = crc16(uCRC, read(iByte));
+    }
+    return (read(iCRC) | (read(iCRC + 1) << 8)) == uCRC;
+  }
+
+  static bool isRecord(const sHeader& rHeader) {
+    return rHeader.m_ulMagic == m_ulMagic
+           && rHeader.m_uchRecordType != Eof
+           && rHeader.m_usRecordLen >= m_stHeader;
+  }
+
+  void store(void);
+  bool isUnchanged(uint16_t uRecordLen, uint8_t uchVersion, uint16_t uCRC) const;
+  static void copyRecord(int iFrom, const sHeader& rHeader, int iTo, uint16_t uRecordLen);
+  static void endChain(int iAddress);
+
+  int writeHeader(int iAddress, uint8_t uRecordType, uint8_t uVersion) {
+    return writeHeader(iAddress, uRecordType, uVersion, m_stHeader);
+  }
+  int writeHeader(int iAddress, uint8_t uRecordType, uint8_t uVersion, uint16_t uRecordLen) {
+    m_iIndexHeader = m_iIndexNext = iAddress;
+
+    updateValue(m_iIndexNext, m_ulMagic), m_iIndexNext += sizeof m_ulMagic;
+    update(m_iIndexNext, uRecordType), m_iIndexNext += sizeof uRecordType;
+    update(m_iIndexNext, uVersion), m_iIndexNext += sizeof uVersion;
+    updateValue(m_iIndexNext, uRecordLen), m_iIndexNext += sizeof(uint16_t);
+    m_fIndexed = false;
+    return m_iIndexNext;
+  }
+
+  static int readHeader(int iAddress, sHeader& rHeader);
+
   void newRecord(uint8_t uRecordType, uint8_t uVersion) {
     writeHeader(end(), uRecordType, uVersion);
-    flush();
+  }
+
+  void commit(void) {
+    m_fDirty = false;
+    m_ulCommits++;
+    Commit();
+  }
+
+  static uint16_t crc16(uint16_t uCRC, uint8_t uchByte) {  // CCITT
+    uCRC ^= uint16_t(uchByte) << 8;
+    for (int iBit(0); iBit < 8; iBit++) {
+      uCRC = (uCRC & 0x8000) ? (uCRC << 1) ^ 0x1021 : (uCRC << 1);
+    }
+    return uCRC;
   }
 
 private:
-  const size_t   m_stHeader;
-  const uint32_t m_ulMagic;
-  const uint8_t  m_uchRecordType;
-  const uint8_t  m_uchVersion;
-  int            m_iIndexHeader;
-  int            m_iIndexNext;
-  bool           m_fHeader;
+  static const size_t   m_stHeader = sizeof(uint32_t) + 2 * sizeof(uint8_t) + sizeof(uint16_t);
+  static const uint32_t m_ulMagic = 0xC0DEF00D;
+
+  const uint8_t m_uchRecordType;
+  const uint8_t m_uchVersion;
+  int           m_iIndexHeader;
+  int           m_iIndexNext;
+  bool          m_fHeader;
+  volatile bool m_fDirty;
+  elapsedMillis m_Quiet;
+  elapsedMillis m_Deferred;
+
+  static CEEPROMStream* m_apStreams[MaxStreams];
+  static size_t         m_nStreams;
+  static uint8_t        m_auchStage[StageBytes];  // Commits run from Task(), one at a time
+  static size_t         m_stStage;
+
+  static uint8_t  m_auchImage[ImageBytes];
+  static uint32_t m_auWriteBack[(ImageBytes + 31) / 32];  // Bytes the EEPROM doesn't have yet
+  static uint32_t m_auLate[(ImageBytes + 31) / 32];       // Written once the others are
+  static size_t   m_cWriteBack;
+  static size_t   m_cLate;
+  static bool     m_fLoaded;
+  static int      m_iLength;
+  static int16_t  m_aiDirectory[256];  // First intact record of each type, -1 for none
+  static int      m_iEnd;
+  static size_t   m_cRecords;
+  static bool     m_fIndexed;
+
+  static elapsedMillis m_Compact;
+  static uint32_t      m_ulLoadMicros;
+  static uint32_t      m_ulIndexMicros;
+  static uint32_t      m_ulIndexBuilds;
+  static uint32_t      m_ulLookups;
+  static uint32_t      m_ulRequests;
+  static uint32_t      m_ulCommits;
+  static uint32_t      m_ulStores;
+  static uint32_t      m_ulBytesWritten;
+  static uint32_t      m_ulMoves;
+  static uint32_t      m_ulCRCErrors;
+  static uint32_t      m_ulOverflows;
+  static uint32_t      m_ulFull;
 };
 
 class CEEPROMInitialize {
 public:
   CEEPROMInitialize() {
-    for (int iAddress(0); iAddress < EEPROM.length(); iAddress++) {
-      EEPROM.update(iAddress, 0xFF);
-    }
+    CEEPROMStream::discardAll();
+    CEEPROMStream::erase();
   }
 private:
   CEEPROMInitialize(const CEEPROMInitialize&);
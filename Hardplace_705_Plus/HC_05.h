@@ -72,6 +72,11 @@
 #include "Teensy41.h"
 #include "Bluetooth.h"
 #include "Tracer.h"
+#include "Profiler.h"
+#include "TraceLog.h"
+#include "ATEngine.h"
+#include "BaudrateCache.h"
+#include "LinkHealth.h"
 
 class CHC_05Device : public CBluetoothDevice {
 public:
@@ -79,6 +84,7 @@ public:
     IBluetooth::TeensyBluetooth DeviceID, IBluetooth& rBluetooth, Stream& rDevice,
     uint32_t uBaudrate = 38400, unsigned long ulTimeout = 1000)
     : CBluetoothDevice(DeviceID, rBluetooth, rDevice, uBaudrate, ulTimeout),
+      m_AT(*this, rBluetooth, DeviceID),
       m_DefaultBaudrate(uBaudrate),
       m_LastComm(0) {
   }
@@ -92,9 +98,18 @@ public:
     int iReturn(CBluetoothDevice::read());
     if (iReturn >= 0) {
       m_LastComm = 0;
+      m_Health.onRx(1);
     }
     return iReturn;
   }
+  using CBluetoothDevice::write;
+  virtual size_t write(uint8_t c) {
+    m_Health.onTx(1);
+    return CBluetoothDevice::write(c);
+  }
+  CLinkHealth& health(void) {
+    return m_Health;
+  }
   virtual String deviceName(void) const {
     return String("HC-05");
   }
@@ -147,27 +162,45 @@ public:
   }
 
 public:
+  static const uint32_t* discoveryRates(size_t& cRates) {  // Most likely first
+    static const uint32_t aulRates[] = { 38400, 115200, 9600, 57600, 19200, 4800, 230400, 921600, 1382400 };
+
+    cRates = sizeof aulRates / sizeof aulRates[0];
+    return aulRates;
+  }
+
+  size_t discoveryOrder(uint32_t* pulOrdered) {  // Room for discoveryRates() + 1, where it was last first
+    size_t          cRates;
+    const uint32_t* pulRates(discoveryRates(cRates));
+
+    return CBaudrateCache::Cache().order(deviceName(), pulRates, cRates, pulOrdered);
+  }
+
   virtual bool discoverBaudrate(void) {
     CAutoATCmdMode restoreMode(this);
     bool           fFound(ping(true));
-    unsigned       uBaud(getBaudrate());
-    const unsigned auRates[] = { 38400, 115200, 9600, 57600, 19200, 4800, 230400, 921600, 1382400 };
+    unsigned       uBaud(lineBaudrate());
+    uint32_t       aulRates[CBaudrateCache::Rates + 1];
+    size_t         cRates(discoveryOrder(aulRates));
 
-    for (size_t nIndex = 0; (!fFound && nIndex < sizeof auRates / sizeof(unsigned)); nIndex++) {
-      begin(auRates[nIndex]);
+    for (size_t nIndex = 0; (!fFound && nIndex < cRates); nIndex++) {
+      if (aulRates[nIndex] == uBaud) {
+        continue;  // Already pinged
+      }
+      begin(aulRates[nIndex]);
       Delay(100);
       clear();
       fFound = ping(true);
     }
-    if (!fFound) {
+    if (fFound) {
+      CBaudrateCache::Cache().found(deviceName(), lineBaudrate());
+    } else {
       begin(uBaud);
       Delay(100);
       clear();
     }
-    if (fFound
-        && Tracer().Enabled()) {
-      SendATCmd("AT+UART");
-      Tracer().TraceLn("Baudrate discovered at " + String(getBaudrate()));
+    if (fFound) {
+      TRACE_EVENT(TraceBluetooth, TraceInfo, BluetoothBaudrate, lineBaudrate(), 0);
     }
     return fFound;
   }
@@ -226,7 +259,14 @@ public:
     return bStatus;
   }
 
+  CATEngine& AT(void) {  // Non-blocking commands
+    return m_AT;
+  }
+
   bool SendATCmd(const char* pszCmd, String& Rsp) {
+    PROFILE_SCOPE(SendATCmd);
+    m_AT.abort();  // This one waits, and reads the port itself
+
     CAutoATCmdMode restoreMode(this);
 
     clear();
@@ -244,12 +284,17 @@ public:
                   || Rsp.indexOf("FAIL\r\n") >= 0
                   || Rsp.indexOf("ERROR") >= 0;
     }
-    if (Rsp.length()) {
-      m_Tracer.Trace(String(pszCmd) + " - " + Rsp);
-    } else {
-      m_Tracer.TraceLn(pszCmd);
+    bool fOK(Rsp.indexOf("OK\r\n") >= 0);
+
+    TRACE_DATA(TraceBluetooth, TraceDebug, ATCommand, reinterpret_cast<const uint8_t*>(pszCmd), strlen(pszCmd));
+    if (m_Tracer.Available()) {  // Don't build the strings for nobody
+      if (Rsp.length()) {
+        m_Tracer.Trace(String(pszCmd) + " - " + Rsp);
+      } else {
+        m_Tracer.TraceLn(pszCmd);
+      }
     }
-    return (Rsp.indexOf("OK\r\n") >= 0);
+    return fOK;
   }
 
   class CAutoATCmdMode {
@@ -280,8 +325,14 @@ public:
     bool          m_fisDataTransferMode;
   };
 
+protected:
+  CATEngine m_AT;
+
 private:
   uint32_t      m_DefaultBaudrate;
   elapsedMillis m_LastComm;
+
+protected:
+  CLinkHealth m_Health;
 };
 #endif
@@ -72,8 +72,9 @@
 #include "HC_05.h"
 #include "EEPromStream.h"
 #include "Tracer.h"
+#include "TraceLog.h"
 
-#define VER_HC_05MASTER 1
+#define VER_HC_05MASTER 2  // 1 was positional
 
 class CHC_05MasterDevice : public CHC_05Device, CEEPROMStream {
 public:
@@ -95,7 +96,23 @@ public:
       m_fSetup(false),
       m_fConnected(false),
       m_LastAttempt(5000),
-      m_AttemptTime(0) {
+      m_AttemptTime(0),
+      m_eLink(LinkPowerOn),
+      m_ulWait(PowerOnMillis),
+      m_cRates(0),
+      m_nRate(0),
+      m_uDiscoverBaud(uBaudrate),
+      m_fSPPInit(false),
+      m_fStateHigh(false),
+      m_ulBackoff(MinBackoffMillis),
+      m_ulNextAttempt(0),
+      m_fDown(false),
+      m_ulReconnects(0),
+      m_ulLastReconnect(0),
+      m_ulMinReconnect(0),
+      m_ulMaxReconnect(0),
+      m_ulTotalReconnect(0),
+      m_ulLinkAttempts(0) {
     Serialize(haveRecord());
     Tracer().TraceLn("Bind Address " + m_sBoundAddress);
   }
@@ -104,6 +121,10 @@ private:
   CHC_05MasterDevice(const CHC_05MasterDevice&);
   CHC_05MasterDevice& operator=(const CHC_05MasterDevice&);
 
+  virtual void Commit(void) {  // setDirty() coalesced
+    Serialize();
+  }
+
 public:
   virtual bool setup(void) {
     begin();
@@ -116,10 +137,18 @@ public:
       PowerOn();
       m_fSetup = false;
     }
+    if (!m_fSetup
+        && isConnected()
+        && CBaudrateCache::Cache().lastGood(deviceName())) {  // Linked through a reboot, it was fine where it was
+      begin(CBaudrateCache::Cache().lastGood(deviceName()));
+      m_fSetup = m_fSPPInit = true;
+      m_AttemptTime = 0;
+    }
     if (!m_fSetup) {
       m_fSetup = discoverBaudrate();
       if (m_fSetup) {
-        InitSPPLib();
+        InitSPPLib();        // Error 17 when already initialised
+        m_fSPPInit = true;
         if (m_sBoundAddress.length()) {
           Bind(m_sBoundAddress);
         }
@@ -129,30 +158,74 @@ public:
     return m_fSetup;
   }
 
-  virtual void Task(void) {
+  virtual void Task(void) {  // IC-705 link policy, never waits on the module
     CHC_05Device::Task();
+    m_AT.Task();
+    if (m_AT.isBusy()) {
+      return;
+    }
+    if (m_fSetup
+        && m_eLink < LinkIdle) {
+      m_eLink = LinkIdle;  // setup() found it
+    }
 
-    if (m_LastAttempt >= 5000) {
-      if (!isReady()) {
-        setup();
-      } else if (m_fConnected
-                 && !isConnected()) {
-        if (isPoweredOn()
-            && isReady()) {
-          if (m_AttemptTime > (60 * 1000)) {  // Deal with wierd state where bluetooth is connected
+    const bool fStateHigh(isConnected());  // BT_ICOM_STATE, debounced
+    const bool fStateEdge(fStateHigh != m_fStateHigh);
+
+    m_fStateHigh = fStateHigh;
+    switch (m_eLink) {
+      case LinkPowerOn:
+        if (!isPoweredOn()) {
+          (getBaudrate() == 38400) ? m_rBluetooth.BluetoothATCmdMode(m_DeviceID)
+                                   : m_rBluetooth.BluetoothDataTransferMode(m_DeviceID);
+          m_rBluetooth.BluetoothPowerOn(m_DeviceID);
+          m_ulWait = PowerOnMillis;
+          m_StateTime = 0;
+        } else if (m_StateTime >= m_ulWait) {
+          startDiscovery();
+        }
+        break;
+
+      case LinkDiscover:
+        if (m_StateTime >= BaudSettleMillis) {
+          m_AT.queue("AT", ProbeMillis, onDiscover, this);
+        }
+        break;
+
+      case LinkIdle:
+        if (m_fConnected
+            || fStateHigh) {  // The module linked on its own
+          m_fConnected = true;
+          linked();
+        } else if (fStateEdge) {  // Something happened, don't sit out the backoff
+          m_ulBackoff = MinBackoffMillis;
+          attempt();
+        } else if (m_LastAttempt >= m_ulNextAttempt) {
+          attempt();
+        }
+        break;
+
+      case LinkLinking:  // onLink() moves on
+        break;
+
+      case LinkUp:
+        if (!fStateHigh) {
+          m_fConnected = false;
+          m_eLink = LinkIdle;
+          m_LastAttempt = 0;
+          m_ulNextAttempt = 0;  // Relink as soon as AT+DISC is done
+          m_ulBackoff = MinBackoffMillis;
+          startDownTime();
+          if (m_AttemptTime > StuckMillis) {  // Deal with wierd state where bluetooth is connected
             PowerOff();                       // but the module doesn't recognize it
           } else {
-            Disconnect();
+            m_AT.queue("AT+DISC", DiscMillis, onDisconnect, this);
           }
+          TRACE_EVENT(TraceBluetooth, TraceInfo, BluetoothDisconnected, m_DeviceID, m_AttemptTime);
+        } else {
+          m_AttemptTime = 0;
         }
-        m_fConnected = false;
-      } else if (isPoweredOn()
-                 && !isConnected()) {
-        m_fConnected = LinkBoundDevice();
-      } else {
-        m_AttemptTime = 0;
-      }
-      m_LastAttempt = 0;
+        break;
     }
   }
 
@@ -160,6 +233,9 @@ public:
     CBluetoothDevice::PowerOff();
     setBaudrate(defaultBaudrate());
     m_fSetup = false;
+    m_fSPPInit = false;
+    m_eLink = LinkPowerOn;
+    startDownTime();
   }
 
   virtual String deviceName(void) const {
@@ -172,6 +248,13 @@ public:
       ;
   }
 
+  void printLinkStatus(Print& rDevice) const {
+    rDevice.printf("IC-705 relink   %lu reconnects, last %lu ms, min %lu, max %lu, mean %lu, %lu attempts, backoff %lu ms\r\n",
+                   m_ulReconnects, m_ulLastReconnect, m_ulMinReconnect, m_ulMaxReconnect,
+                   (m_ulReconnects) ? m_ulTotalReconnect / m_ulReconnects : 0UL,
+                   m_ulLinkAttempts, m_ulBackoff);
+  }
+
   bool isReady(void) {
     return m_fSetup;
   }
@@ -402,26 +485,208 @@ public:
 
   virtual void clearPairing(void) {
     m_sBoundAddress = String();
-    Serialize();
+    setDirty();
   }
 
 private:
-  void Serialize(bool bLoad = false) {
-    const unsigned uMaxAddressLen(14);  // 12 digit hexidecimal value (BD_ADDR)
+  enum eLinkState {
+    LinkPowerOn,   // Waiting for the module to start
+    LinkDiscover,  // One "AT" per baud rate until it answers
+    LinkIdle,      // Ready, link attempts backed off up to MaxBackoffMillis
+    LinkLinking,   // AT+LINK outstanding
+    LinkUp
+  };
+
+  enum {
+    RediscoverMillis = 5000,
+    PowerOnMillis = 1000,
+    BaudSettleMillis = 100,
+    ProbeMillis = 250,
+    BindMillis = 1000,
+    DiscMillis = 1000,
+    LinkMillis = 10000,
+    StuckMillis = 60 * 1000,
+    MinBackoffMillis = 250,
+    MaxBackoffMillis = 8000
+  };
+
+  void startDiscovery(void) {
+    m_cRates = discoveryOrder(m_aulRates);  // Where it was last found first, skip the search if it's still there
+    m_nRate = 0;
+    m_uDiscoverBaud = lineBaudrate();
+    if (m_aulRates[0] != lineBaudrate()) {
+      begin(m_aulRates[m_nRate++]);
+      m_StateTime = 0;
+    } else {
+      m_nRate++;
+      m_StateTime = BaudSettleMillis;  // The current rate, it's settled
+    }
+    m_eLink = LinkDiscover;
+  }
+
+  static void onDiscover(void* pThis, bool fOK, const char* pszResponse) {
+    reinterpret_cast<CHC_05MasterDevice*>(pThis)->onDiscover(fOK);
+  }
+  void onDiscover(bool fOK) {
+    if (fOK) {
+      char achCmd[CATEngine::CmdBytes];
+
+      m_fSetup = true;
+      CBaudrateCache::Cache().found(deviceName(), lineBaudrate());
+      m_eLink = LinkIdle;
+      m_AttemptTime = 0;
+      m_ulNextAttempt = 0;
+      if (!m_fSPPInit) {
+        m_AT.queue("AT+INIT", DiscMillis, onInit, this);
+      }
+      if (m_sBoundAddress.length()) {
+        snprintf(achCmd, sizeof achCmd, "AT+BIND=%s", m_sBoundAddress.c_str());
+        m_AT.queue(achCmd, BindMillis);
+      }
+      TRACE_EVENT(TraceBluetooth, TraceInfo, BluetoothBaudrate, lineBaudrate(), 0);
+    } else if (m_nRate < m_cRates) {
+      begin(m_aulRates[m_nRate++]);
+      m_StateTime = 0;
+    } else {
+      begin(m_uDiscoverBaud);
+      m_eLink = LinkPowerOn;
+      m_ulWait = RediscoverMillis;
+      m_StateTime = 0;
+    }
+  }
+
+  void attempt(void) {
+    m_LastAttempt = 0;
+    m_ulLinkAttempts++;
+    if (m_sBoundAddress.length() == 0) {
+      m_AT.queue("AT+BIND?", BindMillis, onBindAddress, this);
+    } else {
+      link();
+    }
+  }
+
+  void backoff(void) {  // Exponential, with jitter so we don't beat against the radio's own retries
+    m_LastAttempt = 0;
+    m_ulNextAttempt = m_ulBackoff + random(m_ulBackoff / 4 + 1);
+    m_ulBackoff = (2 * m_ulBackoff < MaxBackoffMillis) ? 2 * m_ulBackoff : MaxBackoffMillis;
+  }
+
+  void startDownTime(void) {
+    if (!m_fDown) {
+      m_fDown = true;
+      m_DownTime = 0;
+    }
+  }
+
+  void link(void) {
+    char achCmd[CATEngine::CmdBytes];
+
+    snprintf(achCmd, sizeof achCmd, "AT+LINK=%s", m_sBoundAddress.c_str());  // "3031,7D,341D93"
+    if (m_AT.queue(achCmd, LinkMillis, onLink, this)) {
+      m_eLink = LinkLinking;
+    }
+  }
 
-    CEEPROMStream::rewind();
+  static void onLink(void* pThis, bool fOK, const char* pszResponse) {
+    reinterpret_cast<CHC_05MasterDevice*>(pThis)->onLink(fOK, pszResponse);
+  }
+  void onLink(bool fOK, const char* pszResponse) {
+    m_eLink = LinkIdle;
+    if (fOK) {
+      if (strstr(pszResponse, "ERROR:(0)")) {
+        PowerOff();
+      } else {
+        m_fConnected = true;
+        linked();
+      }
+      return;
+    }
+    backoff();
+    if (strstr(pszResponse, "FAIL")) {
+      m_AT.queue("AT+DISC", DiscMillis, onDisconnect, this);
+    } else if (strstr(pszResponse, "ERROR:(16)")) {  // SPP lib not initialised
+      m_fSPPInit = false;
+      m_AT.queue("AT+INIT", DiscMillis, onInit, this);
+    }
+  }
+
+  static void onInit(void* pThis, bool fOK, const char* pszResponse) {
+    reinterpret_cast<CHC_05MasterDevice*>(pThis)->onInit(fOK, pszResponse);
+  }
+  void onInit(bool fOK, const char* pszResponse) {
+    m_fSPPInit = fOK || strstr(pszResponse, "ERROR:(17)");  // 17, already initialised
+  }
+
+  void linked(void) {
+    m_eLink = LinkUp;
+    m_ulBackoff = MinBackoffMillis;
+    if (m_fDown) {
+      m_Health.onReconnect();
+      m_fDown = false;
+      m_ulLastReconnect = m_DownTime;
+      m_ulTotalReconnect += m_ulLastReconnect;
+      if (!m_ulReconnects++
+          || m_ulLastReconnect < m_ulMinReconnect) {
+        m_ulMinReconnect = m_ulLastReconnect;
+      }
+      if (m_ulLastReconnect > m_ulMaxReconnect) {
+        m_ulMaxReconnect = m_ulLastReconnect;
+      }
+    }
+    TRACE_EVENT(TraceBluetooth, TraceInfo, BluetoothConnected, m_DeviceID, m_AttemptTime);
+  }
 
-    if (bLoad) {
+  static void onBindAddress(void* pThis, bool fOK, const char* pszResponse) {
+    reinterpret_cast<CHC_05MasterDevice*>(pThis)->onBindAddress(fOK, pszResponse);
+  }
+  void onBindAddress(bool fOK, const char* pszResponse) {  // "+BIND:3031:7D:341D93"
+    String Resp(pszResponse);
+
+    if (fOK
+        && Resp.length() > 6
+        && Resp.indexOf(':') >= 0
+        && Resp.substring(0, 6) == String("+BIND:")) {
+      Resp = Resp.substring(1 + Resp.indexOf(':'), Resp.indexOf('\r'));
+      Resp.replace(':', ',');
+      m_sBoundAddress = Resp;
+      link();
+    } else {
+      backoff();
+    }
+  }
+
+  static void onDisconnect(void* pThis, bool fOK, const char* pszResponse) {
+    reinterpret_cast<CHC_05MasterDevice*>(pThis)->onDisconnect(fOK, pszResponse);
+  }
+  void onDisconnect(bool fOK, const char* pszResponse) {
+    if (!fOK
+        && strstr(pszResponse, "ERROR:(16)")) {
+      m_fSPPInit = false;
+      m_AT.queue("AT+INIT", DiscMillis, onInit, this);
+    }
+  }
+
+private:
+  void Serialize(bool bLoad = false) {
+    const unsigned uMaxAddressLen(14);  // Version 1, 12 digit hexidecimal value (BD_ADDR)
+    const SField   aFields[] = {
+      field(1, m_sBoundAddress)
+    };
+
+    if (!bLoad) {
+      putFields(aFields, sizeof aFields / sizeof aFields[0]);
+    } else if (Version() < VER_HC_05MASTER) {
+      CEEPROMStream::rewind();
       get(m_sBoundAddress, uMaxAddressLen);
+      setDirty();
     } else {
-      put(m_sBoundAddress, uMaxAddressLen);
-      CEEPROMStream::flush();
+      getFields(aFields, sizeof aFields / sizeof aFields[0]);
     }
   }
 
   void saveBoundAddress(const String& rBoundAddress) {
     m_sBoundAddress = rBoundAddress;  //3031,7D,341D93
-    Serialize();
+    setDirty();
   }
 
 private:
@@ -436,5 +701,24 @@ private:
   String        m_sBoundAddress;
   elapsedMillis m_LastAttempt;
   elapsedMillis m_AttemptTime;
+  eLinkState    m_eLink;
+  elapsedMillis m_StateTime;
+  unsigned long m_ulWait;
+  uint32_t      m_aulRates[CBaudrateCache::Rates + 1];  // Discovery order
+  size_t        m_cRates;
+  size_t        m_nRate;
+  uint32_t      m_uDiscoverBaud;
+  bool          m_fSPPInit;    // AT+INIT done since power on
+  bool          m_fStateHigh;
+  unsigned long m_ulBackoff;
+  unsigned long m_ulNextAttempt;
+  bool          m_fDown;  // Timing a reconnect
+  elapsedMillis m_DownTime;
+  uint32_t      m_ulReconnects;
+  uint32_t      m_ulLastReconnect;
+  uint32_t      m_ulMinReconnect;
+  uint32_t      m_ulMaxReconnect;
+  uint32_t      m_ulTotalReconnect;
+  uint32_t      m_ulLinkAttempts;
 };
 #endif
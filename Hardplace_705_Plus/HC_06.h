@@ -5,7 +5,10 @@
 
 #include "Hardplace705Plus.h"
 #include "SerialDevice.h"
+#include "BaudrateCache.h"
+#include "LinkHealth.h"
 #include "Tracer.h"
+#include "TraceLog.h"
 
 
 class CBluetoothSlaveDevice : public CSerialDevice {
@@ -14,10 +17,27 @@ public:
     Stream& Device, const char* pszName = "HC_06", uint32_t uBaudrate = 38400,
     unsigned long ulTimeout = 1000)
     : CSerialDevice(Device, uBaudrate, ulTimeout),
-      m_sName(pszName) {
+      m_sName(pszName),
+      m_uConfiguredBaud(uBaudrate) {
   }
 
 public:
+  virtual int read(void) {
+    int iReturn(CSerialDevice::read());
+    if (iReturn >= 0) {
+      m_Health.onRx(1);
+    }
+    return iReturn;
+  }
+  using CSerialDevice::write;
+  virtual size_t write(uint8_t c) {
+    m_Health.onTx(1);
+    return CSerialDevice::write(c);
+  }
+  CLinkHealth& health(void) {
+    return m_Health;
+  }
+
   String Response(void) {
     String sRsp;
 
@@ -38,13 +58,26 @@ public:
   }
 
   virtual bool setup(void) {
-    unsigned uBaud(getBaudrate());
-
-    begin();
-    if (!ping()
-        && discoverBaudrate()) {
+    unsigned       uBaud(getBaudrate());  // Configured, the floor for negotiate()
+    const uint32_t ulLastGood(CBaudrateCache::Cache().lastGood(deviceName()));
+    bool           fAnswered(false);
+
+    if (ulLastGood) {
+      begin(ulLastGood);  // Likely where negotiate() left it
+    } else {
+      begin();
+    }
+    if (CSPPTrafficDetector::isLive(*this)) {  // Linked, it won't answer "AT", and the rate is right
+      CBaudrateCache::Cache().found(deviceName(), lineBaudrate());
+      setBaudrate(lineBaudrate());
+      return true;
+    }
+    if (ping()) {
+      fAnswered = true;
+    } else if (discoverBaudrate()) {
       const unsigned auRates[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1382400 };
 
+      fAnswered = true;
       for (size_t nIndex = 0; nIndex < sizeof auRates / sizeof(unsigned); nIndex++) {
         if (auRates[nIndex] == uBaud) {
           write(String((String("AT+NAME") + m_sName)).c_str());
@@ -62,6 +95,36 @@ public:
         }
       }
     }
+    if (fAnswered) {
+      CBaudrateCache::Cache().negotiate(*this);  // As fast as it will reliably go
+    }
+    return true;
+  }
+
+  bool setModuleBaudrate(uint32_t ulBaudrate) {  // AT+BAUD1..C, applies at once
+    for (size_t nIndex = 0; nIndex < CBaudrateCache::Rates; nIndex++) {
+      if (CBaudrateCache::rates()[nIndex] == ulBaudrate) {
+        write(String(String("AT+BAUD") + String(nIndex + 1, HEX)).c_str());
+        return Response().indexOf("OK") >= 0;
+      }
+    }
+    return false;
+  }
+
+  bool integrityTest(uint32_t& ulMicros) {  // IntegrityPings in a row, and the mean round trip
+    uint32_t ulTotal(0);
+
+    Delay(100);
+    clear();
+    for (unsigned nPing(0); nPing < CBaudrateCache::IntegrityPings; nPing++) {
+      elapsedMicros RoundTrip;
+
+      if (!ping()) {
+        return false;
+      }
+      ulTotal += RoundTrip;
+    }
+    ulMicros = ulTotal / CBaudrateCache::IntegrityPings;
     return true;
   }
 
@@ -70,18 +133,24 @@ public:
     return Response().indexOf("OK") >= 0;
   }
 
-  virtual bool discoverBaudrate(void) {
-    bool           fFound(ping());
-    unsigned       uBaud(getBaudrate());
-    const unsigned auRates[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1382400 };
+  virtual bool discoverBaudrate(void) {  // Where it was last, then where it usually ends up
+    bool     fFound(ping());
+    unsigned uBaud(lineBaudrate());
+    uint32_t aulRates[CBaudrateCache::Rates + 1];
+    size_t   cRates(CBaudrateCache::Cache().order(deviceName(), CBaudrateCache::rates(), CBaudrateCache::Rates, aulRates));
 
-    for (size_t nIndex = 0; (!fFound && nIndex < sizeof auRates / sizeof(unsigned)); nIndex++) {
-      begin(auRates[nIndex]);
+    for (size_t nIndex = 0; (!fFound && nIndex < cRates); nIndex++) {
+      if (aulRates[nIndex] == uBaud) {
+        continue;  // Already pinged
+      }
+      begin(aulRates[nIndex]);
       Delay(100);
       clear();
       fFound = ping();
     }
-    if (!fFound) {
+    if (fFound) {
+      CBaudrateCache::Cache().found(deviceName(), lineBaudrate());
+    } else {
       begin(uBaud);
       Delay(100);
       clear();
@@ -91,9 +160,26 @@ public:
   virtual String deviceName(void) const {
     return m_sName;
   }
+  const CErrorBurst& lineErrors(void) const {
+    return m_LineErrors;
+  }
+
+protected:
+  void onLineError(void) {  // Framing the remote never sent, a burst says the negotiated rate is too fast
+    m_Health.onParseError();
+    if (m_LineErrors.onError()) {
+      CBaudrateCache::Cache().demote(deviceName(), m_uConfiguredBaud);
+      TRACE_EVENT(TraceBluetooth, TraceWarning, BluetoothErrorBurst, lineBaudrate(), m_uConfiguredBaud);
+    }
+  }
 
 private:
-  String m_sName;
+  String      m_sName;
+  uint32_t    m_uConfiguredBaud;
+  CErrorBurst m_LineErrors;
+
+protected:
+  CLinkHealth m_Health;
 };
 
 #endif
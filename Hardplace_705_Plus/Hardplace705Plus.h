@@ -5,6 +5,17 @@
 
 #define TRACE_GLOBAL false
 #define DO_PING
+#define DO_PROFILE
+
+#if !defined USB_HUBS
+#define USB_HUBS 1  // USB host driver pool, a hub is needed for more than one serial port
+#endif
+#if !defined USB_SERIAL_PORTS
+#define USB_SERIAL_PORTS 4  // At least 4, at most 32
+#endif
+#if !defined USB_BINDINGS
+#define USB_BINDINGS 8  // Remembered USB Hardrock bindings
+#endif
 
 #if defined _THREADS_H
 #define USE_THREADS
@@ -9,56 +9,90 @@
   {0x0403, 0x6015, USBSerialBase::FTDI, 0},  // Hardrock Seral
 */
 
+#include <new>
+
 #include "HardplaceUSBHost.h"
 
 #include "Tracer.h"
+#include "TraceLog.h"
+
+alignas(USBHub) uint8_t              CHardplaceUSBHost::m_aauchHubs[CHardplaceUSBHost::Hubs][sizeof(USBHub)];
+alignas(USBSerial_BigBuffer) uint8_t CHardplaceUSBHost::m_aauchSerial[CHardplaceUSBHost::SerialPorts][sizeof(USBSerial_BigBuffer)];
 
 static CHardplaceUSBHost _sUSBHost(19200);
 
 USBHub&
-  SerialUSBHostHub(*_sUSBHost.USBSerialHub());
+  SerialUSBHostHub(CHardplaceUSBHost::hub(0));
 USBSerial_BigBuffer&
-  SerialUSBHost1(*_sUSBHost.USBSerialDevice(CHardplaceUSBHost::USBDevice::USB1));
+  SerialUSBHost1(CHardplaceUSBHost::serialPort(0));
 USBSerial_BigBuffer&
-  SerialUSBHost2(*_sUSBHost.USBSerialDevice(CHardplaceUSBHost::USBDevice::USB2));
+  SerialUSBHost2(CHardplaceUSBHost::serialPort(1));
 USBSerial_BigBuffer&
-  SerialUSBHost3(*_sUSBHost.USBSerialDevice(CHardplaceUSBHost::USBDevice::USB3));
+  SerialUSBHost3(CHardplaceUSBHost::serialPort(2));
 USBSerial_BigBuffer&
-  SerialUSBHost4(*_sUSBHost.USBSerialDevice(CHardplaceUSBHost::USBDevice::USB4));
+  SerialUSBHost4(CHardplaceUSBHost::serialPort(3));
 
 CHardplaceUSBHost::CHardplaceUSBHost(uint32_t uBaud, uint32_t uFormat)
   : m_baud(uBaud),
-    m_format(uFormat),
-    m_Hub(*this),
-    m_USB1(*this, 1),
-    m_USB2(*this, 1),
-    m_USB3(*this, 1),
-    m_USB4(*this, 1) {
-  m_USB1.writeTimeOut(100);
-  m_USB2.writeTimeOut(100);
-  m_USB3.writeTimeOut(100);
-  m_USB4.writeTimeOut(100);
+    m_format(uFormat) {
+  for (size_t nHub(0); nHub < Hubs; nHub++) {
+    new (m_aauchHubs[nHub]) USBHub(*this);
+  }
+  for (size_t nPort(0); nPort < SerialPorts; nPort++) {
+    new (m_aauchSerial[nPort]) USBSerial_BigBuffer(*this, 1);
+    serialPort(nPort).writeTimeOut(100);
+    m_apListeners[nPort] = 0;
+  }
+  for (size_t nDriver(0); nDriver < Drivers; nDriver++) {
+    m_afDriverActive[nDriver] = false;
+  }
 }
 
-
-USBHub*
-CHardplaceUSBHost::USBSerialHub(void) const {
-  return static_cast<USBHub*>(m_aDrivers[USBDevice::HUB]);
+USBHub&
+CHardplaceUSBHost::hub(size_t nHub) {
+  return *reinterpret_cast<USBHub*>(m_aauchHubs[nHub]);
+}
+USBSerial_BigBuffer&
+CHardplaceUSBHost::serialPort(size_t nPort) {
+  return *reinterpret_cast<USBSerial_BigBuffer*>(m_aauchSerial[nPort]);
+}
+int CHardplaceUSBHost::serialPortIndex(const Stream& rStream) {
+  for (size_t nPort(0); nPort < SerialPorts; nPort++) {
+    if (&rStream == static_cast<const Stream*>(&serialPort(nPort))) {
+      return nPort;
+    }
+  }
+  return -1;
+}
+USBDriver&
+CHardplaceUSBHost::driver(size_t nDriver) {  // Hubs first, then the serial ports
+  return (nDriver < Hubs)
+           ? static_cast<USBDriver&>(hub(nDriver))
+           : static_cast<USBDriver&>(serialPort(nDriver - Hubs));
 }
-USBSerial_BigBuffer*
-CHardplaceUSBHost::USBSerialDevice(USBDevice which) const {
-  if (which >= USB1
-      && which <= USB4) {
-    return static_cast<USBSerial_BigBuffer*>(m_aDrivers[which]);
+void CHardplaceUSBHost::driverName(size_t nDriver, char* pszName, size_t stName) const {
+  if (nDriver < Hubs) {
+    snprintf(pszName, stName, "Hub%u", unsigned(nDriver + 1));
+  } else {
+    snprintf(pszName, stName, "SerialUSBHost%u", unsigned(nDriver - Hubs + 1));
   }
-  return 0;
 }
 void CHardplaceUSBHost::Task(void) {
   _sUSBHost._Task();
 }
+void CHardplaceUSBHost::listen(size_t nPort, IUSBPortEvents* pListener) {
+  if (nPort < SerialPorts) {
+#if defined USE_THREADS
+    Threads::Scope wait(_sUSBHost.m_Mutex);
+#endif
+    _sUSBHost.m_apListeners[nPort] = pListener;
+    if (pListener
+        && _sUSBHost.m_afDriverActive[Hubs + nPort]) {  // Attached before anyone listened
+      pListener->onUSBAttached();
+    }
+  }
+}
 void CHardplaceUSBHost::_Task(void) {
-  const size_t cDevices(sizeof m_aDrivers / sizeof(USBDriver*));
-
 #if defined USE_THREADS
   Threads::Scope wait(m_Mutex);
 #endif
@@ -66,29 +100,42 @@ void CHardplaceUSBHost::_Task(void) {
   USBHost::Task();
 
   // Print out information about different devices.
-  for (uint8_t nIndex(0); nIndex < cDevices; nIndex++) {
-    if (*m_aDrivers[nIndex] != m_afDriverActive[nIndex]) {
-      m_afDriverActive[nIndex] = *m_aDrivers[nIndex];
-      
-      if (m_afDriverActive[nIndex]) {
-        USBSerial_BigBuffer* curDevice(USBSerialDevice(USBDevice(nIndex)));
+  for (size_t nIndex(0); nIndex < Drivers; nIndex++) {
+    USBDriver& rDriver(driver(nIndex));
+
+    if (bool(rDriver) != m_afDriverActive[nIndex]) {
+      IUSBPortEvents* pListener((nIndex >= Hubs) ? m_apListeners[nIndex - Hubs] : 0);
+      char            achName[24];
+
+      m_afDriverActive[nIndex] = bool(rDriver);
+      driverName(nIndex, achName, sizeof achName);
 
-        if (curDevice) {
-          curDevice->begin(m_baud, m_format);
+      if (m_afDriverActive[nIndex]) {
+        TRACE_EVENT(TraceUSB, TraceInfo, USBAttached, nIndex,
+                    (uint32_t(rDriver.idVendor()) << 16) | rDriver.idProduct());
+        if (nIndex >= Hubs) {
+          serialPort(nIndex - Hubs).begin(m_baud, m_format);
+        }
+        if (pListener) {
+          pListener->onUSBAttached();
         }
 
         if (m_DebugMonitor) {
-          m_DebugMonitor.printf("*** Device %s %x:%x - connected ***\r\n", m_apszDriverNames[nIndex], m_aDrivers[nIndex]->idVendor(), m_aDrivers[nIndex]->idProduct());
+          m_DebugMonitor.printf("*** Device %s %x:%x - connected ***\r\n", achName, rDriver.idVendor(), rDriver.idProduct());
 
-          const uint8_t* psz(m_aDrivers[nIndex]->manufacturer());
+          const uint8_t* psz(rDriver.manufacturer());
           if (psz && *psz) m_DebugMonitor.printf("  manufacturer: %s\r\n", psz);
-          psz = m_aDrivers[nIndex]->product();
+          psz = rDriver.product();
           if (psz && *psz) m_DebugMonitor.printf("  product: %s\r\n", psz);
-          psz = m_aDrivers[nIndex]->serialNumber();
+          psz = rDriver.serialNumber();
           if (psz && *psz) m_DebugMonitor.printf("  Serial: %s\r\n", psz);
         }
       } else {
-        m_DebugMonitor.printf("*** Device %s - disconnected ***\r\n", m_apszDriverNames[nIndex]);
+        TRACE_EVENT(TraceUSB, TraceInfo, USBDetached, nIndex, 0);
+        if (pListener) {
+          pListener->onUSBDetached();
+        }
+        m_DebugMonitor.printf("*** Device %s - disconnected ***\r\n", achName);
       }
     }
   }
@@ -7,6 +7,22 @@
 #include "Hardplace705Plus.h"
 #include "Tracer.h"
 
+#if USB_SERIAL_PORTS < 4 || USB_SERIAL_PORTS > 32
+#error USB_SERIAL_PORTS must be 4 to 32
+#endif
+
+class IUSBPortEvents {  // Called from CHardplaceUSBHost::Task() as a driver attaches or detaches, don't block
+public:
+  virtual ~IUSBPortEvents() {}
+  virtual void onUSBAttached(void) = 0;
+  virtual void onUSBDetached(void) = 0;
+};
+
+/*
+   USB host with a compile time sized driver pool, USB_HUBS hubs and USB_SERIAL_PORTS serial ports
+   (Hardplace705Plus.h). Serial port n is SerialUSBHost(n + 1) in traces and status.
+*/
+
 class CHardplaceUSBHost : public USBHost {
 public:
   CHardplaceUSBHost(uint32_t uBaud = 115200, uint32_t uFormat = USBHOST_SERIAL_8N1);
@@ -16,39 +32,42 @@ private:
   CHardplaceUSBHost& operator=(const CHardplaceUSBHost&);
 
 public:
-  enum USBDevice {
-    HUB,
-    USB1,
-    USB2,
-    USB3,
-    USB4
+  enum {
+    Hubs = USB_HUBS,
+    SerialPorts = USB_SERIAL_PORTS,
+    Drivers = USB_HUBS + USB_SERIAL_PORTS
   };
 
 public:
-  USBHub*              USBSerialHub(void) const;
-  USBSerial_BigBuffer* USBSerialDevice(USBDevice which) const;
+  static USBHub&              hub(size_t nHub);
+  static USBSerial_BigBuffer& serialPort(size_t nPort);
+  static int                  serialPortIndex(const Stream& rStream);  // -1 if not a USB host serial port
+  static bool                 isSerialPort(const Stream& rStream) {
+    return serialPortIndex(rStream) >= 0;
+  }
 
 public:
   static void Task(void);
+  static void listen(size_t nPort, IUSBPortEvents* pListener);
 
 private:
-  void _Task(void);
+  void        _Task(void);
+  USBDriver&  driver(size_t nDriver);
+  void        driverName(size_t nDriver, char* pszName, size_t stName) const;
 
 private:
-  uint32_t            m_baud;
-  uint32_t            m_format;
-  USBHub              m_Hub;
-  USBSerial_BigBuffer m_USB1;
-  USBSerial_BigBuffer m_USB2;
-  USBSerial_BigBuffer m_USB3;
-  USBSerial_BigBuffer m_USB4;
-  USBDriver*          m_aDrivers[5] = { &m_Hub, &m_USB1, &m_USB2, &m_USB3, &m_USB4 };
-  const char*         m_apszDriverNames[5] = { "Hub", "SerialUSBHost1", "SerialUSBHost2", "SerialUSBHost3", "SerialUSBHost4" };
-  bool                m_afDriverActive[5] = { false, false, false, false, false };
-  CTraceDevice        m_DebugMonitor;
+  uint32_t        m_baud;
+  uint32_t        m_format;
+  bool            m_afDriverActive[Drivers];
+  IUSBPortEvents* m_apListeners[SerialPorts];
+  CTraceDevice    m_DebugMonitor;
 #if defined USE_THREADS
-  Threads::Mutex      m_Mutex;
+  Threads::Mutex  m_Mutex;
 #endif
+
+  // Driver storage, constructed in place by the constructor. Static so a port's address is valid before then.
+  alignas(USBHub) static uint8_t              m_aauchHubs[Hubs][sizeof(USBHub)];
+  alignas(USBSerial_BigBuffer) static uint8_t m_aauchSerial[SerialPorts][sizeof(USBSerial_BigBuffer)];
 };
 
 extern USBHub&              SerialUSBHostHub;
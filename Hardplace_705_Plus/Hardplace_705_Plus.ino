@@ -11,6 +11,10 @@
 #include "HardrockUSB.h"
 #include "HardrockPair.h"
 #include "SerialProcessor.h"
+#include "Profiler.h"
+#include "TraceLog.h"
+#include "Capture.h"
+#include "SerialBuffers.h"
 
 extern "C" uint32_t set_arm_clock(uint32_t frequency);
 
@@ -23,6 +27,7 @@ bool BindByMap(CHardrockPair& rHardrock);
 void BindByPort(CHardrockPair& rHardrock);
 void HighAlarmISR(void);
 void LowAlarmISR(void);
+void ReplayFrame(const uint8_t* puchFrame, size_t stFrame);
 
 /*
    Serial1 -> Hardrock A
@@ -47,10 +52,7 @@ CHardrockBluetoothSlaveDevice BluetoothA(Serial4, "Hardplace A", 115200);
 CHardrockBluetoothSlaveDevice BluetoothB(Serial3, "Hardplace B", 115200);
 CHardrockPair                 HardrockA(CTeensy::eHardrock::A, Serial1, Teensy, IC_705, 0xE2);
 CHardrockPair                 HardrockB(CTeensy::eHardrock::B, Serial2, Teensy, IC_705, 0xE3);
-CHardrockUSB                  HardrockUSB1(SerialUSBHost1);
-CHardrockUSB                  HardrockUSB2(SerialUSBHost2);
-CHardrockUSB                  HardrockUSB3(SerialUSBHost3);
-CHardrockUSB                  HardrockUSB4(SerialUSBHost4);
+CHardrockUSBPool              HardrockUSB;  // HardrockUSB[n] is SerialUSBHost(n + 1)
 CSerialProcessor              CmdProcessor(Serial, 115200);
 #if defined                   DUAL_SERIAL
 CSerialProcessor              CmdProcessorB(SerialUSB1, 115200);
@@ -58,6 +60,11 @@ CSerialProcessor              CmdProcessorB(SerialUSB1, 115200);
 }
 
 void setup() {
+  CSerialBuffers::attach(Serial1, "Serial1 HR A", 115200);  // Fastest rate each port runs at
+  CSerialBuffers::attach(Serial2, "Serial2 HR B", 115200);
+  CSerialBuffers::attach(Serial3, "Serial3 BT B", 921600);  // CBaudrateCache::NegotiateCeiling
+  CSerialBuffers::attach(Serial4, "Serial4 BT A", 921600);
+  CSerialBuffers::attach(Serial8, "Serial8 IC-705", 115200);
   if (!Tracer.Enabled()) {
     if (Teensy.DebugEnabled()) {
       Tracer.Enable();
@@ -68,12 +75,20 @@ void setup() {
     }
   }
   if (Tracer.Enabled()) {
+    bool fAbnormalReset(false);
+
     if (CrashReport) {            // CrashReport.breadcrumb((1-6), uint32_t identifier)
       Tracer.TraceLn("");         // CrashReport.breadcrumb( 1, 0x5000000 | __LINE__ );
       Tracer.print(CrashReport);  // Upper bits hold '5' perhaps indicating func() for ref, lower bits show line #
+      fAbnormalReset = true;
     }
     if (Teensy.WatchdogTripped()) {
       Tracer.TraceLn("Reboot due to Watchdog timeout");
+      fAbnormalReset = true;
+    }
+    if (fAbnormalReset
+        && CTraceLog::havePreviousBoot()) {  // What was going on before the reset
+      CTraceLog::printPreviousBoot(Tracer, CTraceLog::PreviousBootSeconds);
     }
   }
 
@@ -81,12 +96,9 @@ void setup() {
   IC_705.setup();
   HardrockA.setup();
   HardrockB.setup();
-  BluetoothA.setup();  // Note: if you reboot with the Bluetooth connected discoverBaudrate will fail
-  BluetoothB.setup();  // due to the inability to enter command mode and if will take a long time to complete the setup
-  HardrockUSB1.setup();
-  HardrockUSB2.setup();
-  HardrockUSB3.setup();
-  HardrockUSB4.setup();
+  BluetoothA.setup();  // Note: a module linked through a reboot won't answer AT commands, live traffic on it
+  BluetoothB.setup();  // skips discovery, otherwise the search starts at the rate it was last found at
+  HardrockUSB.setup();
   CmdProcessor.setup();
 #if defined DUAL_SERIAL
   CmdProcessorB.setup();
@@ -114,7 +126,11 @@ void setup() {
   BluetoothB.bind(Teensy);  // Command Processor
   BluetoothB.bind(IC_705);  // IC-705 passthru
 
-  IC_705.bindDevice(Teensy, IC_705.getRigAddress());  // Route IC-705 Broadcasts to Teensy
+  IC_705.bindDevice(Teensy, IC_705.getRigAddress(),  // Route IC-705 Broadcasts to Teensy, frequency, mode, RF power and TX
+                    CICOMFilter({ CICOMResp::SetFrequencyRig, CICOMResp::SetModeFilterRig, CICOMResp::ReadBandEdges,
+                                  CICOMResp::ReadOperatingFreq, CICOMResp::ReadModeFilter, CICOMResp::SetFrequency,
+                                  CICOMResp::SetModeFilter, 0x14, 0x1C }));
+  CCapture::setReplayHandler(ReplayFrame, IC_705);     // Captured radio frames replay through the IC-705 fan-out, dry
 
   InternalTemperature.attachHighTempInterruptCelsius(fHighTempAlarmC, &HighAlarmISR);
   Teensy.enableWatchdog();
@@ -122,21 +138,26 @@ void setup() {
 }
 
 void        loop() {
+  PROFILE_SCOPE(Loop);
 #if defined DO_PING
   elapsedMillis loopTime(0);
 #endif
 
-  Teensy.Task();
-  IC_705.Task();
-  HardrockA.Task();
-  HardrockB.Task();
-  BluetoothA.Task();
-  BluetoothB.Task();
-  CmdProcessor.Task();
+  PROFILE(TeensyTask, Teensy.Task());
+  PROFILE(IC_705Task, IC_705.Task());
+  PROFILE(HardrockATask, HardrockA.Task());
+  PROFILE(HardrockBTask, HardrockB.Task());
+  PROFILE(BluetoothATask, BluetoothA.Task());
+  PROFILE(BluetoothBTask, BluetoothB.Task());
+  PROFILE(CmdProcessorTask, CmdProcessor.Task());
 #if defined DUAL_SERIAL
-  CmdProcessorB.Task();
+  PROFILE(CmdProcessorBTask, CmdProcessorB.Task());
 #endif
-  HardplaceTask();
+  PROFILE(HardplaceTask, HardplaceTask());
+  PROFILE(TraceLogTask, CTraceLog::Task());
+  PROFILE(CaptureTask, CCapture::Task());
+  PROFILE(EEPROMTask, CEEPROMStream::Task());
+  CSerialBuffers::Task();
 
 #if defined DO_PING
 #define PING_INTERVAL 10000
@@ -158,10 +179,7 @@ void        loop() {
         + " - Hardrock-A " + String((Teensy.HardrockAvailable(CTeensy::eHardrock::A)) ? pszConnected : pszDisconnected)
         + " - Hardrock-B " + String((Teensy.HardrockAvailable(CTeensy::eHardrock::B)) ? pszConnected : pszDisconnected)
         + " - Hub " + String((SerialUSBHostHub) ? pszConnected : pszDisconnected)
-        + " - HardrockUSB1 " + String((HardrockUSB1) ? pszConnected : pszDisconnected)
-        + " - HardrockUSB2 " + String((HardrockUSB2) ? pszConnected : pszDisconnected)
-        + " - HardrockUSB3 " + String((HardrockUSB3) ? pszConnected : pszDisconnected)
-        + " - HardrockUSB4 " + String((HardrockUSB4) ? pszConnected : pszDisconnected)
+        + " - HardrockUSB " + String(HardrockUSB.attached()) + "/" + String(HardrockUSB.size()) + " attached"
         + " - PTT-A " + String((Teensy.PTTEnabled(CTeensy::eHardrock::A)) ? pszEnabled : pszDisabled)
         + " - PTT-B " + String((Teensy.PTTEnabled(CTeensy::eHardrock::B)) ? pszEnabled : pszDisabled)
         + " - Tuner " + String((Teensy.TunerEnabled()) ? pszEnabled : pszDisabled)
@@ -204,14 +222,52 @@ void printStatus(CSerialDevice& rPrintDevice) {
   rPrintDevice.println("Hardrock-A      " + String((Teensy.HardrockAvailable(CTeensy::eHardrock::A)) ? pszConnected : pszDisconnected));
   rPrintDevice.println("Hardrock-B      " + String((Teensy.HardrockAvailable(CTeensy::eHardrock::B)) ? pszConnected : pszDisconnected));
   rPrintDevice.println("Hub             " + String((SerialUSBHostHub) ? pszConnected : pszDisconnected));
-  rPrintDevice.println("HardrockUSB1    " + String((HardrockUSB1) ? pszConnected : pszDisconnected));
-  rPrintDevice.println("HardrockUSB2    " + String((HardrockUSB2) ? pszConnected : pszDisconnected));
-  rPrintDevice.println("HardrockUSB3    " + String((HardrockUSB3) ? pszConnected : pszDisconnected));
-  rPrintDevice.println("HardrockUSB4    " + String((HardrockUSB4) ? pszConnected : pszDisconnected));
+  rPrintDevice.println("HardrockUSB     " + String(HardrockUSB.attached()) + " of " + String(HardrockUSB.size()) + " attached");
+  for (uint32_t uPorts(CHardrockUSB::activePorts()); uPorts; uPorts &= uPorts - 1) {
+    CHardrockUSB& rPort(HardrockUSB[__builtin_ctz(uPorts)]);
+
+    rPrintDevice.printf("%-16s%s %s\r\n", rPort.deviceName().c_str(), rPort.stateName(), rPort.modelName().c_str());
+  }
   rPrintDevice.println("PTT-A           " + String((Teensy.PTTEnabled(CTeensy::eHardrock::A)) ? pszEnabled : pszDisabled));
   rPrintDevice.println("PTT-B           " + String((Teensy.PTTEnabled(CTeensy::eHardrock::B)) ? pszEnabled : pszDisabled));
   rPrintDevice.println("Tuner           " + String((Teensy.TunerEnabled()) ? pszEnabled : pszDisabled));
+  Teensy.powerSafety().printStatus(rPrintDevice);
+  HardrockA.powerControl().printStatus(rPrintDevice, "Power control A");
+  HardrockB.powerControl().printStatus(rPrintDevice, "Power control B");
   rPrintDevice.println("CPU Temperature " + String(InternalTemperature.readTemperatureC(), 1) + "C");
+  IC_705.cloneBridge().printStatus(rPrintDevice);
+  IC_705.bridge().printStatus(rPrintDevice);
+  IC_705.mux().printStatus(rPrintDevice);
+  IC_705.printRoutes(rPrintDevice);
+  IC_705.AT().printStatus(rPrintDevice);
+  IC_705.printLinkStatus(rPrintDevice);
+  CBaudrateCache::Cache().printStatus(rPrintDevice);
+  CSerialBuffers::printStatus(rPrintDevice);
+  BluetoothA.printBridgeStatus(rPrintDevice);
+  BluetoothB.printBridgeStatus(rPrintDevice);
+  for (size_t nPort(0); nPort < HardrockUSB.size(); nPort++) {
+    if (HardrockUSB[nPort].state() >= CHardrockUSB::Identified) {
+      HardrockUSB[nPort].printBridgeStatus(rPrintDevice);
+    }
+  }
+  rPrintDevice.printf("Bluetooth A     %lu baud, %lu line errors, %lu bursts\r\n",
+                      BluetoothA.lineBaudrate(), BluetoothA.lineErrors().errors(), BluetoothA.lineErrors().bursts());
+  rPrintDevice.printf("Bluetooth B     %lu baud, %lu line errors, %lu bursts\r\n",
+                      BluetoothB.lineBaudrate(), BluetoothB.lineErrors().errors(), BluetoothB.lineErrors().bursts());
+  CEEPROMStream::printStatus(rPrintDevice);
+}
+
+void printLinkHealth(CSerialDevice& rPrintDevice, bool fReset) {
+  if (fReset) {
+    IC_705.health().reset();
+    BluetoothA.health().reset();
+    BluetoothB.health().reset();
+    rPrintDevice.println("OK");
+    return;
+  }
+  IC_705.health().printStatus(rPrintDevice, "IC-705");
+  BluetoothA.health().printStatus(rPrintDevice, "Bluetooth A");
+  BluetoothB.health().printStatus(rPrintDevice, "Bluetooth B");
 }
 
 namespace {
@@ -256,6 +312,13 @@ void HardplaceTask(void) {
   }
   wasConnected = isConnected;
 
+  for (uint32_t uPorts(CHardrockUSB::activePorts()); uPorts; uPorts &= uPorts - 1) {  // Attached ports only
+    CHardrockUSB& rPort(HardrockUSB[__builtin_ctz(uPorts)]);
+
+    if (!rPort.isBound()) {
+      rPort.Task();  // Attach, probe and identify, a bound port runs from its Hardrock pair
+    }
+  }
   ManageBindings();
 
   Teensy.TunerEnable(
@@ -295,7 +358,24 @@ void ReadRFPower(bool fNow) {
   }
 }
 
-void ManageBindings(void) {
+void ManageBindings(void) {  // Only when a USB port, the binding map or a Hardrock pair changed since the last pass
+  static uint32_t uLastGeneration(UINT32_MAX);
+  static uint32_t uLastRevision(UINT32_MAX);
+  static uint32_t uLastState(UINT32_MAX);
+  const uint32_t  uGeneration(CHardrockUSB::generation());
+  const uint32_t  uRevision(Teensy.bindingsRevision());
+  const uint32_t  uState((uint32_t(BluetoothA.isBound(HardrockA.deviceClass())) << 5)
+                        | (uint32_t(BluetoothB.isBound(HardrockB.deviceClass())) << 4)
+                        | (uint32_t(HardrockA.isConnected()) << 3) | (uint32_t(HardrockA.isBound()) << 2)
+                        | (uint32_t(HardrockB.isConnected()) << 1) | uint32_t(HardrockB.isBound()));
+
+  if (uGeneration == uLastGeneration
+      && uRevision == uLastRevision
+      && uState == uLastState) {
+    return;
+  }
+  uLastGeneration = uGeneration, uLastRevision = uRevision, uLastState = uState;
+
   if (HardrockA.isConnected()) {
     if (!HardrockA.isBound()) {
       if (!BindByMap(HardrockA)) {
@@ -330,20 +410,18 @@ bool BindByMap(CHardrockPair& rHardrock) {
                               : CTeensy::eBinding::HardrockB);
 
   if (rHardrock.isConnected() && !rHardrock.isBound()) {
-    CHardrockUSB* aHardrockUSB[4] = { &HardrockUSB1, &HardrockUSB2, &HardrockUSB3, &HardrockUSB4 };
+    const String sModelName(rHardrock.modelName());
 
-    for (size_t nIndex(0);
-         (!fBound && nIndex < sizeof aHardrockUSB / sizeof(CHardrockUSB*)); nIndex++) {
-      if (aHardrockUSB[nIndex]->isUSBConnected()) {
+    for (uint32_t uPorts(CHardrockUSB::activePorts()); !fBound && uPorts; uPorts &= uPorts - 1) {
+      CHardrockUSB& rPort(HardrockUSB[__builtin_ctz(uPorts)]);
+
+      if (rPort.isUSBConnected()) {
         CTeensy::eBinding Binding(Teensy.getBinding(
-          aHardrockUSB[nIndex]->idProduct(), aHardrockUSB[nIndex]->idVendor(),
-          aHardrockUSB[nIndex]->serialNumber(), rHardrock.modelName()));
-        if (Binding == eTarget && !aHardrockUSB[nIndex]->isBound()) {
+          rPort.fingerprint(sModelName.c_str()), rPort.idProduct(), rPort.idVendor()));
+        if (Binding == eTarget && !rPort.isBound()) {
           rHardrock.bind((rHardrock.serialPort() == CTeensy::eHardrock::A) ? BluetoothA : BluetoothB,
-                         *aHardrockUSB[nIndex]);
-          Tracer.TraceLn(
-            rHardrock.deviceName() + " Bound by map to "
-            + String((rHardrock.serialPort() == CTeensy::eHardrock::A) ? "BluetoothA" : "BluetoothB"));
+                         rPort);
+          TRACE_EVENT(TraceHardrock, TraceInfo, HardrockBound, rHardrock.serialPort(), 1);  // By map
           fBound = true;
         }
       }
@@ -353,26 +431,25 @@ bool BindByMap(CHardrockPair& rHardrock) {
 }
 
 void BindByPort(CHardrockPair& rHardrock) {
-  CHardrockUSB*                  aHardrock[4] = { &HardrockUSB1, &HardrockUSB2, &HardrockUSB3, &HardrockUSB4 };
   CHardrockBluetoothSlaveDevice& rBluetooth(
     (rHardrock.serialPort() == CTeensy::eHardrock::A) ? BluetoothA : BluetoothB);
 
   if (rHardrock.isConnected() && !rHardrock.isBound()
       && !rBluetooth.isBound(rHardrock.deviceClass())) {
-    for (size_t nIndex(0); nIndex < sizeof aHardrock / sizeof(CHardrockUSB*); nIndex++) {
-      if (aHardrock[nIndex]->isHardrockConnected()
-          && aHardrock[nIndex]->isConnected() && !aHardrock[nIndex]->isBound()
-          && rHardrock.modelName() == aHardrock[nIndex]->modelName()) {
-        rHardrock.bind(rBluetooth, *aHardrock[nIndex]);
+    for (uint32_t uPorts(CHardrockUSB::activePorts()); uPorts; uPorts &= uPorts - 1) {
+      CHardrockUSB& rPort(HardrockUSB[__builtin_ctz(uPorts)]);
+
+      if (rPort.isHardrockConnected()
+          && rPort.isConnected() && !rPort.isBound()
+          && rHardrock.modelName() == rPort.modelName()) {
+        rHardrock.bind(rBluetooth, rPort);
         Teensy.bind(
           (rHardrock.serialPort() == CTeensy::eHardrock::A)
             ? CTeensy::eBinding::HardrockA
             : CTeensy::eBinding::HardrockB,
-          aHardrock[nIndex]->idProduct(), aHardrock[nIndex]->idVendor(),
-          aHardrock[nIndex]->serialNumber(), aHardrock[nIndex]->modelName());
-        Tracer.TraceLn(
-          rHardrock.deviceName() + " Bound by port to "
-          + String((rHardrock.serialPort() == CTeensy::eHardrock::A) ? "BluetoothA" : "BluetoothB"));
+          rPort.idProduct(), rPort.idVendor(),
+          rPort.serialNumber(), rPort.modelName());
+        TRACE_EVENT(TraceHardrock, TraceInfo, HardrockBound, rHardrock.serialPort(), 0);  // By port
         break;
       }
     }
@@ -390,4 +467,8 @@ void LowAlarmISR(void) {
   // set an alarm at high temperature
   InternalTemperature.attachHighTempInterruptCelsius(fHighTempAlarmC, &HighAlarmISR);
 }
+
+void ReplayFrame(const uint8_t* puchFrame, size_t stFrame) {
+  IC_705.onReplay(puchFrame, stFrame);
+}
 }
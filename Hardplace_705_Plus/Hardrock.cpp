@@ -5,6 +5,7 @@
 #include "Hardrock50Plus.h"
 #include "Hardrock500.h"
 #include "SerialDevice.h"
+#include "TraceLog.h"
 
 const char* CHardrock50::modelName() {
   return "Hardrock50";
@@ -55,10 +56,7 @@ public:
       setBaudrate(aulBaudrates[nIndex]);
       fHaveComms = HardrockCommand(pszBandCmd);
       if (fHaveComms) {
-        Tracer().TraceLn(
-            "Hardrock found at "
-            + String(aulBaudrates[nIndex])
-            + " baud");
+        TRACE_EVENT(TraceHardrock, TraceInfo, HardrockBaudrate, aulBaudrates[nIndex], 0);
       }
     }
     if (!fHaveComms) {
@@ -37,6 +37,9 @@
 #include "SerialDevice.h"
 #include "Teensy41.h"
 #include "Tracer.h"
+#include "Profiler.h"
+#include "TraceLog.h"
+#include "Capture.h"
 
 class CHardrock : public CSerialDevice {
 public:
@@ -120,18 +123,34 @@ public:
   }
 
   size_t write(const String& rCmd) {
-    while (m_LastReadWrite <= m_IntercommandPeriod) {
-      Delay(1);
+    {
+      PROFILE_SCOPE(HardrockWriteSpacing);
+      while (m_LastReadWrite <= m_IntercommandPeriod) {
+        Delay(1);
+      }
     }
     clear();
 
     size_t stWritten(CSerialDevice::write(rCmd));
-    // Tracer().TraceLn("Hardrock::write: " + rCmd);
+    TRACE_DATA(TraceHardrock, TraceDebug, HardrockToAmp,
+               reinterpret_cast<const uint8_t*>(rCmd.c_str()), rCmd.length());
+    CAPTURE_FRAME(*this, CaptureTx, reinterpret_cast<const uint8_t*>(rCmd.c_str()), rCmd.length());
     m_LastReadWrite = 0;
     return stWritten;
   }
+  bool isWriteDue(void) const {  // write() won't wait out the intercommand spacing
+    return m_LastReadWrite > m_IntercommandPeriod;
+  }
+  void onFrameRead(const char* pchFrame, size_t stFrame) {  // A response the owner assembled itself, logged as one read here
+    TRACE_DATA(TraceHardrock, TraceDebug, HardrockFromAmp, reinterpret_cast<const uint8_t*>(pchFrame), stFrame);
+    CAPTURE_FRAME(*this, CaptureRx, reinterpret_cast<const uint8_t*>(pchFrame), stFrame);
+    m_LastReadWrite = 0;
+  }
   String readStringUntil(char terminator) {
     String Rsp(CSerialDevice::readStringUntil(terminator));
+    TRACE_DATA(TraceHardrock, TraceDebug, HardrockFromAmp,
+               reinterpret_cast<const uint8_t*>(Rsp.c_str()), Rsp.length());
+    CAPTURE_FRAME(*this, CaptureRx, reinterpret_cast<const uint8_t*>(Rsp.c_str()), Rsp.length());
     for (size_t nIndex(0); nIndex < Rsp.length();) {
       if (!isAlphaNumeric(Rsp[nIndex])
           && Rsp[nIndex] != ';') {
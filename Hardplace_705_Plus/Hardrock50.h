@@ -28,7 +28,7 @@ public:
 
 public:
   virtual void setFrequency(uint64_t ullFrequencyHz) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     m_FreqSupported = ullFrequencyHz < 30000000;
     if (availableForWrite()) {
       char achBuf[32];
@@ -38,7 +38,7 @@ public:
     }
   }
   virtual bool isHardrockConnected(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRBN;");
       write(Cmd);
@@ -49,7 +49,7 @@ public:
   }
   virtual unsigned getFrequencyBand(void) {
     // HRBN;HRBN5;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRBN;");
       write(Cmd);
@@ -62,7 +62,7 @@ public:
   }
   virtual void setFrequencyBand(unsigned uBand) {
     // HRBN7;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRBN");
       Cmd += uBand;
@@ -110,7 +110,7 @@ public:
   }
   virtual int getKeyingMode(void) {
     // HRMD;HRMD0;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRMD;");
       write(Cmd);
@@ -126,7 +126,7 @@ public:
   }
   virtual void setKeyingMode(bool bPTTOn) {
     // HRMD1; 0 (OFF), 1 (PTT), 2 (COR), 3 (QRP)
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRMD");
       Cmd += (bPTTOn) ? "1" : "0";
@@ -139,7 +139,7 @@ public:
     // HRPWR;HRPWR000;<CR><LF>
     // HRPWD;HRPWD000;<CR><LF>
     // HRPWV;HRPWV000;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd(String(String("HRPW") + String(chWhich) + String(';')));
       write(Cmd);
@@ -162,7 +162,7 @@ public:
   }
   virtual String getTemperature(void) {
     // HRTP;HRTP69F;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTP;");
       write(Cmd);
@@ -181,7 +181,7 @@ public:
   }
   virtual void setTemperatureScaleCelsius(bool bCelsius) {
     // HRTSC;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String sCmd(String("HRTS") + (bCelsius) ? 'C' : 'F' + ';');
       write(sCmd);
@@ -189,7 +189,7 @@ public:
   }
   virtual float getDCInputVoltage(void) {
     // HRVT;HRVT58;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRVT;");
       write(Cmd);
@@ -201,7 +201,7 @@ public:
     return 0;
   }
   virtual bool isATUPresent(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMV?;");
       write(Cmd);
@@ -211,14 +211,14 @@ public:
     return false;
   }
   virtual void Tune(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMA;");
       write(Cmd);
     }
   }
   virtual bool isTuning(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMS?;");
       write(Cmd);
@@ -233,7 +233,7 @@ public:
     return 1;
   }
   virtual bool SaveATUSettings(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMQ;");
       return (write(Cmd) == Cmd.length());
@@ -241,7 +241,7 @@ public:
     return false;
   }
   virtual bool isTunerByPassed(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMY?;");
       write(Cmd);
@@ -255,7 +255,7 @@ public:
     return false;
   }
   virtual void setTunerByPass(bool bByPass) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMY");
       Cmd += (bByPass) ? "1;" : "0;";
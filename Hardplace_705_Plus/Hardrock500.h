@@ -189,7 +189,7 @@ public:
 
 public:
   virtual void setFrequency(uint64_t ullFrequencyHz) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     m_FreqSupported = ullFrequencyHz < 30000000;
     if (availableForWrite()) {
       char achBuf[32];
@@ -201,7 +201,7 @@ public:
 
   bool isHardrockConnected(void) {
     // HRAA;HRAA;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRAA;");
       String Rsp;
@@ -216,7 +216,7 @@ public:
 
   unsigned getFrequencyBand(void) {
     // HRBN;HRBN5;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRBN;");
       write(Cmd);
@@ -230,7 +230,7 @@ public:
 
   void setFrequencyBand(unsigned uBand) {
     // HRBN7;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRBN");
       Cmd += uBand;
@@ -280,7 +280,7 @@ public:
 
   int getKeyingMode(void) {
     // HRMD;HRMD0;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRMD;");
       write(Cmd);
@@ -295,7 +295,7 @@ public:
 
   void setKeyingMode(bool bPTTOn) {
     // HRMD1;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRMD");
       Cmd += (bPTTOn) ? "1" : "0";
@@ -309,7 +309,7 @@ public:
     // HRPWR;HRPWR000;<CR><LF>
     // HRPWD;HRPWD000;<CR><LF>
     // HRPWV;HRPWV000;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd(String(String("HRPW") + String(chWhich) + String(';')));
       write(Cmd);
@@ -334,7 +334,7 @@ public:
 
   String getTemperature(void) {
     // HRTP;HRTP69F;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTP;");
       write(Cmd);
@@ -355,7 +355,7 @@ public:
 
   void setTemperatureScaleCelsius(bool bCelsius) {
     // HRTSC;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String sCmd(String("HRTS") + (bCelsius) ? 'C' : 'F' + ';');
       write(sCmd);
@@ -364,7 +364,7 @@ public:
 
   float getDCInputVoltage(void) {
     // HRVT;HRVT58;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRVT;");
       write(Cmd);
@@ -378,7 +378,7 @@ public:
 
   bool isATUPresent(void) {
     // HRAP:HRAP1;/HRAP0;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRAP;");
       write(Cmd);
@@ -390,7 +390,7 @@ public:
   }
 
   void Tune(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTU;");
       write(Cmd);
@@ -398,7 +398,7 @@ public:
   }
 
   bool isTuning(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTT;");
       write(Cmd);
@@ -410,7 +410,7 @@ public:
   }
 
   unsigned getActiveAntenna(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRAN;");
       write(Cmd);
@@ -424,7 +424,7 @@ public:
   }
 
   bool SaveATUSettings(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMQ;");
       return (write(Cmd) == Cmd.length());
@@ -439,7 +439,7 @@ public:
        Example: HRTB0; bypasses the ATU
     */
   bool isTunerByPassed(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTB;");
       write(Cmd);
@@ -453,7 +453,7 @@ public:
   }
 
   void setTunerByPass(bool bByPass) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTB");
       Cmd += (bByPass) ? "0;" : "1;";
@@ -29,7 +29,7 @@ public:
 public:
   virtual void setFrequency(uint64_t ullFrequencyHz) {
     m_FreqSupported = ullFrequencyHz < 30000000;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       char achBuf[32];
       sprintf(achBuf, "FA%011llu;", ullFrequencyHz);
@@ -39,7 +39,7 @@ public:
   }
   virtual bool isHardrockConnected(void) {
     // HRAA;HRAA;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRAA;");
       String Rsp;
@@ -53,7 +53,7 @@ public:
   }
   virtual unsigned getFrequencyBand(void) {
     // HRBN;HRBN5;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRBN;");
       write(Cmd);
@@ -66,7 +66,7 @@ public:
   }
   virtual void setFrequencyBand(unsigned uBand) {
     // HRBN7;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
 
     if (availableForWrite()) {
       String Cmd("HRBN");
@@ -115,14 +115,14 @@ public:
   }
   virtual int getKeyingMode(void) {
     // HRMD;HRMD0;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRMD;");
       write(Cmd);
       String Rsp(readString());
       if (isValidResponse(Rsp, Cmd)  // There is some strangness where keying mode comes up invalid
           && Rsp.length() > 6) {     // on powerup (HRMD144;) or such,
-        setKeyingMode(true);         // if this is the case switch it to PTT
+        write(String("HRMD1;"));     // if this is the case switch it to PTT, the port is already locked
         write(Cmd);
         Rsp = readString();
       }
@@ -137,7 +137,7 @@ public:
   }
   virtual void setKeyingMode(bool bPTTOn) {
     // HRMD1; 0 (OFF), 1 (PTT), 2 (COR), 3 (QRP)
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRMD");
       Cmd += (bPTTOn) ? "1" : "0";
@@ -150,7 +150,7 @@ public:
     // HRPWR;HRPWR000;<CR><LF>
     // HRPWD;HRPWD000;<CR><LF>
     // HRPWV;HRPWV000;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd(String(String("HRPW") + String(chWhich) + String(';')));
       write(Cmd);
@@ -173,7 +173,7 @@ public:
   }
   virtual String getTemperature(void) {
     // HRTP;HRTP69F;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTP;");
       write(Cmd);
@@ -192,7 +192,7 @@ public:
   }
   virtual void setTemperatureScaleCelsius(bool bCelsius) {
     // HRTSC;
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String sCmd(String("HRTS") + (bCelsius) ? 'C' : 'F' + ';');
       write(sCmd);
@@ -200,7 +200,7 @@ public:
   }
   virtual float getDCInputVoltage(void) {
     // HRVT;HRVT58;<CR><LF>
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRVT;");
       write(Cmd);
@@ -212,7 +212,7 @@ public:
     return 0;
   }
   virtual bool isATUPresent(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMV?;");
       write(Cmd);
@@ -222,14 +222,14 @@ public:
     return false;
   }
   virtual void Tune(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMA;");
       write(Cmd);
     }
   }
   virtual bool isTuning(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMS?;");
       write(Cmd);
@@ -244,7 +244,7 @@ public:
     return 1;
   }
   virtual bool SaveATUSettings(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTMQ;");
       return (write(Cmd) == Cmd.length());
@@ -252,7 +252,7 @@ public:
     return false;
   }
   virtual bool isTunerByPassed(void) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTB;");
       write(Cmd);
@@ -265,7 +265,7 @@ public:
     return false;
   }
   virtual void setTunerByPass(bool bByPass) {
-    CHardrock::autolock(*this);
+    CHardrock::autolock Lock(*this);
     if (availableForWrite()) {
       String Cmd("HRTB");
       Cmd += (bByPass) ? "0;" : "1;";
@@ -7,6 +7,8 @@
 #include "HC_06.h"
 #include "BoundDevice.h"
 #include "Tracer.h"
+#include "Capture.h"
+#include "TextFrame.h"
 
 
 class CHardrockBluetoothSlaveDevice : public CBluetoothSlaveDevice, public CBoundDevice {
@@ -27,6 +29,7 @@ private:
 public:
   virtual void Task(void) {
     CSerialDevice::Task();
+    m_Batch.flush(*this);  // What didn't fit last time
   }
   void bind(CBoundDevice& rDevice) {
     m_BoundDevices.bind(rDevice);
@@ -43,34 +46,83 @@ public:
     return fBound;
   }
   virtual void onAvailable(void) {
-    if (peek() == 0xFE) {
+    if (m_Parser.isEmpty()
+        && peek() == 0xFE) {
       const size_t stBuf(128);
       uint8_t*     pauchBuf(new uint8_t[stBuf]);
       size_t       stRead(readBytesUntil(0xFD, pauchBuf, stBuf));
 
+      if (stRead < 2
+          || stRead == stBuf
+          || pauchBuf[1] != 0xFE) {
+        onLineError();
+      } else {
+        m_Health.onFrame();
+      }
+      CAPTURE_FRAME(*this, CaptureRx, pauchBuf, stRead);
+
       for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
         m_BoundDevices.get(nIndex)->onNewPacket(pauchBuf, stRead, *this);
       }
       delete[] pauchBuf;
     } else {
-      while (available()
-             && !isAlphaNumeric(peek())
-             && peek() != ';') {
-        read();
+      bool fFrames(false);
+
+      while (available() > 0) {  // Every frame that's here, none that isn't
+        switch (m_Parser.feed(read())) {
+          case CTextFrameParser::Partial:
+            break;
+
+          case CTextFrameParser::Junk:
+            onLineError();
+            break;
+
+          case CTextFrameParser::Frame:
+            m_Health.onFrame();
+            m_RxRate.onFrame(m_Parser.length());
+            CAPTURE_FRAME(*this, CaptureRx, reinterpret_cast<const uint8_t*>(m_Parser.frame()), m_Parser.length());
+            for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
+              m_BoundDevices.get(nIndex)->onTextFrame(m_Parser.frame(), m_Parser.length(), *this);
+            }
+            m_Parser.next();
+            fFrames = true;
+            break;
+        }
+        if (m_Parser.isEmpty()
+            && peek() == 0xFE) {
+          break;  // CI-V next time round
+        }
       }
-      if (available()) {
-        String sData(readStringUntil(';'));
+      if (fFrames) {
         for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
-          m_BoundDevices.get(nIndex)->onNewPacket(sData, *this);
+          m_BoundDevices.get(nIndex)->onBurstEnd(*this);
         }
       }
     }
   }
   virtual void onNewPacket(const String& rsPacket, CSerialDevice& rSrcDevice) {
     write(rsPacket.c_str(), rsPacket.length());
+    CAPTURE_FRAME(*this, CaptureTx, reinterpret_cast<const uint8_t*>(rsPacket.c_str()), rsPacket.length());
+  }
+  virtual void onTextFrame(const char* pchFrame, size_t stFrame, CSerialDevice& rSrcDevice) {
+    m_Batch.append(pchFrame, stFrame, *this);
+    CAPTURE_FRAME(*this, CaptureTx, reinterpret_cast<const uint8_t*>(pchFrame), stFrame);
+  }
+  virtual void onBurstEnd(CSerialDevice& rSrcDevice) {
+    m_Batch.flush(*this);
+  }
+
+  void printBridgeStatus(Print& rDevice) const {
+    rDevice.printf("%-15s in %lu B/s %lu frames/s, out %lu B/s %lu frames/s, %lu frames in %lu writes, %lu dropped\r\n",
+                   deviceName().c_str(), m_RxRate.bytesPerSec(), m_RxRate.framesPerSec(),
+                   m_Batch.rate().bytesPerSec(), m_Batch.rate().framesPerSec(),
+                   m_Batch.rate().frames(), m_Batch.writes(), m_Batch.dropped() + m_Parser.dropped());
   }
 
 private:
   CBoundDeviceList m_BoundDevices;
+  CTextFrameParser m_Parser;
+  CTextFrameBatch  m_Batch;
+  CFrameRate       m_RxRate;
 };
 #endif
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include "HardrockPair.h"
 #include "Tracer.h"
+#include "TraceLog.h"
 
 #if defined USE_THREADS
 void        CHardrockPair::newHardrock(void* pThis) {
@@ -26,10 +27,7 @@ bool CHardrockPair::newHardrock(void) {
   m_pHardrock.reset(CHardrock::CHardrockFactory(*this));
 
   if (m_pHardrock) {
-    m_pHardrock->Tracer().TraceLn(
-      "Found new Hardrock "
-      + String(m_pHardrock->Model()));
-
+    TRACE_EVENT(TraceHardrock, TraceInfo, HardrockFound, m_Port, m_pHardrock->getBaudrate());
     m_pHardrock->setup();
     if (m_rTeensy.getFrequencyHz()) {
       m_pHardrock->setFrequency(m_rTeensy.getFrequencyHz());
@@ -39,9 +37,6 @@ bool CHardrockPair::newHardrock(void) {
 
     if (m_pHardrock->isATUPresent()
         || m_pHardrock->isATUPresent()) {
-      m_pHardrock->Tracer().TraceLn(
-        String(m_pHardrock->Model())
-        + " has ATU installed");
       m_pTuner = std::make_shared<CIC_705Tuner>(m_rTeensy, m_rIC705, *m_pHardrock);
       if (m_pTuner) {
         m_pTuner->setup();
@@ -58,23 +53,30 @@ bool CHardrockPair::newHardrock(void) {
   return bool(m_pHardrock);
 }
 void CHardrockPair::onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice) {
-  if (m_pHardrock) {
-    CICOMResp Resp(puPacket, stPacket);
-
-    if (Resp.isFrequencyResponse()) {
-      m_pHardrock->setFrequency(Resp.FrequencyHz());
-    }
+  onNewFrame(CICOMResp(CICOMResp::NoCopy, puPacket, stPacket), rSrcDevice);
+}
+bool CHardrockPair::onNewFrame(const CICOMResp& rFrame, CSerialDevice& rSrcDevice) {
+  if (m_pHardrock
+      && rFrame.isFrequencyResponse()) {
+    endSample();  // The main loop, it holds the port for a power sample
+    m_pHardrock->setFrequency(rFrame.FrequencyHz());
   }
+  return true;
 }
 void CHardrockPair::onNewPacket(const String& rsPacket, CSerialDevice& rSrcDevice) {
   if (m_pHardrock
       && CHardrock::isHardrockPacket(rsPacket)) {
+    endSample();  // The client's command first, the sample starts over on the next poll
+#if defined USE_THREADS
+    Threads::Scope wait(*m_pHardrock);  // The command and its response, between the monitors' polls
+#endif
     m_pHardrock->write(rsPacket);
 
     if (m_pHardrock->isResponseExpected(rsPacket)) {
       String sRsp(m_pHardrock->readStringUntil(';'));
       if (sRsp.length()) {
         rSrcDevice.write(sRsp.c_str(), sRsp.length());
+        CAPTURE_FRAME(rSrcDevice, CaptureTx, reinterpret_cast<const uint8_t*>(sRsp.c_str()), sRsp.length());
       }
     }
   }
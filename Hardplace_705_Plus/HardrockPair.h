@@ -19,8 +19,10 @@
 #include "HardrockBluetooth.h"
 #include "HardrockUSB.h"
 #include "EEPromStream.h"
+#include "PowerControl.h"
+#include "TextFrame.h"
 
-#define VER_HARDROCKPAIR 1
+#define VER_HARDROCKPAIR 2  // 1 was positional
 
 class CHardrockPair : public CSerialDevice, public CBoundDevice, private CEEPROMStream {
 public:
@@ -34,11 +36,13 @@ public:
                       : CTeensy::eEEPromRecordTypes::HardrockBType,
                     VER_HARDROCKPAIR),
       m_Port(eWhich), m_rTeensy(rTeensy),
-      m_rIC705(rIC705), m_ICOM(uchRigAddress), m_pHardrock(0), m_pTuner(0),
-      m_fWasAttached(false), m_fWasCreated(false), m_bFrequencyRequested(false),
+      m_rIC705(rIC705), m_ICOM(uchRigAddress), m_pHardrock(0), m_pTuner(0), m_eSample(SampleIdle),
+      m_fSampleSent(false), m_fWasAttached(false), m_fWasCreated(false), m_bFrequencyRequested(false),
       m_uActiveAntenna(1), m_pBluetooth(0), m_pUSB(0), m_ulBaudrate(CSerialDevice::getBaudrate()) {
     Serialize(haveRecord());
-    m_rIC705.bindDevice(*this, uchRigAddress);
+    m_rIC705.bindDevice(*this, uchRigAddress,  // Frequency changes only
+                        CICOMFilter({ CICOMResp::SetFrequencyRig, CICOMResp::ReadBandEdges,
+                                      CICOMResp::ReadOperatingFreq, CICOMResp::SetFrequency }));
   }
   ~CHardrockPair() {
     m_rIC705.unbindDevice(*this);
@@ -51,6 +55,10 @@ private:
   CHardrockPair(const CHardrockPair&);
   CHardrockPair& operator=(const CHardrockPair&);
 
+  virtual void Commit(void) {  // setDirty() coalesced
+    Serialize();
+  }
+
 public:
   void setup(void) {
     setBaudrate(m_ulBaudrate);
@@ -72,8 +80,10 @@ public:
         m_fWasCreated = newHardrock();
 #endif
       } else if (m_pHardrock) {
-        m_ulBaudrate = m_pHardrock->getBaudrate();
-        Serialize();
+        if (m_ulBaudrate != m_pHardrock->getBaudrate()) {
+          m_ulBaudrate = m_pHardrock->getBaudrate();
+          setDirty();
+        }
 
         if (!m_bFrequencyRequested) {
           m_ICOM.ReadOperatingFreq(m_rIC705);
@@ -109,6 +119,7 @@ public:
           m_Poll = 0;
         }
 #endif
+        controlPower();
         if (m_pUSB) {
           m_pUSB->Task();
         }
@@ -118,6 +129,7 @@ public:
       threads.yield();
 #endif
       unbind();
+      endSample();
       m_fWasAttached = m_fWasCreated = m_bFrequencyRequested = false;
       m_pTuner.reset();
       m_pHardrock.reset();
@@ -143,6 +155,9 @@ public:
   bool isATUPresent(void) const {
     return bool(m_pTuner);
   }
+  const CPowerControl& powerControl(void) const {
+    return m_PowerControl;
+  }
 public:
   void bind(CHardrockBluetoothSlaveDevice& rBluetooth, CHardrockUSB& rUSB) {
     rBluetooth.bind(rUSB);
@@ -161,18 +176,144 @@ public:
     return m_pBluetooth != 0 || m_pUSB != 0;
   }
   void Serialize(bool bLoad = false) {
-    CEEPROMStream::rewind();
+    const SField aFields[] = {
+      field(1, m_ulBaudrate)
+    };
 
-    if (bLoad) {
+    if (!bLoad) {
+      putFields(aFields, sizeof aFields / sizeof aFields[0]);
+    } else if (Version() < VER_HARDROCKPAIR) {
+      CEEPROMStream::rewind();
       get(m_ulBaudrate);
+      setDirty();
     } else {
-      put(m_ulBaudrate);
-      CEEPROMStream::flush();
+      getFields(aFields, sizeof aFields / sizeof aFields[0]);
     }
   }
 
 private:
   bool newHardrock(void);
+  // Power control, from the main loop a step at a time. A sample is the forward power, and while transmitting the
+  // drive and SWR, one request per pass and its reply picked up as it arrives, with the port held from the first
+  // request to the last reply. Only the amplifier in use, while the radio is transmitting into a target in CW or
+  // digital.
+  enum eSample {
+    SampleIdle,
+    SampleForward,
+    SampleDrive,
+    SampleSWR
+  };
+
+  enum {
+    ReplyMillis = 250  // As CHardrock::readString()
+  };
+
+  static const char* sampleCmd(eSample eStep) {
+    static const char* const apszCmds[] = { "", "HRPWF;", "HRPWD;", "HRPWV;" };
+
+    return apszCmds[eStep];
+  }
+
+  void controlPower(void) {
+    if (m_eSample == SampleIdle) {
+      startSample();
+    } else if (m_fSampleSent) {
+      readSample();
+    } else if (m_pHardrock->isWriteDue()) {
+      m_PowerFrame.next();
+      m_pHardrock->write(String(sampleCmd(m_eSample)));
+      m_fSampleSent = true;
+      m_Reply = 0;
+    }
+  }
+  void startSample(void) {
+    if (m_PowerPoll < CPowerControl::PollMillis
+        || m_rTeensy.isTuning()) {
+      return;
+    }
+    m_PowerPoll = 0;
+    m_PowerState = m_rTeensy.powerState();
+    if (m_PowerState.m_eActiveAmp != m_Port
+        || m_PowerState.m_fSafetyPending
+        || !m_PowerState.m_uTargetWatts
+        || !m_PowerState.m_fModeKnown
+        || m_PowerState.m_eModeClass == CPowerProfile::Phone
+        || !m_PowerState.m_fTransmitting) {
+      m_PowerControl.idle();
+      return;
+    }
+#if defined USE_THREADS
+    if (!static_cast<Threads::Mutex&>(*m_pHardrock).try_lock()) {
+      return;  // A monitor has the port, the next poll
+    }
+#endif
+    m_eSample = SampleForward;
+    m_fSampleSent = false;
+  }
+  void readSample(void) {
+    CSerialDevice& rPort(*m_pHardrock);  // The byte reads, CHardrock's read() is a whole response
+
+    while (rPort.available() > 0) {
+      if (m_PowerFrame.feed(rPort.read()) == CTextFrameParser::Frame) {
+        if (strncmp(m_PowerFrame.frame(), sampleCmd(m_eSample), 5) == 0) {
+          onReading(atof(m_PowerFrame.frame() + 5));
+          return;
+        }
+        m_PowerFrame.next();  // Not ours, a late reply
+      }
+    }
+    if (m_Reply >= ReplyMillis) {
+      endSample();  // No reply, the next poll starts over
+    }
+  }
+  void onReading(float fReading) {
+    m_pHardrock->onFrameRead(m_PowerFrame.frame(), m_PowerFrame.length());
+    m_PowerFrame.next();
+    m_afReading[m_eSample - SampleForward] = fReading;
+    m_fSampleSent = false;
+    switch (m_eSample) {
+      case SampleForward:
+        if (fReading >= CPowerControl::MinForwardWatts) {
+          m_eSample = SampleDrive;
+        } else {
+          m_afReading[SampleDrive - SampleForward] = m_afReading[SampleSWR - SampleForward] = 0;
+          finishSample();
+        }
+        break;
+
+      case SampleDrive:
+        m_eSample = SampleSWR;
+        break;
+
+      default:
+        if (fReading < 1.0f) {
+          endSample();  // A bad read, it isn't a perfect match and mustn't lift a fold-back
+        } else {
+          finishSample();
+        }
+        break;
+    }
+  }
+  void finishSample(void) {
+    endSample();
+
+    const int iLevel(m_PowerControl.onSample(m_afReading[0], m_afReading[1], m_afReading[2], m_PowerState.m_uTargetWatts,
+                                             m_PowerState.m_uchRFLevel, m_PowerState.m_uchMaxPower));
+
+    if (iLevel >= 0
+        && m_rIC705.WriteRFPower(iLevel)) {
+      m_rTeensy.onRFLevel(iLevel);
+    }
+  }
+  void endSample(void) {  // Main loop, before anything there uses the port
+    if (m_eSample != SampleIdle) {
+      m_eSample = SampleIdle;
+      m_fSampleSent = false;
+#if defined USE_THREADS
+      static_cast<Threads::Mutex&>(*m_pHardrock).unlock();
+#endif
+    }
+  }
 #if defined USE_THREADS
   static void newHardrock(void* pThis);
   static void AntennaMonitor(void* pThis);
@@ -232,6 +373,7 @@ private:
 public:
   virtual void onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice);
   virtual void onNewPacket(const String& rsPacket, CSerialDevice& rSrcDevice);
+  virtual bool onNewFrame(const CICOMResp& rFrame, CSerialDevice& rSrcDevice);
 
 private:
   CTeensy::eHardrock             m_Port;
@@ -242,6 +384,14 @@ private:
   std::shared_ptr<CIC_705Tuner>  m_pTuner;
   elapsedMillis                  m_StartupDelay;
   elapsedMillis                  m_Poll;
+  elapsedMillis                  m_PowerPoll;
+  CPowerControl                  m_PowerControl;
+  CTextFrameParser               m_PowerFrame;
+  CTeensy::SPowerState           m_PowerState;
+  eSample                        m_eSample;
+  bool                           m_fSampleSent;
+  elapsedMillis                  m_Reply;
+  float                          m_afReading[3];  // Forward, drive, SWR
   bool                           m_fWasAttached;
   volatile bool                  m_fWasCreated;
   bool                           m_bFrequencyRequested;
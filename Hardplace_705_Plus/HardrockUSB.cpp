@@ -1,29 +1,196 @@
 #include "HardrockUSB.h"
+#include "Hardrock50.h"
+#include "Hardrock50Plus.h"
+#include "Hardrock500.h"
+#include "TraceLog.h"
 
-#if defined USE_THREADS
-
-bool CHardrockUSB::getHardrockModel(void* pThis) {
-  CHardrockUSB*  pHardrockUSB(reinterpret_cast<CHardrockUSB*>(pThis));
-  Threads::Scope wait(pHardrockUSB->m_Mutex);
-  return pHardrockUSB->getHardrockModel();
-}
-#endif
-
-bool CHardrockUSB::getHardrockModel(void) {
-  if (!m_HardrockFound) {
-    CHardrock* pHardrock(CHardrock::CHardrockFactory(*this));
-    if (pHardrock) {
-      const_cast<String&>(m_sModel) = pHardrock->Model();
-      Tracer().TraceLn(
-        deviceName()
-        + " Connected to "
-        + pHardrock->Model());
-      delete pHardrock;
-      m_HardrockFound = true;
-    } else {
-      Tracer().TraceLn(deviceName() + " Hardrock Not Found");
-      const_cast<String&>(m_sModel) = m_pszUnknown;
+CHardrockUSB::SProbeCache CHardrockUSB::m_aCache[CHardrockUSB::CacheEntries];
+size_t                    CHardrockUSB::m_nCacheNext(0);
+volatile uint32_t         CHardrockUSB::m_uActivePorts(0);
+volatile uint32_t         CHardrockUSB::m_uGeneration(0);
+
+static const char* const apszProbeCmds[] = { "HRBN", "HRAA", "HRAN" };
+static const uint32_t    aulProbeBaudrates[] = { 19200, 115200, 38400, 57600, 9600, 4800 };
+
+const char* CHardrockUSB::stateName(void) {
+  static const char* const apszStates[] = { "Detached", "Attached", "Configured", "Probing", "Identified", "Bound" };
+
+  return apszStates[state()];
+}
+
+void CHardrockUSB::Task(void) {
+  if (m_fDetachEvent) {
+    m_fDetachEvent = false;
+    detached();
+  }
+  if (m_fAttachEvent) {
+    m_fAttachEvent = false;
+    m_eState = Attached;
+  }
+
+  switch (m_eState) {
+    case Detached:
+      break;
+
+    case Attached:
+      if (isUSBConnected()) {
+        m_eState = Configured;
+        m_uIdentity = CTeensy::USBIdentity(idVendor(), idProduct(), reinterpret_cast<const char*>(m_rUSBDevice.serialNumber()));
+        m_uGeneration++;
+        if (isHardrockUSB()
+            && !fromCache()) {
+          startProbe();
+        }
+      }
+      break;
+
+    case Configured:
+      if (!isUSBConnected()) {
+        detached();
+      } else if (isHardrockUSB()
+                 && m_tryInterval >= RetryMillis) {
+        startProbe();
+      }
+      break;
+
+    case Probing:
+      if (!isUSBConnected()) {
+        detached();
+      } else {
+        probe();
+      }
+      break;
+
+    case Identified:
+    case Bound:
+      if (!isUSBConnected()) {
+        detached();
+      } else {
+        CSerialDevice::Task();
+        m_Batch.flush(*this);  // What didn't fit last time
+      }
+      break;
+  }
+}
+
+void CHardrockUSB::detached(void) {
+  if (m_eState >= Identified) {
+    clear();
+  }
+  m_eState = Detached;
+  m_pszModel = m_pszUnknown;
+  m_uIdentity = 0;
+  m_uGeneration++;
+  if (!m_fAttachEvent) {
+    m_uActivePorts &= ~(uint32_t(1) << m_nPort);
+  }
+}
+
+bool CHardrockUSB::fromCache(void) {
+  const char* pszSerial(reinterpret_cast<const char*>(m_rUSBDevice.serialNumber()));
+
+  for (size_t nIndex(0); nIndex < CacheEntries; nIndex++) {
+    const SProbeCache& rEntry(m_aCache[nIndex]);
+
+    if (rEntry.m_pszModel
+        && rEntry.m_uVendor == idVendor()
+        && rEntry.m_uProduct == idProduct()
+        && strncmp(rEntry.m_achSerial, (pszSerial) ? pszSerial : "", sizeof rEntry.m_achSerial - 1) == 0) {
+      if (getBaudrate() != rEntry.m_ulBaudrate) {
+        setBaudrate(rEntry.m_ulBaudrate);
+      }
+      identified(rEntry.m_pszModel, false);
+      return true;
     }
   }
-  return m_HardrockFound;
+  return false;
+}
+
+void CHardrockUSB::startProbe(void) {
+  m_eState = Probing;
+  m_eStep = ProbeBand;
+  m_nBaud = 0;  // The current baud rate first
+  sendProbe();
+}
+
+void CHardrockUSB::sendProbe(void) {
+  while (available()) {
+    read();
+  }
+  write(";");
+  write(apszProbeCmds[m_eStep]);
+  write(";");
+  m_stProbe = 0;
+  m_ProbeTime = 0;
+}
+
+void CHardrockUSB::probe(void) {  // Collect the reply as it arrives, never wait for it
+  while (available()) {
+    const int iChar(read());
+
+    if (iChar == ';') {
+      m_achProbe[m_stProbe] = '\0';
+      m_stProbe = 0;
+      if (strstr(m_achProbe, apszProbeCmds[m_eStep])) {
+        onProbe(true);
+        return;
+      }
+    } else if (m_stProbe < sizeof m_achProbe - 1) {
+      m_achProbe[m_stProbe++] = toupper(iChar);
+    }
+  }
+  if (m_ProbeTime >= ProbeMillis) {
+    onProbe(false);
+  }
+}
+
+void CHardrockUSB::onProbe(bool fAnswered) {
+  switch (m_eStep) {
+    case ProbeBand:
+      if (fAnswered) {
+        m_eStep = ProbeAA;
+        sendProbe();
+      } else if (m_nBaud < sizeof aulProbeBaudrates / sizeof aulProbeBaudrates[0]) {
+        setBaudrate(aulProbeBaudrates[m_nBaud++]);
+        sendProbe();
+      } else {
+        setBaudrate(aulProbeBaudrates[0]);
+        m_eState = Configured;
+        m_tryInterval = 0;
+        TRACE_EVENT(TraceUSB, TraceInfo, USBNotHardrock, m_nPort, 0);
+      }
+      break;
+
+    case ProbeAA:
+      if (fAnswered) {
+        m_eStep = ProbeAN;
+        sendProbe();
+      } else {
+        identified(CHardrock50::modelName(), true);
+      }
+      break;
+
+    case ProbeAN:
+      identified((fAnswered) ? CHardrock500::modelName() : CHardrock50Plus::modelName(), true);
+      break;
+  }
+}
+
+void CHardrockUSB::identified(const char* pszModel, bool fCache) {
+  m_pszModel = pszModel;
+  m_eState = Identified;
+  m_uGeneration++;
+  if (fCache) {
+    const char*  pszSerial(reinterpret_cast<const char*>(m_rUSBDevice.serialNumber()));
+    SProbeCache& rEntry(m_aCache[m_nCacheNext]);
+
+    m_nCacheNext = (m_nCacheNext + 1) % CacheEntries;
+    rEntry.m_uVendor = idVendor();
+    rEntry.m_uProduct = idProduct();
+    strncpy(rEntry.m_achSerial, (pszSerial) ? pszSerial : "", sizeof rEntry.m_achSerial - 1);
+    rEntry.m_achSerial[sizeof rEntry.m_achSerial - 1] = '\0';
+    rEntry.m_pszModel = pszModel;
+    rEntry.m_ulBaudrate = getBaudrate();
+  }
+  TRACE_EVENT(TraceUSB, TraceInfo, USBIdentified, m_nPort, getBaudrate());
 }
@@ -4,32 +4,61 @@
 #include <Arduino.h>
 #include <USBHost_t36.h>  // Read this header first for key info
 #include <elapsedMillis.h>
+#include <new>
 
 #include "Hardplace705Plus.h"
 #include "SerialDevice.h"
 #include "Hardrock.h"
 #include "BoundDevice.h"
 #include "Tracer.h"
+#include "Capture.h"
+#include "TextFrame.h"
+#include "HardplaceUSBHost.h"
+
+/*
+   USB Hardrock port
+
+   Each USB host serial port runs its own lifecycle, driven by the attach and detach events from
+   CHardplaceUSBHost::Task():
+     Detached -> Attached -> Configured -> Probing -> Identified -> Bound (a Hardrock pair uses it)
+   A port whose VID/PID is the Hardrock FTDI part is probed without blocking, one command per Task() call with its
+   reply collected as it arrives, stepping through the baud rates until the amplifier answers. The result is kept
+   by VID/PID/serial number, so a Hardrock that comes back (hub hot-plug, power cycle) is identified from the cache
+   without probing. A failed probe is retried every RetryMillis.
+*/
+
+class CHardrockUSB : public CSerialDevice, public CBoundDevice, private IUSBPortEvents {
+public:
+  enum ePortState {
+    Detached,
+    Attached,
+    Configured,
+    Probing,
+    Identified,
+    Bound
+  };
+
+  enum {
+    ProbeMillis = 250,
+    RetryMillis = 10000,
+    CacheEntries = 8
+  };
 
-class CHardrockUSB : public CSerialDevice, public CBoundDevice {
 public:
-  CHardrockUSB(Stream& rUSB)
-    : CSerialDevice(rUSB, 19200),
+  CHardrockUSB(size_t nPort)
+    : CSerialDevice(CHardplaceUSBHost::serialPort(nPort), 19200),
       CBoundDevice(static_cast<CBoundDevice::eDeviceClass>(CTeensy::eBoundDeviceTypes::USBHost)),
-      m_rUSBDevice(static_cast<USBSerial_BigBuffer&>(rUSB)),
-      m_sDeviceName(m_pszUnknown),
-      m_sModel(m_pszUnknown),
-      m_tryInterval(10000),
-      m_HardrockFound(false) {
-    if (&rUSB == static_cast<const Stream*>(&SerialUSBHost1)) {
-      m_sDeviceName = "SerialUSBHost1";
-    } else if (&rUSB == static_cast<const Stream*>(&SerialUSBHost2)) {
-      m_sDeviceName = "SerialUSBHost2";
-    } else if (&rUSB == static_cast<const Stream*>(&SerialUSBHost3)) {
-      m_sDeviceName = "SerialUSBHost3";
-    } else if (&rUSB == static_cast<const Stream*>(&SerialUSBHost4)) {
-      m_sDeviceName = "SerialUSBHost4";
-    }
+      m_rUSBDevice(CHardplaceUSBHost::serialPort(nPort)),
+      m_sDeviceName("SerialUSBHost" + String(nPort + 1)),
+      m_pszModel(m_pszUnknown),
+      m_nPort(nPort),
+      m_fAttachEvent(false),
+      m_fDetachEvent(false),
+      m_eState(Detached),
+      m_eStep(ProbeBand),
+      m_nBaud(0),
+      m_stProbe(0),
+      m_uIdentity(0) {
   }
 
 private:
@@ -67,18 +96,9 @@ public:
 
 public:
   void setup() {
+    CHardplaceUSBHost::listen(m_nPort, this);
   }
-  void Task(void) {
-    if (!isUSBConnected()) {
-      if (m_HardrockFound) {
-        m_HardrockFound = false;
-        const_cast<String&>(m_sModel) = m_pszUnknown;
-        clear();
-      }
-    } else if (isHardrockConnected()) {
-      CSerialDevice::Task();
-    }
-  }
+  void Task(void);
   void bind(CBoundDevice& rDevice) {
     m_BoundDevices.bind(rDevice);
   }
@@ -94,13 +114,17 @@ public:
     return m_sDeviceName;
   }
   String modelName(void) const {
-    return const_cast<String&>(m_sModel);
+    return String(m_pszModel);
+  }
+  ePortState state(void) {
+    return (m_eState == Identified && isBound()) ? Bound : m_eState;
   }
+  const char* stateName(void);
   bool isUSBConnected(void) {
     return bool(*this);
   }
   bool isConnected(void) {
-    return isUSBConnected() && m_HardrockFound;
+    return isUSBConnected() && m_eState == Identified;
   }
   bool isHardrockUSB(void) {
     return (isUSBConnected()
@@ -109,42 +133,74 @@ public:
   }
 
 public:
-  bool isHardrockConnected(void) {
-    if (isHardrockUSB()) {
-      if (!m_HardrockFound
-          && m_tryInterval >= 10000) {
-        m_tryInterval = 0;
-#if defined XXXUSE_THREADS
-        threads.addThread(getHardrockModel, this);
-        threads.yield();
-#else
-        getHardrockModel();
-#endif
-      }
-    } else if (m_HardrockFound) {
-      m_HardrockFound = false;
-      const_cast<String&>(m_sModel) = m_pszUnknown;
-    }
+  bool isHardrockConnected(void) {  // Never blocks, probing runs from Task()
+    return isConnected();
+  }
+
+  uint32_t identity(void) const {  // CTeensy::USBIdentity(), computed when the port enumerated
+    return m_uIdentity;
+  }
+  uint32_t fingerprint(const char* pszModelName) const {
+    return CTeensy::USBFingerprint(m_uIdentity, pszModelName);
+  }
+  static uint32_t generation(void) {  // Changes as a port is identified or detached
+    return m_uGeneration;
+  }
+
+  static uint32_t activePorts(void) {  // Bit n set while port n is attached or still winding down
+    return m_uActivePorts;
+  }
 
-    return m_HardrockFound;
+private:
+  virtual void onUSBAttached(void) {
+    m_fAttachEvent = true;
+    m_uActivePorts |= uint32_t(1) << m_nPort;
   }
+  virtual void onUSBDetached(void) {
+    m_fDetachEvent = true;
+  }
+
+  enum eProbeStep {
+    ProbeBand,
+    ProbeAA,
+    ProbeAN
+  };
+
+  struct SProbeCache {
+    uint16_t    m_uVendor;
+    uint16_t    m_uProduct;
+    char        m_achSerial[24];
+    const char* m_pszModel;
+    uint32_t    m_ulBaudrate;
+  };
+
+  void detached(void);
+  bool fromCache(void);
+  void startProbe(void);
+  void probe(void);
+  void sendProbe(void);
+  void onProbe(bool fAnswered);
+  void identified(const char* pszModel, bool fCache);
 
 protected:
-  bool getHardrockModel(void);
-#if defined USE_THREADS
-  static bool getHardrockModel(void* pThis);
-#endif
   virtual void onAvailable(void) {
     if (m_rUSBDevice) {
-      while (available()
-             && !isAlphaNumeric(peek())
-             && peek() != ';') {
-        read();
+      bool fFrames(false);
+
+      while (available() > 0) {  // Every frame that's here, none that isn't
+        if (m_Parser.feed(read()) == CTextFrameParser::Frame) {
+          m_RxRate.onFrame(m_Parser.length());
+          CAPTURE_FRAME(*this, CaptureRx, reinterpret_cast<const uint8_t*>(m_Parser.frame()), m_Parser.length());
+          for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
+            m_BoundDevices.get(nIndex)->onTextFrame(m_Parser.frame(), m_Parser.length(), *this);
+          }
+          m_Parser.next();
+          fFrames = true;
+        }
       }
-      if (available()) {
-        String sData(readStringUntil(';'));
+      if (fFrames) {
         for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
-          m_BoundDevices.get(nIndex)->onNewPacket(sData, *this);
+          m_BoundDevices.get(nIndex)->onBurstEnd(*this);
         }
       }
     }
@@ -152,20 +208,99 @@ protected:
   virtual void onNewPacket(const String& rsPacket, CSerialDevice& rSrcDevice) {
     if (CHardrock::isHardrockPacket(rsPacket)) {
       write(rsPacket.c_str(), rsPacket.length());
+      CAPTURE_FRAME(*this, CaptureTx, reinterpret_cast<const uint8_t*>(rsPacket.c_str()), rsPacket.length());
+    }
+  }
+  virtual void onTextFrame(const char* pchFrame, size_t stFrame, CSerialDevice& rSrcDevice) {
+    if (isHardrockFrame(pchFrame)) {
+      m_Batch.append(pchFrame, stFrame, *this);
+      CAPTURE_FRAME(*this, CaptureTx, reinterpret_cast<const uint8_t*>(pchFrame), stFrame);
     }
   }
+  virtual void onBurstEnd(CSerialDevice& rSrcDevice) {
+    m_Batch.flush(*this);
+  }
 
+public:
+  void printBridgeStatus(Print& rDevice) const {
+    rDevice.printf("%-15s in %lu B/s %lu frames/s, out %lu B/s %lu frames/s, %lu frames in %lu writes, %lu dropped\r\n",
+                   deviceName().c_str(), m_RxRate.bytesPerSec(), m_RxRate.framesPerSec(),
+                   m_Batch.rate().bytesPerSec(), m_Batch.rate().framesPerSec(),
+                   m_Batch.rate().frames(), m_Batch.writes(), m_Batch.dropped() + m_Parser.dropped());
+  }
 
 private:
-  USBSerial_BigBuffer& m_rUSBDevice;
-  CBoundDeviceList     m_BoundDevices;
-  const char*          m_pszUnknown = "Unknown";
-  String               m_sDeviceName;
-  volatile String      m_sModel;
-  elapsedMillis        m_tryInterval;
-  volatile bool        m_HardrockFound;
-#if defined USE_THREADS
-  Threads::Mutex m_Mutex;
-#endif
+  static bool isHardrockFrame(const char* pchFrame) {  // CHardrock::isHardrockPacket() without the String
+    const char chFirst(toupper(pchFrame[0]));
+    const char chSecond((chFirst) ? toupper(pchFrame[1]) : '\0');
+
+    return (chFirst == 'H' && chSecond == 'R')
+           || (chFirst == 'F' && chSecond == 'A')
+           || (chFirst == 'I' && chSecond == 'F');
+  }
+
+
+private:
+  USBSerial_BigBuffer&         m_rUSBDevice;
+  CBoundDeviceList             m_BoundDevices;
+  const char*                  m_pszUnknown = "Unknown";
+  String                       m_sDeviceName;
+  const char*                  m_pszModel;
+  size_t                       m_nPort;
+  volatile bool                m_fAttachEvent;
+  volatile bool                m_fDetachEvent;
+  ePortState                   m_eState;
+  eProbeStep                   m_eStep;
+  size_t                       m_nBaud;
+  elapsedMillis                m_ProbeTime;
+  elapsedMillis                m_tryInterval;
+  char                         m_achProbe[32];
+  size_t                       m_stProbe;
+  uint32_t                     m_uIdentity;
+  CTextFrameParser             m_Parser;
+  CTextFrameBatch              m_Batch;
+  CFrameRate                   m_RxRate;
+
+  static SProbeCache       m_aCache[CacheEntries];
+  static size_t            m_nCacheNext;
+  static volatile uint32_t m_uActivePorts;
+  static volatile uint32_t m_uGeneration;
 };
-#endif
\ No newline at end of file
+
+class CHardrockUSBPool {  // One CHardrockUSB per USB host serial port
+public:
+  CHardrockUSBPool() {
+    for (size_t nPort(0); nPort < size(); nPort++) {
+      new (m_aauchPorts[nPort]) CHardrockUSB(nPort);
+    }
+  }
+
+private:
+  CHardrockUSBPool(const CHardrockUSBPool&);
+  CHardrockUSBPool& operator=(const CHardrockUSBPool&);
+
+public:
+  static size_t size(void) {
+    return CHardplaceUSBHost::SerialPorts;
+  }
+  CHardrockUSB& operator[](size_t nPort) {
+    return *reinterpret_cast<CHardrockUSB*>(m_aauchPorts[nPort]);
+  }
+  void setup(void) {
+    for (size_t nPort(0); nPort < size(); nPort++) {
+      (*this)[nPort].setup();
+    }
+  }
+  size_t attached(void) {
+    size_t cAttached(0);
+
+    for (uint32_t uPorts(CHardrockUSB::activePorts()); uPorts; uPorts &= uPorts - 1) {
+      cAttached += (*this)[__builtin_ctz(uPorts)].isUSBConnected();
+    }
+    return cAttached;
+  }
+
+private:
+  alignas(CHardrockUSB) uint8_t m_aauchPorts[CHardplaceUSBHost::SerialPorts][sizeof(CHardrockUSB)];
+};
+#endif
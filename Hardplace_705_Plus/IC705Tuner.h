@@ -65,6 +65,7 @@
 #include "ICOM.h"
 #include "Hardrock.h"
 #include "Tracer.h"
+#include "TraceLog.h"
 
 
 class CIC_705Tuner {
@@ -110,7 +111,7 @@ public:
         } while (0);
 #endif
         if (fHasAH705) {  // Tuner set to AH-705, tune normally
-          m_Tracer.TraceLn("Tuning Normally AH-705 mode");
+          TRACE_EVENT(TraceHardrock, TraceInfo, TuneStart, 0, 0);  // Normally, AH-705 mode
 
           m_rHardrock.Tune();                           // Tell the Hardrock to tune. It takes somewhere between .5 and 1 second to switch over to tuning mode
           for (unsigned uTry = 0; uTry < 20; uTry++) {  // Spin awaiting switch over to tuning mode
@@ -130,7 +131,7 @@ public:
           m_rTuner.TunerKey(false);  // Tell the IC-705 to stop sending the tuning signal
         } else if (!m_fTuning) {     // The IC 705 transmits a 10 watt tuning signal
           m_fTuning = true;          // ... and the IC-705 won't let us change it
-          m_Tracer.TraceLn("Tuning via Proxy, ICOM Phase");
+          TRACE_EVENT(TraceHardrock, TraceInfo, TuneStart, 1, 0);  // Via proxy, ICOM phase
           m_rTuner.TunerEnablePTT(false);  // Disable PTT
           m_rTuner.TunerKey(true);         // Tell the IC-705 to send the tuning signal
           delay(70);                       // Give the IC-705 a chance to act upon the command
@@ -142,7 +143,7 @@ public:
       }
     } else if (m_fTuning  // We tune on the trailing edge. Where we can control things.
                && m_rTuner.TuneComplete()) {
-      m_Tracer.TraceLn("Tuning via Proxy, Hardrock Phase");
+      TRACE_EVENT(TraceHardrock, TraceInfo, TuneStart, 2, 0);  // Via proxy, Hardrock phase
 
       if (TuneEnabled()) {  // If the active antenna can be tuned
         unsigned char auchRespBuf[80];
@@ -6,7 +6,7 @@ void CICOMResp::setICOMAddress(void) {
   setICOMAddress(m_pPacket, m_stPacket);
 }
 
-void CICOMResp::setICOMAddress(unsigned char* pPacket, size_t stPacketLen) {
+void CICOMResp::setICOMAddress(const unsigned char* pPacket, size_t stPacketLen) {
   if (pPacket && stPacketLen >= 4) {
     setICOMAddress(pPacket[3]);
   }
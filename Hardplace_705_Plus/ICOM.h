@@ -1,38 +1,60 @@
 #if !defined ICOM_H_DEFINED
 #define ICOM_H_DEFINED
 
+#include <initializer_list>
+
 #include "Hardplace705Plus.h"
 #include "Teensy41.h"
 #include "SerialDevice.h"
 
 class CICOMResp {
+public:
+  enum eNoCopy {
+    NoCopy  // Decode the caller's buffer in place, it must outlive the CICOMResp
+  };
+
 public:
   CICOMResp(uint8_t uchRigAddress = 0xE0)
     : m_Type(Unknown),
       m_uchRigAddress(uchRigAddress),
+      m_pauchOwned(0),
       m_pPacket(0),
-      m_stPacket(0) {
+      m_stPacket(0),
+      m_ullFrequencyHz(0) {
   }
   CICOMResp(const uint8_t* pResp, size_t stRespLen, uint8_t uchRigAddress = 0xE0)
     : m_Type(Unknown),
       m_uchRigAddress(uchRigAddress),
-      m_pPacket(new uint8_t[stRespLen]),
-      m_stPacket(stRespLen) {
+      m_pauchOwned(new uint8_t[stRespLen]),
+      m_pPacket(m_pauchOwned),
+      m_stPacket(stRespLen),
+      m_ullFrequencyHz(0) {
     while (m_stPacket > 1
            && (pResp[0] != 0xFE || pResp[1] != 0xFE)) {
       pResp++, m_stPacket--;
     }
-    memcpy(m_pPacket, pResp, m_stPacket);
-    if (stRespLen > 4) {
-      m_Type = static_cast<RespType>(m_pPacket[4]);
-    }
+    memcpy(m_pauchOwned, pResp, m_stPacket);
+    decode();
     /*
          FE FE 00 A4 - 01 05 01 FD
          FE FE 00 A4 - 00 00 50 68 46 01 FD
       */
   }
+  CICOMResp(eNoCopy, const uint8_t* pResp, size_t stRespLen, uint8_t uchRigAddress = 0xE0)
+    : m_Type(Unknown),
+      m_uchRigAddress(uchRigAddress),
+      m_pauchOwned(0),
+      m_pPacket(pResp),
+      m_stPacket(stRespLen),
+      m_ullFrequencyHz(0) {
+    while (m_stPacket > 1
+           && (m_pPacket[0] != 0xFE || m_pPacket[1] != 0xFE)) {
+      m_pPacket++, m_stPacket--;
+    }
+    decode();
+  }
   ~CICOMResp() {
-    delete[] m_pPacket, m_pPacket = 0, m_stPacket = 0;
+    delete[] m_pauchOwned, m_pauchOwned = 0, m_pPacket = 0, m_stPacket = 0;
   }
 private:
   CICOMResp(const CICOMResp&);
@@ -117,20 +139,7 @@ public:
   }
 
   uint64_t FrequencyHz(void) const {
-    uint64_t ullFrequency(0);
-
-    if (isFrequencyResponse()
-        && m_stPacket > 10) {
-      uint64_t ullMultiplier(1);
-
-      for (size_t nIndex(5); nIndex < m_stPacket - 1; nIndex++) {
-        uint8_t uchValue((((m_pPacket[nIndex] & 0xF0) >> 4) * 10) + (m_pPacket[nIndex] & 0x0F));
-
-        ullFrequency += static_cast<uint64_t>(uchValue) * ullMultiplier;
-        ullMultiplier *= 100;
-      }
-    }
-    return ullFrequency;
+    return m_ullFrequencyHz;
   }
 
   uint32_t FrequencyMeters(void) const {
@@ -165,7 +174,7 @@ public:
 
   int Mode(void) const {
     int iMode(-1);
-    if (ResponseType() == ReadModeFilter
+    if ((ResponseType() == ReadModeFilter || ResponseType() == SetModeFilterRig)  // Read or broadcast
         && m_stPacket >= 6) {
       iMode = static_cast<unsigned>(m_pPacket[5]);
     }
@@ -174,7 +183,7 @@ public:
 
   int Filter(void) const {
     int iFilter(-1);
-    if (ResponseType() == ReadModeFilter
+    if ((ResponseType() == ReadModeFilter || ResponseType() == SetModeFilterRig)  // Read or broadcast
         && m_stPacket >= 7) {
       iFilter = static_cast<unsigned>(m_pPacket[6]);
     }
@@ -214,7 +223,7 @@ public:
   }
 
 public:
-  void    setICOMAddress(uint8_t* pPacket, size_t stPacketLen);
+  void    setICOMAddress(const uint8_t* pPacket, size_t stPacketLen);
   void    setICOMAddress(uint8_t uchAddress);
   void    setICOMAddress(void);
   uint8_t getICOMAddress(void) const;
@@ -224,11 +233,66 @@ public:
     return rOutputDev.write(pbBuffer, stBufLen);
   }
 
+private:
+  void decode(void) {  // Everything the subscribers ask for, worked out once per frame, m_stPacket is after the leading garbage
+    if (m_stPacket > 4) {
+      m_Type = static_cast<RespType>(m_pPacket[4]);
+    }
+    if (isFrequencyResponse()
+        && m_stPacket > 10) {
+      uint64_t ullMultiplier(1);
+
+      for (size_t nIndex(5); nIndex < m_stPacket - 1; nIndex++) {
+        uint8_t uchValue((((m_pPacket[nIndex] & 0xF0) >> 4) * 10) + (m_pPacket[nIndex] & 0x0F));
+
+        m_ullFrequencyHz += static_cast<uint64_t>(uchValue) * ullMultiplier;
+        ullMultiplier *= 100;
+      }
+    }
+  }
+
 private:
   CICOMResp::RespType m_Type;
   uint8_t             m_uchRigAddress;
-  uint8_t*            m_pPacket;
+  uint8_t*            m_pauchOwned;
+  const uint8_t*      m_pPacket;
   size_t              m_stPacket;
+  uint64_t            m_ullFrequencyHz;
+};
+
+class CICOMFilter {  // Which frames from the radio a bound device wants to see
+public:
+  CICOMFilter(bool fBroadcastOnly = false)
+    : m_fBroadcastOnly(fBroadcastOnly) {
+    memset(m_auCommands, 0xFF, sizeof m_auCommands);
+  }
+  CICOMFilter(std::initializer_list<uint8_t> Commands, bool fBroadcastOnly = false)
+    : m_fBroadcastOnly(fBroadcastOnly) {
+    memset(m_auCommands, 0, sizeof m_auCommands);
+    for (uint8_t uchCommand : Commands) {
+      m_auCommands[uchCommand >> 5] |= 1UL << (uchCommand & 0x1F);
+    }
+  }
+
+public:
+  bool isInterested(const CICOMResp& rFrame) const {
+    const size_t stFrame(rFrame);
+
+    if (m_fBroadcastOnly
+        && !rFrame.isBroadcast()) {
+      return false;
+    }
+    if (stFrame > 4) {
+      const uint8_t uchCommand(static_cast<const uint8_t*>(rFrame)[4]);
+
+      return (m_auCommands[uchCommand >> 5] & (1UL << (uchCommand & 0x1F))) != 0;
+    }
+    return false;
+  }
+
+private:
+  bool     m_fBroadcastOnly;
+  uint32_t m_auCommands[256 / 32];
 };
 
 class CICOMReq {
@@ -258,6 +322,11 @@ public:
     return write(rOutputDev, ReadRFLevelReq, sizeof ReadRFLevelReq);
   }
 
+  size_t ReadTXState(Stream& rOutputDev) {  // The response is the bound devices', isTransmitting() waits for it
+    static const uint8_t ReadTXStateReq[] = { 0xFE, 0xFE, getICOMAddress(), getRigAddress(), 0x1C, 0x00, 0xFD };
+    return write(rOutputDev, ReadTXStateReq, sizeof ReadTXStateReq);
+  }
+
   size_t WriteModeFilter(Stream& rOutputDev, unsigned uMode, unsigned uFilter) {
     uint8_t WriteModeFilterReq[] = { 0xFE, 0xFE, getICOMAddress(), getRigAddress(), 0x01, 0x00, 0x00, 0xFD };
     WriteModeFilterReq[5] = static_cast<uint8_t>(uMode);
@@ -379,8 +448,20 @@ public:
   }
 
 public:
-  static size_t getResponse(CSerialDevice& rStream, uint8_t* puchBuffer, size_t stLen) {
-    return rStream.readBytesUntil(0xFD, puchBuffer, stLen);
+  size_t getResponse(CSerialDevice& rStream, uint8_t* puchBuffer, size_t stLen) {
+    // Replies to other controllers (the bridge and mux clients) are handed back to the stream's fan-out
+    for (;;) {
+      const size_t stBytes(rStream.readBytesUntil(0xFD, puchBuffer, stLen));
+
+      if (stBytes <= 3
+          || puchBuffer[0] != 0xFE
+          || puchBuffer[1] != 0xFE
+          || puchBuffer[2] == m_uchRigAddress
+          || puchBuffer[2] == 0x00) {
+        return stBytes;
+      }
+      rStream.onSkippedFrame(puchBuffer, stBytes);
+    }
   }
 
   bool getRigResponse(CSerialDevice& rStream) {
@@ -3,15 +3,18 @@
 
 #include <cstdint>
 #include <cstddef>
-#include <memory>
 #include <elapsedMillis.h>
 #include "core_pins.h"
-#include "List.hpp"
 
 #include "Hardplace705Plus.h"
 #include "HC_05Master.h"
 #include "ICOM.h"
 #include "BoundDevice.h"
+#include "TraceLog.h"
+#include "Capture.h"
+#include "CloneBridge.h"
+#include "CIVBridge.h"
+#include "CIVMux.h"
 
 class CIC_705MasterDevice : public CHC_05MasterDevice, private CICOMReq, public CBoundDevice {
 public:
@@ -25,12 +28,18 @@ public:
       DeviceID, rBluetooth, rDevice, uBaudrate, ulTimeout, pszName, pszRName, pszPIN,
       ulClass, eRecordType),
       CICOMReq(uchRigAddress),
-      CBoundDevice(static_cast<CBoundDevice::eDeviceClass>(CTeensy::eBoundDeviceTypes::IC_705Master)) {
+      CBoundDevice(static_cast<CBoundDevice::eDeviceClass>(CTeensy::eBoundDeviceTypes::IC_705Master)),
+      m_cBoundDevices(0),
+      m_ulReplayFrames(0),
+      m_ulReplayDeliveries(0),
+      m_CloneBridge(*this),
+      m_Bridge(*this),
+      m_Mux(*this) {
+    memset(m_aRoutes, 0, sizeof m_aRoutes);
   }
   ~CIC_705MasterDevice() {
-    while (!m_BoundDevices.isEmpty()) {
-      delete m_BoundDevices.get(0);
-      m_BoundDevices.remove(0);
+    while (m_cBoundDevices) {
+      delete m_apBoundDevices[--m_cBoundDevices];
     }
   }
 
@@ -39,7 +48,24 @@ public:
     return CHC_05MasterDevice::setup();
   }
   virtual void Task(void) {
-    CHC_05MasterDevice::Task();
+    m_CloneBridge.Task();
+    if (!m_CloneBridge.isActive()) {  // The stream is the transfer's, no AT commands, relinks or keepalives in it
+      CHC_05MasterDevice::Task();
+      m_Health.Task();
+      if (isConnected()
+          && m_Health.keepaliveDue()) {  // Quiet, ask the radio something harmless
+        m_Health.keepaliveSent();        // First, ReadOperatingFreq() runs Task()
+        ReadOperatingFreq();
+      }
+      m_Bridge.Task();
+      if (m_Mux.isBusy()) {
+        m_Mux.expire();
+      } else if (m_Mux.isPending()
+                 && m_Mutex.try_lock()) {  // Not while the Hardplace holds the radio, its own request goes first
+        m_Mux.dispatch();  // In flight until onFrame() or expire(), the radio isn't held in between
+        m_Mutex.unlock();
+      }
+    }
   }
 
 public:
@@ -47,11 +73,20 @@ public:
     return CICOMResp::isClonePacket(pPacket, stPacketLen);
   }
 
+  const CCloneBridge& cloneBridge(void) const {
+    return m_CloneBridge;
+  }
+  CCIVBridge& bridge(void) {
+    return m_Bridge;
+  }
+  const CCIVMux& mux(void) const {
+    return m_Mux;
+  }
+
 public:
   bool ReadOperatingFreq(bool fWait = false) {
     bool fReturn(false);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       fReturn = CICOMReq::ReadOperatingFreq(*this);
       m_Mutex.unlock();
       Task();
@@ -61,8 +96,7 @@ public:
 
   size_t ReadModeFilter(bool fWait = false) {
     size_t stReturn(0);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       stReturn = CICOMReq::ReadModeFilter(*this);
       m_Mutex.unlock();
     }
@@ -71,18 +105,25 @@ public:
 
   size_t ReadRFPower(bool fWait = false) {
     size_t stReturn(0);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       stReturn = CICOMReq::ReadRFPower(*this);
       m_Mutex.unlock();
     }
     return stReturn;
   }
 
+  size_t ReadTXState(bool fWait = false) {
+    size_t stReturn(0);
+    if (acquire(fWait)) {
+      stReturn = CICOMReq::ReadTXState(*this);
+      m_Mutex.unlock();
+    }
+    return stReturn;
+  }
+
   size_t WriteModeFilter(unsigned uMode, unsigned uFilter, bool fWait = false) {
     size_t stReturn(0);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       stReturn = CICOMReq::WriteModeFilter(*this, uMode, uFilter);
       m_Mutex.unlock();
     }
@@ -91,18 +132,17 @@ public:
 
   size_t WriteRFPower(unsigned uLevel, bool fWait = false) {
     size_t stReturn(0);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       stReturn = CICOMReq::WriteRFPower(*this, uLevel);
       m_Mutex.unlock();
+      TRACE_EVENT(TracePower, TraceInfo, RFPowerWrite, uLevel, stReturn);
     }
     return stReturn;
   }
 
   bool TX(bool bOn, bool fWait = false) {
     bool fReturn(false);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       fReturn = CICOMReq::TX(*this, bOn);
       m_Mutex.unlock();
     }
@@ -111,8 +151,7 @@ public:
 
   bool isTransmitting(bool fWait = false) {
     bool fReturn(false);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       fReturn = CICOMReq::isTransmitting(*this);
       m_Mutex.unlock();
     }
@@ -121,8 +160,7 @@ public:
 
   bool Tuner(bool bOn, bool fWait = false) {
     bool fReturn(false);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       fReturn = CICOMReq::Tuner(*this, bOn);
       m_Mutex.unlock();
     }
@@ -131,8 +169,7 @@ public:
 
   bool isTunerSelect_AH_705(bool fWait = false) {
     bool fReturn(false);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       fReturn = CICOMReq::isTunerSelect_AH_705(*this);
       m_Mutex.unlock();
     }
@@ -141,8 +178,7 @@ public:
 
   bool getCI_V_Transcieve(bool fWait = false) {
     bool fReturn(false);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       fReturn = CICOMReq::CI_V_Transcieve(*this);
       m_Mutex.unlock();
       Task();
@@ -152,8 +188,7 @@ public:
 
   bool setCI_V_Transcieve(bool bOn, bool fWait = false) {
     bool fReturn(false);
-    if ((fWait && m_Mutex.lock())
-        || m_Mutex.try_lock()) {
+    if (acquire(fWait)) {
       fReturn = CICOMReq::CI_V_Transcieve(*this, bOn);
       m_Mutex.unlock();
       Task();
@@ -183,20 +218,27 @@ public:
     return CICOMReq::getRigResponse(*this);
   }
 
+public:
+  enum {
+    MaxBoundDevices = 8,
+    MaxDeviceAddresses = 8
+  };
+
 private:
   class CICOMBoundDevice : public CBoundDevice {
   public:
-    CICOMBoundDevice(CBoundDevice& rDevice, uint8_t uchAddress = 0xE0)
-      : CBoundDevice(rDevice), m_rBoundDevice(rDevice), m_uchAddress(uchAddress) {}
-    CICOMBoundDevice(const CICOMBoundDevice& rSrc)
-      : CBoundDevice(rSrc), m_rBoundDevice(rSrc.m_rBoundDevice), m_uchAddress(rSrc.m_uchAddress) {}
+    CICOMBoundDevice(CBoundDevice& rDevice, const CICOMFilter& rFilter = CICOMFilter())
+      : CBoundDevice(rDevice), m_rBoundDevice(rDevice), m_Filter(rFilter), m_cAddresses(0) {}
     virtual ~CICOMBoundDevice() {}
 
   private:
     CICOMBoundDevice();
+    CICOMBoundDevice(const CICOMBoundDevice&);
     CICOMBoundDevice& operator=(const CICOMBoundDevice&);
 
   public:
+    virtual void onTextFrame(const char* pchFrame, size_t stFrame, CSerialDevice& rSrcDevice) {  // CI-V only
+    }
     virtual void onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice) {
       m_rBoundDevice.onNewPacket(puPacket, stPacket, rSrcDevice);
     }
@@ -206,184 +248,232 @@ private:
     virtual void onReceive(uint8_t uchChar, CSerialDevice& rSrcDevice) {
       m_rBoundDevice.onReceive(uchChar, rSrcDevice);
     };
+    virtual bool onNewFrame(const CICOMResp& rFrame, CSerialDevice& rSrcDevice) {
+      if (!m_rBoundDevice.onNewFrame(rFrame, rSrcDevice)) {
+        m_rBoundDevice.onNewPacket(static_cast<const uint8_t*>(rFrame), static_cast<size_t>(rFrame), rSrcDevice);
+      }
+      return true;
+    }
 
   public:
-    uint8_t getAddress(void) const {
-      return m_uchAddress;
+    bool isDevice(const CBoundDevice& rDevice) const {
+      return &m_rBoundDevice == &rDevice;
+    }
+    bool isInterested(const CICOMResp& rFrame) const {
+      return m_Filter.isInterested(rFrame);
     }
+    bool addAddress(uint8_t uchAddress) {
+      for (size_t nIndex(0); nIndex < m_cAddresses; nIndex++) {
+        if (m_auchAddresses[nIndex] == uchAddress) {
+          return true;
+        }
+      }
+      if (m_cAddresses < MaxDeviceAddresses) {
+        m_auchAddresses[m_cAddresses++] = uchAddress;
+        return true;
+      }
+      return false;
+    }
+    size_t addresses(void) const {
+      return m_cAddresses;
+    }
+    uint8_t address(size_t nIndex) const {
+      return m_auchAddresses[nIndex];
+    }
+
   private:
     CBoundDevice& m_rBoundDevice;
-    uint8_t       m_uchAddress;
+    CICOMFilter   m_Filter;
+    uint8_t       m_auchAddresses[MaxDeviceAddresses];
+    size_t        m_cAddresses;
+  };
+
+  struct SRoute {  // One per CI-V address, indexed by the frame's to address
+    CICOMBoundDevice* m_pDevice;
+    uint32_t          m_ulFrames;
+    uint32_t          m_ulBytes;
   };
 
 public:
-  void bindDevice(CBoundDevice& rDevice, uint8_t uchAddress) {
-    m_BoundDevices.add(new CICOMBoundDevice(rDevice, uchAddress));
+  bool bindDevice(CBoundDevice& rDevice, uint8_t uchAddress, const CICOMFilter& rFilter = CICOMFilter()) {
+    // Binding an already bound device adds another virtual CI-V address for it, the first filter stays
+    CICOMBoundDevice* pBound(findBound(rDevice));
+
+    if (!pBound) {
+      if (m_cBoundDevices >= MaxBoundDevices) {
+        return false;
+      }
+      pBound = new CICOMBoundDevice(rDevice, rFilter);
+      m_apBoundDevices[m_cBoundDevices++] = pBound;  // Broadcast subscribers
+    }
+    if (!pBound->addAddress(uchAddress)) {
+      return false;
+    }
+    m_aRoutes[uchAddress].m_pDevice = pBound;
+    return true;
   }
   void unbindDevice(CBoundDevice& rDevice) {
-    for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
-      if (&static_cast<CBoundDevice&>(*m_BoundDevices.get(nIndex)) == &rDevice) {
-        delete m_BoundDevices.get(nIndex);
-        m_BoundDevices.remove(nIndex);
+    for (size_t nIndex(0); nIndex < m_cBoundDevices; nIndex++) {
+      CICOMBoundDevice* pBound(m_apBoundDevices[nIndex]);
+
+      if (pBound->isDevice(rDevice)) {
+        for (size_t nAddress(0); nAddress < pBound->addresses(); nAddress++) {
+          SRoute& rRoute(m_aRoutes[pBound->address(nAddress)]);
+
+          if (rRoute.m_pDevice == pBound) {
+            rRoute.m_pDevice = 0;
+          }
+        }
+        m_apBoundDevices[nIndex] = m_apBoundDevices[--m_cBoundDevices];
+        delete pBound;
         break;
       }
     }
   }
   virtual void onAvailable(void) {
     if (available() >= 6) {
-      size_t    stBuf(128);
-      uint8_t*  pauchBuf(new uint8_t[stBuf]);
-      size_t    cBytes(readBytesUntil(0xFD, pauchBuf, stBuf));
-      CICOMResp Resp(pauchBuf, cBytes);
-
-      if (Resp.isBroadcast()
-          || Resp.isFrequencyResponse()
-          || Resp.isOperatingModeResponse()) {
-        for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
-          m_BoundDevices.get(nIndex)->onNewPacket(pauchBuf, cBytes, *this);
+      uint8_t auchFrame[128];
+      size_t  cBytes(readBytesUntil(0xFD, auchFrame, sizeof auchFrame));
+
+      TRACE_DATA(TraceCIV, TraceDebug, CIVFromRadio, auchFrame, cBytes);
+      CAPTURE_FRAME(*this, CaptureRx, auchFrame, cBytes);
+      if (cBytes < 5
+          || cBytes == sizeof auchFrame
+          || auchFrame[0] != 0xFE
+          || auchFrame[1] != 0xFE) {
+        m_Health.onParseError();  // Short, overlong or unframed, the addresses can't be trusted
+        return;
+      }
+      m_Health.onFrame();
+      onFrame(auchFrame, cBytes);
+    }
+  }
+  virtual void onSkippedFrame(const uint8_t* puchFrame, size_t stFrame) {  // Another controller's reply, read by getResponse()
+    m_Health.onFrame();
+    TRACE_DATA(TraceCIV, TraceDebug, CIVFromRadio, puchFrame, stFrame);
+    CAPTURE_FRAME(*this, CaptureRx, puchFrame, stFrame);
+    onFrame(puchFrame, stFrame);
+  }
+  void onFrame(const uint8_t* puchFrame, size_t stFrame) {  // Fan out a frame from the radio
+    PROFILE_SCOPE(FrameFanOut);
+    const CICOMResp Frame(CICOMResp::NoCopy, puchFrame, stFrame);  // Decoded once, every subscriber reads it
+    SRoute&         rRoute(m_aRoutes[Frame.ToAddress()]);
+
+    rRoute.m_ulFrames++;
+    rRoute.m_ulBytes += stFrame;
+
+    if (m_Mux.onFrame(Frame)) {  // A reply for a client request, the radio is free for the next one
+      return;
+    }
+    m_Bridge.onFrame(Frame);
+
+    if (Frame.isBroadcast()
+        || Frame.isFrequencyResponse()
+        || Frame.isOperatingModeResponse()) {
+      for (size_t nIndex(0); nIndex < m_cBoundDevices; nIndex++) {
+        if (m_apBoundDevices[nIndex]->isInterested(Frame)) {
+          m_apBoundDevices[nIndex]->onNewFrame(Frame, *this);
         }
-      } else {
-        for (int nIndex(0); nIndex < m_BoundDevices.getSize(); nIndex++) {
-          CICOMBoundDevice* pDevice(m_BoundDevices.get(nIndex));
-          if (pDevice && pDevice->getAddress() == Resp.ToAddress()) {
-            pDevice->onNewPacket(pauchBuf, cBytes, *this);
-            break;
-          }
+      }
+    } else if (rRoute.m_pDevice
+               && rRoute.m_pDevice->isInterested(Frame)) {
+      rRoute.m_pDevice->onNewFrame(Frame, *this);
+    }
+  }
+  void onReplay(const uint8_t* puchFrame, size_t stFrame) {  // Capture replay, onFrame() as a dry run
+    // Decoded and routed the same way, but nothing is delivered: a subscriber would set the PTT enables and write
+    // the RF power to the radio, the mux and bridge would write to their clients
+    const CICOMResp Frame(CICOMResp::NoCopy, puchFrame, stFrame);
+    const SRoute&   rRoute(m_aRoutes[Frame.ToAddress()]);
+
+    m_ulReplayFrames++;
+    if (Frame.isBroadcast()
+        || Frame.isFrequencyResponse()
+        || Frame.isOperatingModeResponse()) {
+      for (size_t nIndex(0); nIndex < m_cBoundDevices; nIndex++) {
+        if (m_apBoundDevices[nIndex]->isInterested(Frame)) {
+          m_ulReplayDeliveries++;
         }
       }
-      delete[] pauchBuf;
+    } else if (rRoute.m_pDevice
+               && rRoute.m_pDevice->isInterested(Frame)) {
+      m_ulReplayDeliveries++;
     }
   }
-  virtual void onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice) {
-    const size_t               stBuf(128);
-    std::shared_ptr<uint8_t[]> pauchBuf(new uint8_t[stBuf]);
-
-    enum cloanCmds {
-      getCloneInfo = 0xE0,
-      CloneInfo,
-      CloanRead,
-      CloanWrite,
-      CloanRecord,
-      CloanEnd
-    };
-
-    if (isCloneRequest(puPacket, stPacket)
-        && stPacket >= 5
-        && (puPacket[4] == CloanRead
-            || puPacket[4] == CloanWrite)) {
-
-      memcpy(pauchBuf.get(), puPacket, stPacket);
-      if (puPacket[4] == CloanRead) {
-#if 0 && defined(USE_THREADS)
-      threads.addThread(onCloanRead, new cloanArgs(this, rSrcDevice, pauchBuf, stPacket, pauchBuf, stBuf));
-      threads.yield();
-#else
-        onCloanRead(rSrcDevice, pauchBuf, stPacket, pauchBuf, stBuf);
-#endif
-      } else {
-#if 0 && defined(USE_THREADS)
-      threads.addThread(onCloanWrite, new cloanArgs(this, rSrcDevice, pauchBuf, stPacket, pauchBuf, stBuf));
-      threads.yield();
-#else
-        onCloanWrite(rSrcDevice, pauchBuf, stPacket, pauchBuf, stBuf);
-#endif
+  void printRoutes(Print& rDevice) const {
+    for (size_t nAddress(0); nAddress < sizeof m_aRoutes / sizeof m_aRoutes[0]; nAddress++) {
+      const SRoute& rRoute(m_aRoutes[nAddress]);
+
+      if (rRoute.m_ulFrames || rRoute.m_pDevice) {
+        rDevice.printf("Route %02X        %s%s, %lu frames %lu bytes\r\n", unsigned(nAddress),
+                       (nAddress == 0) ? "broadcast" : (rRoute.m_pDevice) ? "bound" : "unbound",
+                       (m_Bridge.isRouted(nAddress)) ? " + bridge" : "",
+                       rRoute.m_ulFrames, rRoute.m_ulBytes);
       }
-    } else {
-      write(puPacket, stPacket);
-      size_t cBytes(getResponse(pauchBuf.get(), stBuf));
-      rSrcDevice.write(pauchBuf.get(), cBytes);
+    }
+    if (m_ulReplayFrames) {
+      rDevice.printf("Replay          %lu frames, %lu would have been delivered\r\n", m_ulReplayFrames, m_ulReplayDeliveries);
     }
   }
-
-private:
-  size_t write(const uint8_t* pauchBuf, size_t stBuf) {
-    return CSerialDevice::write(pauchBuf, stBuf);
+  virtual void onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice) {
+    if (CCloneBridge::isCloneTransfer(puPacket, stPacket)) {
+      m_CloneBridge.start(rSrcDevice, puPacket, stPacket);  // Streams from Task() until the transfer goes quiet
+    } else if (!m_CloneBridge.isActive()) {
+      TRACE_DATA(TraceCIV, TraceDebug, CIVFromClient, puPacket, stPacket);
+      CAPTURE_FRAME(rSrcDevice, CaptureRx, puPacket, stPacket);
+      m_Mux.submit(rSrcDevice, puPacket, stPacket);  // Sent from Task() in turn, the reply comes back through onFrame()
+    }
   }
 
-  struct cloanArgs {
-    cloanArgs(CIC_705MasterDevice*       pClass,
-              CSerialDevice&             rSrcDevice,
-              std::shared_ptr<uint8_t[]> pauchCmd, const size_t stCmd,
-              std::shared_ptr<uint8_t[]> pauchBuf, const size_t stBuf)
-      : m_pClass(pClass), m_rSrcDevice(rSrcDevice),
-        m_pauchCmd(pauchCmd), m_stCmd(stCmd),
-        m_pauchBuf(pauchBuf), m_stBuf(stBuf) {}
-    virtual ~cloanArgs() {}
-
-    CIC_705MasterDevice*       m_pClass;
-    CSerialDevice&             m_rSrcDevice;
-    std::shared_ptr<uint8_t[]> m_pauchCmd;
-    const size_t               m_stCmd;
-    std::shared_ptr<uint8_t[]> m_pauchBuf;
-    const size_t               m_stBuf;
-
-  private:
-    cloanArgs();
-    cloanArgs(const cloanArgs&);
-    cloanArgs& operator=(const cloanArgs&);
-  };
-  static void onCloanRead(void* Args) {  // Args must be allocated memory
-    std::shared_ptr<cloanArgs> pArgs(reinterpret_cast<cloanArgs*>(Args));
-    Threads::Scope             wait(pArgs->m_pClass->m_Mutex);
-
-    pArgs->m_pClass->onCloanRead(
-      pArgs->m_rSrcDevice, pArgs->m_pauchCmd, pArgs->m_stCmd, pArgs->m_pauchBuf, pArgs->m_stBuf);
-  }
-  void onCloanRead(
-    CSerialDevice&             rSrcDevice,
-    std::shared_ptr<uint8_t[]> pauchCmd, const size_t stCmd,
-    std::shared_ptr<uint8_t[]> pauchBuf, const size_t stBuf) {
-    bool fFlushOnWrite(!Tracer().FlushOnWrite());
-
-    Tracer().disableFlushOnWrite(true);
-
-    write(pauchCmd.get(), stCmd);
-    size_t cBytes(getResponse(pauchBuf.get(), stBuf));
-    rSrcDevice.write(pauchBuf.get(), cBytes);
-
-    for (size_t cBytes(getResponse(pauchBuf.get(), stBuf)); (cBytes || available()); cBytes = getResponse(pauchBuf.get(), stBuf)) {
-      if (cBytes) {
-        rSrcDevice.write(pauchBuf.get(), cBytes);
-        if (Tracer().availableForWrite() >= int(cBytes * 3)) {
-          Tracer().TraceHex(pauchBuf.get(), cBytes);
-        }
+private:
+  CICOMBoundDevice* findBound(const CBoundDevice& rDevice) const {
+    for (size_t nIndex(0); nIndex < m_cBoundDevices; nIndex++) {
+      if (m_apBoundDevices[nIndex]->isDevice(rDevice)) {
+        return m_apBoundDevices[nIndex];
       }
-      Delay(0);
     }
-    Tracer().disableFlushOnWrite(fFlushOnWrite);
+    return 0;
   }
-  static void onCloanWrite(void* Args) {  // Args must be allocated memory
-    std::shared_ptr<cloanArgs> pArgs(reinterpret_cast<cloanArgs*>(Args));
-    Threads::Scope             wait(pArgs->m_pClass->m_Mutex);
 
-    pArgs->m_pClass->onCloanWrite(
-      pArgs->m_rSrcDevice, pArgs->m_pauchCmd, pArgs->m_stCmd, pArgs->m_pauchBuf, pArgs->m_stBuf);
+  bool acquire(bool fWait) {  // The radio belongs to the clone bridge while a transfer is running
+    if (m_CloneBridge.isActive()) {
+      return false;
+    }
+    if (fWait) {
+      m_Mutex.lock();  // Held, no queued client request is dispatched ahead of ours
+      awaitMux();
+    } else if (!m_Mutex.try_lock()) {
+      return false;
+    } else if (m_Mux.isBusy()) {  // Not behind a client's request, the caller retries
+      m_Mutex.unlock();
+      return false;
+    }
+    return true;
   }
-  void onCloanWrite(
-    CSerialDevice&             rSrcDevice,
-    std::shared_ptr<uint8_t[]> pauchCmd, const size_t stCmd,
-    std::shared_ptr<uint8_t[]> pauchBuf, const size_t stBuf) {
-    bool fFlushOnWrite(!Tracer().FlushOnWrite());
 
-    Tracer().disableFlushOnWrite(true);
-
-    write(pauchCmd.get(), stCmd);
-
-    for (size_t cBytes(rSrcDevice.readBytesUntil(0xFD, pauchBuf.get(), stBuf));
-         (cBytes || rSrcDevice.available());
-         cBytes = rSrcDevice.readBytesUntil(0xFD, pauchBuf.get(), stBuf)) {
-      if (cBytes) {
-        write(pauchBuf.get(), cBytes);
-        if (Tracer().availableForWrite() >= int(cBytes * 3)) {
-          Tracer().TraceHex(pauchBuf.get(), cBytes);
-        }
+  void awaitMux(void) {  // Until the client request in flight is answered or times out, its reply is read here
+    while (m_Mux.isBusy()
+           && !m_Mux.expire()) {
+      if (available() >= 6) {
+        onAvailable();  // The caller may be the main loop, nothing else would read it
+      } else {
+        Delay(1);
       }
-      Delay(0);
     }
-    Tracer().disableFlushOnWrite(fFlushOnWrite);
   }
+
+  virtual size_t write(const uint8_t* pauchBuf, size_t stBuf) {  // Every CI-V frame to the radio passes through here, the bridge and mux included
+    if (m_CloneBridge.isActive()) {
+      return 0;
+    }
+    TRACE_DATA(TraceCIV, TraceDebug, CIVToRadio, pauchBuf, stBuf);
+    CAPTURE_FRAME(*this, CaptureTx, pauchBuf, stBuf);
+    return CSerialDevice::write(pauchBuf, stBuf);
+  }
+
 public:
-  operator Threads::Mutex&() {
+  operator Threads::Mutex&() {  // Threads::Scope on the radio from the main loop, after the client request in flight
+    awaitMux();
     return m_Mutex;
   }
 
@@ -392,7 +482,14 @@ private:
   CIC_705MasterDevice& operator=(const CIC_705MasterDevice&);
 
 private:
-  List<CICOMBoundDevice*> m_BoundDevices;
-  Threads::Mutex          m_Mutex;
+  SRoute            m_aRoutes[256];
+  CICOMBoundDevice* m_apBoundDevices[MaxBoundDevices];
+  size_t            m_cBoundDevices;
+  Threads::Mutex    m_Mutex;
+  uint32_t          m_ulReplayFrames;
+  uint32_t          m_ulReplayDeliveries;
+  CCloneBridge      m_CloneBridge;
+  CCIVBridge        m_Bridge;
+  CCIVMux           m_Mux;
 };
 #endif
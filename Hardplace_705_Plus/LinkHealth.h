@@ -0,0 +1,135 @@
+#if !defined LINKHEALTH_H_DEFINED
+#define LINKHEALTH_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+
+#include "Hardplace705Plus.h"
+
+/*
+   Bluetooth link health
+
+   One per link, the owner counts what crosses it: bytes each way, frames, frames that didn't parse, keepalives that
+   went unanswered and reconnects. Errors are also kept per window of WindowFrames frames, a link whose last window
+   was over DegradedErrorPercent, or that missed DegradedTimeouts keepalives in a row, is reported as degrading while
+   it still works.
+
+   The keepalive only runs when the link is quiet, traffic already says it's up. An answered keepalive doubles the
+   interval up to MaxKeepaliveMillis, a missed one halves it down to MinKeepaliveMillis, so a link that starts to
+   go is checked more often. Anything received while one is outstanding counts as the answer.
+
+   RSSI isn't here, the HC-05 only reports it in AT+INQ results, an inquiry takes seconds and can't run while linked.
+*/
+
+class CLinkHealth {
+public:
+  enum {
+    MinKeepaliveMillis = 2000,
+    MaxKeepaliveMillis = 30000,
+    ReplyMillis = 1000,
+    WindowFrames = 256,
+    DegradedErrorPercent = 2,
+    DegradedTimeouts = 2
+  };
+
+public:
+  CLinkHealth() {
+    reset();
+  }
+
+private:
+  CLinkHealth(const CLinkHealth&);
+  CLinkHealth& operator=(const CLinkHealth&);
+
+public:
+  void reset(void) {
+    m_ulRxBytes = m_ulTxBytes = m_ulFrames = m_ulErrors = 0;
+    m_ulKeepalives = m_ulTimeouts = m_ulReconnects = 0;
+    m_uWindowFrames = m_uWindowErrors = m_uLastWindowPercent = 0;
+    m_uTimeoutRun = 0;
+    m_ulKeepalive = MinKeepaliveMillis;
+    m_fAwaiting = false;
+    m_Quiet = 0;
+  }
+
+  void onRx(size_t cBytes) {
+    m_ulRxBytes += cBytes;
+    m_Quiet = 0;
+    if (m_fAwaiting) {
+      m_fAwaiting = false;
+      m_uTimeoutRun = 0;
+      m_ulKeepalive = (2 * m_ulKeepalive < MaxKeepaliveMillis) ? 2 * m_ulKeepalive : MaxKeepaliveMillis;
+    }
+  }
+  void onTx(size_t cBytes) {
+    m_ulTxBytes += cBytes;
+  }
+  void onFrame(void) {
+    m_ulFrames++;
+    if (++m_uWindowFrames >= WindowFrames) {
+      m_uLastWindowPercent = (100 * m_uWindowErrors) / m_uWindowFrames;
+      m_uWindowFrames = m_uWindowErrors = 0;
+    }
+  }
+  void onParseError(void) {
+    m_ulErrors++;
+    m_uWindowErrors++;
+    onFrame();
+  }
+  void onReconnect(void) {
+    m_ulReconnects++;
+    m_fAwaiting = false;
+    m_uTimeoutRun = 0;
+    m_ulKeepalive = MinKeepaliveMillis;
+  }
+
+  bool keepaliveDue(void) const {
+    return !m_fAwaiting && m_Quiet >= m_ulKeepalive;
+  }
+  void keepaliveSent(void) {
+    m_ulKeepalives++;
+    m_fAwaiting = true;
+    m_Reply = 0;
+  }
+  void Task(void) {
+    if (m_fAwaiting
+        && m_Reply >= ReplyMillis) {
+      m_fAwaiting = false;
+      m_ulTimeouts++;
+      m_uTimeoutRun++;
+      m_ulKeepalive = (m_ulKeepalive / 2 > MinKeepaliveMillis) ? m_ulKeepalive / 2 : MinKeepaliveMillis;
+    }
+  }
+
+  bool isDegrading(void) const {
+    return m_uLastWindowPercent > DegradedErrorPercent
+           || m_uTimeoutRun >= DegradedTimeouts;
+  }
+
+  void printStatus(Print& rDevice, const char* pszLink) const {
+    rDevice.printf("%-15s %lu bytes in, %lu out, %lu frames, %lu errors (%u%%), %lu/%lu keepalives missed, %lu reconnects,"
+                   " keepalive %lu ms%s\r\n",
+                   pszLink, m_ulRxBytes, m_ulTxBytes, m_ulFrames, m_ulErrors, m_uLastWindowPercent,
+                   m_ulTimeouts, m_ulKeepalives, m_ulReconnects, m_ulKeepalive, (isDegrading()) ? ", DEGRADING" : "");
+  }
+
+private:
+  uint32_t      m_ulRxBytes;
+  uint32_t      m_ulTxBytes;
+  uint32_t      m_ulFrames;
+  uint32_t      m_ulErrors;
+  uint32_t      m_ulKeepalives;
+  uint32_t      m_ulTimeouts;
+  uint32_t      m_ulReconnects;
+  unsigned      m_uWindowFrames;
+  unsigned      m_uWindowErrors;
+  unsigned      m_uLastWindowPercent;
+  unsigned      m_uTimeoutRun;  // Keepalives missed in a row
+  unsigned long m_ulKeepalive;
+  bool          m_fAwaiting;
+  elapsedMillis m_Quiet;
+  elapsedMillis m_Reply;
+};
+#endif
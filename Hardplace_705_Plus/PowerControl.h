@@ -0,0 +1,128 @@
+#if !defined POWERCONTROL_H_DEFINED
+#define POWERCONTROL_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+
+#include "Hardplace705Plus.h"
+
+/*
+   Closed loop amplifier output
+
+   One per Hardrock, fed the forward power, drive and SWR the owner read from the amplifier, the IC-705 RF level
+   and the limit, and answers the RF level to write, or -1 to leave it. Nothing is trimmed unless the amplifier is
+   transmitting (at least MinForwardWatts forward) into a target, a band and antenna without one runs open loop on
+   the power limits alone.
+
+   The new level scales the current one by target / forward, the IC-705 RF level drives the amplifier close enough
+   to linearly that a couple of trims settle it. Inside DeadbandPercent of the target it's left alone, up it moves
+   at most MaxStepUp per trim, down as far as it needs, and never more often than TrimMillis, the radio and the
+   amplifier's meter both need time to follow. Above FoldbackSWR the target itself comes down by FoldbackSWR / SWR,
+   so a bad match is driven less hard rather than held at full output. The limit is never exceeded.
+
+   The owner samples every PollMillis from the main loop, only while the radio says it's transmitting into a target,
+   one meter request per pass with its reply picked up on a later one, so the loop never waits on the amplifier. It
+   only trims in CW and digital modes, a voice signal's average is far under its peaks and would be driven up to the
+   limit; phone runs open loop.
+*/
+
+class CPowerControl {
+public:
+  enum {
+    PollMillis = 200,
+    TrimMillis = 500,
+    MinForwardWatts = 2,
+    DeadbandPercent = 5,
+    MaxStepUp = 13  // About 5% of the RF level range
+  };
+
+  static constexpr float FoldbackSWR = 2.0f;
+
+public:
+  CPowerControl()
+    : m_fTransmitting(false), m_fFoldback(false), m_fForward(0), m_fDrive(0), m_fSWR(0),
+      m_ulSamples(0), m_ulTrims(0), m_ulFoldbacks(0), m_uchLastLevel(0) {}
+
+private:
+  CPowerControl(const CPowerControl&);
+  CPowerControl& operator=(const CPowerControl&);
+
+public:
+  void idle(void) {  // Not the active amplifier, or the band is changing
+    m_fTransmitting = m_fFoldback = false;
+  }
+
+  int onSample(float fForward, float fDrive, float fSWR, unsigned uTargetWatts, uint8_t uchLevel, uint8_t uchLimit) {
+    m_ulSamples++;
+    m_fForward = fForward;
+    m_fDrive = fDrive;
+    m_fSWR = fSWR;
+    m_fTransmitting = fForward >= MinForwardWatts;
+    if (!m_fTransmitting
+        || !uTargetWatts
+        || !uchLevel) {
+      m_fFoldback = false;
+      return -1;
+    }
+
+    float fTarget(uTargetWatts);
+
+    if (fSWR > FoldbackSWR) {
+      if (!m_fFoldback) {
+        m_ulFoldbacks++;
+      }
+      m_fFoldback = true;
+      fTarget = (fTarget * FoldbackSWR) / fSWR;
+    } else {
+      m_fFoldback = false;
+    }
+
+    const float fError(fTarget - fForward);
+
+    if ((fError < 0 ? -fError : fError) * 100.0f <= fTarget * DeadbandPercent
+        || m_Trim < TrimMillis) {
+      return (uchLevel > uchLimit) ? uchLimit : -1;
+    }
+
+    long lLevel(lroundf((float(uchLevel) * fTarget) / fForward));
+
+    if (lLevel > uchLevel + MaxStepUp) {
+      lLevel = uchLevel + MaxStepUp;
+    }
+    if (lLevel > uchLimit) {
+      lLevel = uchLimit;
+    }
+    if (lLevel < 1) {
+      lLevel = 1;
+    }
+    if (lLevel == uchLevel) {
+      return -1;
+    }
+    m_Trim = 0;
+    m_ulTrims++;
+    m_uchLastLevel = static_cast<uint8_t>(lLevel);
+    return lLevel;
+  }
+
+  void printStatus(Print& rDevice, const char* pszAmp) const {
+    rDevice.printf("%-15s %s forward %.1f W, drive %.1f W, SWR %.1f, %lu samples, %lu trims, last RF level %u,"
+                   " %lu fold-backs%s\r\n",
+                   pszAmp, (m_fTransmitting) ? "TX" : "RX", m_fForward, m_fDrive, m_fSWR,
+                   m_ulSamples, m_ulTrims, m_uchLastLevel, m_ulFoldbacks, (m_fFoldback) ? ", FOLDED BACK" : "");
+  }
+
+private:
+  volatile bool m_fTransmitting;
+  bool          m_fFoldback;
+  float         m_fForward;
+  float         m_fDrive;
+  float         m_fSWR;
+  uint32_t      m_ulSamples;
+  uint32_t      m_ulTrims;
+  uint32_t      m_ulFoldbacks;
+  uint8_t       m_uchLastLevel;
+  elapsedMillis m_Trim;
+};
+#endif
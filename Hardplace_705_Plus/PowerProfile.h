@@ -0,0 +1,168 @@
+#if !defined POWERPROFILE_H_DEFINED
+#define POWERPROFILE_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <Arduino.h>
+
+#include "Hardplace705Plus.h"
+#include "EEPromStream.h"
+
+/*
+   RF power limits
+
+   One byte per amplifier (Hardrock A, Hardrock B, QRP), antenna, band and mode class, the IC-705 RF level the radio
+   may be set to there. The bands are the eleven the Hardrocks cover plus 2M and 70CM, the mode classes are CW, phone
+   (SSB, AM, FM) and digital (RTTY and DV, the IC-705 doesn't broadcast the USB-D data mode). The QRP rows only use
+   the first antenna.
+
+   The record is written by the owner's setters, the owner keeps the indices of where it is operating and reads one
+   byte when it needs the limit. seed() sets every mode class at once, for the limits kept before there were mode
+   classes. Until the radio has told it the mode, the owner clamps to lowest(), the tightest of the mode classes.
+
+   Each Hardrock, antenna and HF band also has an output target in watts for CPowerControl, 0 leaves it open loop.
+*/
+
+#define VER_POWERPROFILE 1
+
+class CPowerProfile : public CEEPROMStream {
+public:
+  enum {
+    Amplifiers = 3,
+    Hardrocks = 2,  // The amplifiers with a power meter
+    Antennas = 2,
+    Bands = 13,
+    Band2M = 11,
+    Band70CM = 12,
+    Unlimited = 255
+  };
+
+  enum eModeClass {
+    CW,
+    Phone,
+    Digital,
+    ModeClasses
+  };
+
+public:
+  CPowerProfile(uint8_t uchRecordType)
+    : CEEPROMStream(uchRecordType, VER_POWERPROFILE) {
+    memset(m_auchMax, Unlimited, sizeof m_auchMax);
+    memset(m_auTargetWatts, 0, sizeof m_auTargetWatts);
+    if (haveRecord()) {
+      Serialize(true);
+    }
+  }
+
+private:
+  CPowerProfile();
+  CPowerProfile(const CPowerProfile&);
+  CPowerProfile& operator=(const CPowerProfile&);
+
+  virtual void Commit(void) {
+    Serialize();
+  }
+
+public:
+  static int bandIndex(uint32_t ulMeters) {  // 6M through 160M as getMetersMapIndex(), then 2M and 70CM
+    switch (ulMeters) {
+      case 6: return 0;
+      case 10: return 1;
+      case 12: return 2;
+      case 15: return 3;
+      case 17: return 4;
+      case 20: return 5;
+      case 30: return 6;
+      case 40: return 7;
+      case 60: return 8;
+      case 80: return 9;
+      case 160: return 10;
+      case 2: return Band2M;
+      case 1: return Band70CM;
+      default: return -1;
+    }
+  }
+
+  static eModeClass modeClass(int iMode) {  // The CI-V operating mode
+    switch (iMode) {
+      case 0x03:  // CW
+      case 0x07:  // CW-R
+        return CW;
+      case 0x04:  // RTTY
+      case 0x08:  // RTTY-R
+      case 0x17:  // DV
+        return Digital;
+      default:
+        return Phone;
+    }
+  }
+  static const char* modeClassName(eModeClass eMode) {
+    static const char* const apszNames[ModeClasses] = { "CW", "Phone", "Digital" };
+
+    return (eMode >= CW && eMode < ModeClasses) ? apszNames[eMode] : "";
+  }
+
+  uint8_t get(unsigned uAmplifier, unsigned uAntenna, int iBand, eModeClass eMode) const {
+    return (iBand >= 0 && iBand < Bands) ? m_auchMax[uAmplifier][uAntenna][iBand][eMode] : Unlimited;
+  }
+  uint8_t lowest(unsigned uAmplifier, unsigned uAntenna, int iBand) const {
+    uint8_t uchMax(Unlimited);
+
+    for (unsigned uMode(0); uMode < ModeClasses; uMode++) {
+      const uint8_t uchMode(get(uAmplifier, uAntenna, iBand, static_cast<eModeClass>(uMode)));
+
+      uchMax = (uchMode < uchMax) ? uchMode : uchMax;
+    }
+    return uchMax;
+  }
+  void set(unsigned uAmplifier, unsigned uAntenna, int iBand, eModeClass eMode, uint8_t uchMax) {
+    if (iBand >= 0 && iBand < Bands
+        && m_auchMax[uAmplifier][uAntenna][iBand][eMode] != uchMax) {
+      m_auchMax[uAmplifier][uAntenna][iBand][eMode] = uchMax;
+      setDirty();
+    }
+  }
+  void seed(unsigned uAmplifier, unsigned uAntenna, int iBand, uint8_t uchMax) {
+    for (unsigned uMode(0); uMode < ModeClasses; uMode++) {
+      set(uAmplifier, uAntenna, iBand, static_cast<eModeClass>(uMode), uchMax);
+    }
+  }
+
+  uint16_t targetWatts(unsigned uAmplifier, unsigned uAntenna, int iBand) const {
+    return (uAmplifier < Hardrocks && iBand >= 0 && iBand < Band2M) ? m_auTargetWatts[uAmplifier][uAntenna][iBand] : 0;
+  }
+  bool setTargetWatts(unsigned uAmplifier, unsigned uAntenna, int iBand, uint16_t uWatts) {
+    if (uAmplifier >= Hardrocks
+        || iBand < 0 || iBand >= Band2M) {
+      return false;
+    }
+    if (m_auTargetWatts[uAmplifier][uAntenna][iBand] != uWatts) {
+      m_auTargetWatts[uAmplifier][uAntenna][iBand] = uWatts;
+      setDirty();
+    }
+    return true;
+  }
+
+private:
+  void Serialize(bool bLoad = false) {
+    const SField aFields[] = {
+      field(1, m_auchMax[0]),
+      field(2, m_auchMax[1]),
+      field(3, m_auchMax[2]),
+      field(4, m_auTargetWatts[0]),
+      field(5, m_auTargetWatts[1])
+    };
+
+    if (bLoad) {
+      getFields(aFields, sizeof aFields / sizeof aFields[0]);
+    } else {
+      putFields(aFields, sizeof aFields / sizeof aFields[0]);
+    }
+  }
+
+private:
+  uint8_t  m_auchMax[Amplifiers][Antennas][Bands][ModeClasses];
+  uint16_t m_auTargetWatts[Hardrocks][Antennas][Band2M];
+};
+#endif
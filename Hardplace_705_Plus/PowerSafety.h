@@ -0,0 +1,104 @@
+#if !defined POWERSAFETY_H_DEFINED
+#define POWERSAFETY_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+
+#include "Hardplace705Plus.h"
+
+/*
+   RF power on a band change
+
+   The owner starts it when the frequency broadcast says the band changed, writes the new band's safe RF level and
+   asks for it back, and keeps the amplifier PTT enable lines low while it's pending. The next RF power response at
+   or under the limit acknowledges it, that's the radio set safe for the new band, and the time from the broadcast is
+   kept as the band change latency.
+
+   A write the radio didn't take (the CI-V port was busy, the frame was lost) is repeated every RetryMillis, up to
+   MaxWrites writes. After that it stays pending, the lines stay low and the RF power poll acknowledges it when the
+   radio is at a safe level.
+*/
+
+class CPowerSafety {
+public:
+  enum {
+    RetryMillis = 250,
+    MaxWrites = 4
+  };
+
+public:
+  CPowerSafety()
+    : m_fPending(false), m_uWrites(0), m_ulBandChanges(0), m_ulAcknowledged(0), m_ulRetries(0), m_ulGaveUp(0),
+      m_ulLastMicros(0), m_ulMaxMicros(0), m_ullTotalMicros(0) {}
+
+private:
+  CPowerSafety(const CPowerSafety&);
+  CPowerSafety& operator=(const CPowerSafety&);
+
+public:
+  void start(void) {  // A band change that superseded one still pending starts over
+    m_fPending = true;
+    m_uWrites = 1;
+    m_Since = 0;
+    m_Retry = 0;
+    m_ulBandChanges++;
+  }
+  void cancel(void) {  // Disconnected, the lines are off anyway
+    m_fPending = false;
+  }
+  bool pending(void) const {
+    return m_fPending;
+  }
+  uint32_t acknowledged(void) {
+    const uint32_t ulMicros(m_Since);
+
+    m_fPending = false;
+    m_ulAcknowledged++;
+    m_ulLastMicros = ulMicros;
+    m_ullTotalMicros += ulMicros;
+    if (ulMicros > m_ulMaxMicros) {
+      m_ulMaxMicros = ulMicros;
+    }
+    return ulMicros;
+  }
+
+  bool retryDue(void) const {
+    return m_fPending && m_Retry >= RetryMillis;
+  }
+  bool retry(void) {  // True while another write is worth sending
+    m_Retry = 0;
+    if (m_uWrites < MaxWrites) {
+      m_uWrites++;
+      m_ulRetries++;
+      return true;
+    }
+    if (m_uWrites++ == MaxWrites) {
+      m_ulGaveUp++;
+    }
+    return false;
+  }
+
+  void printStatus(Print& rDevice) const {
+    rDevice.printf("Power safety    %lu band changes, latency last %lu us, max %lu us, average %lu us, %lu retries,"
+                   " %lu unacknowledged%s\r\n",
+                   m_ulBandChanges, m_ulLastMicros, m_ulMaxMicros,
+                   (m_ulAcknowledged) ? static_cast<uint32_t>(m_ullTotalMicros / m_ulAcknowledged) : 0UL,
+                   m_ulRetries, m_ulGaveUp, (m_fPending) ? ", PTT HELD" : "");
+  }
+
+private:
+  bool          m_fPending;
+  unsigned      m_uWrites;
+  elapsedMicros m_Since;
+  elapsedMillis m_Retry;
+  uint32_t      m_ulBandChanges;
+  uint32_t      m_ulAcknowledged;
+  uint32_t      m_ulRetries;
+  uint32_t      m_ulGaveUp;  // Ran out of writes, waited on the poll
+  uint32_t      m_ulLastMicros;
+  uint32_t      m_ulMaxMicros;
+  uint64_t      m_ullTotalMicros;
+};
+#endif
@@ -0,0 +1,110 @@
+#include <Arduino.h>
+#if !defined PROFILE_CYCLE_COUNTER
+#include <chrono>
+#endif
+
+#include "Profiler.h"
+
+CProfiler::SProbe CProfiler::m_aProbes[CProfiler::EndOfList];
+
+static const char* apszProbeNames[CProfiler::EndOfList] = {
+  "Loop",
+  "Teensy.Task",
+  "IC_705.Task",
+  "HardrockA.Task",
+  "HardrockB.Task",
+  "BluetoothA.Task",
+  "BluetoothB.Task",
+  "CmdProcessor.Task",
+  "CmdProcessorB.Task",
+  "HardplaceTask",
+  "TraceLog.Task",
+  "Capture.Task",
+  "EEPROM.Task",
+  "IC_705 frame fan-out",
+  "readBytesUntil",
+  "Hardrock write spacing",
+  "SendATCmd"
+};
+
+static class CProfilerInitialize {
+public:
+  CProfilerInitialize() {
+    CProfiler::begin();
+  }
+} _profilerInitialize;
+
+void CProfiler::begin(void) {
+#if defined PROFILE_CYCLE_COUNTER
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;  // The Teensy startup code enables these, make sure
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+  reset();
+}
+
+void CProfiler::reset(void) {
+  for (size_t nIndex(0); nIndex < EndOfList; nIndex++) {
+    memset(&m_aProbes[nIndex], 0, sizeof m_aProbes[nIndex]);
+    m_aProbes[nIndex].m_uMin = UINT32_MAX;
+  }
+}
+
+uint32_t CProfiler::cycles(void) {
+#if defined PROFILE_CYCLE_COUNTER
+  return ARM_DWT_CYCCNT;
+#else
+  return static_cast<uint32_t>(
+    std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch())
+      .count());
+#endif
+}
+
+uint32_t CProfiler::cyclesPerMicrosecond(void) {
+#if defined PROFILE_CYCLE_COUNTER
+  uint32_t uCyclesPerMicrosecond(F_CPU_ACTUAL / 1000000);  // Tracks set_arm_clock() throttling
+
+  return (uCyclesPerMicrosecond) ? uCyclesPerMicrosecond : 1;
+#else
+  return 1000;
+#endif
+}
+
+const char* CProfiler::probeName(eProbe eWhich) {
+  return (eWhich >= 0 && eWhich < EndOfList) ? apszProbeNames[eWhich] : "Unknown";
+}
+
+void CProfiler::print(Print& rDevice, bool fMachineReadable) {
+  const uint32_t uCyclesPerMicrosecond(cyclesPerMicrosecond());
+
+  if (fMachineReadable) {
+    rDevice.printf("probe,count,min_cycles,mean_cycles,max_cycles,cycles_per_us");
+    for (size_t nBucket(0); nBucket < HistogramBuckets; nBucket++) {
+      rDevice.printf(",lt_%lu_us", 1UL << nBucket);
+    }
+    rDevice.printf("\r\n");
+  } else {
+    rDevice.printf("%-22s %10s %10s %10s %10s\r\n", "Probe", "Count", "Min(us)", "Mean(us)", "Max(us)");
+  }
+
+  for (size_t nIndex(0); nIndex < EndOfList; nIndex++, Delay(10)) {
+    const SProbe   Probe(m_aProbes[nIndex]);  // Snapshot, the probes keep running
+    const uint32_t uMin((Probe.m_ulCount) ? Probe.m_uMin : 0);
+    const uint32_t uMean((Probe.m_ulCount) ? static_cast<uint32_t>(Probe.m_ullTotal / Probe.m_ulCount) : 0);
+
+    if (fMachineReadable) {
+      rDevice.printf("%s,%lu,%lu,%lu,%lu,%lu",
+                     probeName(eProbe(nIndex)), Probe.m_ulCount, uMin, uMean, Probe.m_uMax, uCyclesPerMicrosecond);
+      for (size_t nBucket(0); nBucket < HistogramBuckets; nBucket++) {
+        rDevice.printf(",%lu", Probe.m_aulHistogram[nBucket]);
+      }
+      rDevice.printf("\r\n");
+    } else {
+      rDevice.printf("%-22s %10lu %10lu %10lu %10lu\r\n",
+                     probeName(eProbe(nIndex)), Probe.m_ulCount,
+                     uMin / uCyclesPerMicrosecond, uMean / uCyclesPerMicrosecond,
+                     Probe.m_uMax / uCyclesPerMicrosecond);
+    }
+    rDevice.flush();
+  }
+}
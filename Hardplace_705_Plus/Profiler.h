@@ -0,0 +1,141 @@
+#if !defined PROFILER_H_DEFINED
+#define PROFILER_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Print.h>
+
+#include "Hardplace705Plus.h"
+
+/*
+   Cycle accurate task profiler
+
+   On the Teensy 4.x the probes are timed with the Cortex-M7 DWT cycle counter (ARM_DWT_CYCCNT),
+   one count per CPU clock, so a probe costs two register reads and a handful of adds.
+   Off target (host builds) std::chrono::steady_clock is used and a "cycle" is one nanosecond.
+
+   Each probe accumulates count/min/mean/max and a log2 histogram of the elapsed time in microseconds
+   (bucket n holds samples < 2^n microseconds, the last bucket holds everything longer).
+
+   "HPPR;"  prints the table, "HPPRM;" prints it machine readable (CSV), "HPPRR;" resets the counters.
+*/
+
+#if defined __IMXRT1062__
+#define PROFILE_CYCLE_COUNTER
+#endif
+
+class CProfiler {
+public:
+  enum eProbe {
+    Loop,
+    TeensyTask,
+    IC_705Task,
+    HardrockATask,
+    HardrockBTask,
+    BluetoothATask,
+    BluetoothBTask,
+    CmdProcessorTask,
+    CmdProcessorBTask,
+    HardplaceTask,
+    TraceLogTask,
+    CaptureTask,
+    EEPROMTask,
+    FrameFanOut,
+    ReadBytesUntil,
+    HardrockWriteSpacing,
+    SendATCmd,
+    EndOfList
+  };
+
+  enum {
+    HistogramBuckets = 16
+  };
+
+private:
+  CProfiler();
+  CProfiler(const CProfiler&);
+  CProfiler& operator=(const CProfiler&);
+
+public:
+  static void begin(void);
+  static void reset(void);
+  static void print(Print& rDevice, bool fMachineReadable = false);
+
+  static uint32_t cycles(void);
+  static uint32_t cyclesPerMicrosecond(void);
+
+  static void record(eProbe eWhich, uint32_t uCycles) {
+    if (eWhich >= 0 && eWhich < EndOfList) {
+      SProbe& rProbe(m_aProbes[eWhich]);
+
+      rProbe.m_ulCount++;
+      rProbe.m_ullTotal += uCycles;
+      if (uCycles < rProbe.m_uMin) {
+        rProbe.m_uMin = uCycles;
+      }
+      if (uCycles > rProbe.m_uMax) {
+        rProbe.m_uMax = uCycles;
+      }
+      rProbe.m_aulHistogram[bucket(uCycles)]++;
+    }
+  }
+
+  static const char* probeName(eProbe eWhich);
+  static uint32_t    maxMicros(eProbe eWhich) {
+    return (eWhich >= 0 && eWhich < EndOfList) ? m_aProbes[eWhich].m_uMax / cyclesPerMicrosecond() : 0;
+  }
+
+private:
+  static size_t bucket(uint32_t uCycles) {
+    uint32_t uMicros(uCycles / cyclesPerMicrosecond());
+    size_t   stBucket(0);
+
+    while (uMicros && stBucket < HistogramBuckets - 1) {
+      uMicros >>= 1, stBucket++;
+    }
+    return stBucket;
+  }
+
+  struct SProbe {
+    uint32_t m_ulCount;
+    uint64_t m_ullTotal;
+    uint32_t m_uMin;
+    uint32_t m_uMax;
+    uint32_t m_aulHistogram[HistogramBuckets];
+  };
+
+private:
+  static SProbe m_aProbes[EndOfList];  // Best effort when updated from more than one thread
+};
+
+class CProfileScope {
+public:
+  CProfileScope(CProfiler::eProbe eWhich)
+    : m_eWhich(eWhich), m_uStart(CProfiler::cycles()) {
+  }
+  ~CProfileScope() {
+    CProfiler::record(m_eWhich, CProfiler::cycles() - m_uStart);
+  }
+
+private:
+  CProfileScope();
+  CProfileScope(const CProfileScope&);
+  CProfileScope& operator=(const CProfileScope&);
+
+private:
+  const CProfiler::eProbe m_eWhich;
+  const uint32_t          m_uStart;
+};
+
+#if defined DO_PROFILE
+#define PROFILE_SCOPE(_probe_) CProfileScope _profile_scope_(CProfiler::_probe_)
+#define PROFILE(_probe_, _expr_) \
+  do { \
+    CProfileScope _profile_scope_(CProfiler::_probe_); \
+    _expr_; \
+  } while (0)
+#else
+#define PROFILE_SCOPE(_probe_)
+#define PROFILE(_probe_, _expr_) _expr_
+#endif
+#endif
@@ -0,0 +1,80 @@
+#include <Arduino.h>
+
+#include "SerialBuffers.h"
+#include "Profiler.h"
+#include "Tracer.h"
+
+static DMAMEM uint8_t auchPool[CSerialBuffers::PoolBytes] __attribute__((aligned(CSerialBuffers::Alignment)));
+
+CSerialBuffers::SPort CSerialBuffers::m_aPorts[CSerialBuffers::Ports];
+size_t                CSerialBuffers::m_cPorts(0);
+size_t                CSerialBuffers::m_stPoolUsed(0);
+
+bool CSerialBuffers::attach(HardwareSerial& rPort, const char* pszName, uint32_t ulMaxBaudrate,
+                            unsigned long ulStallMillis, size_t stTxBytes) {
+  size_t stRxBytes((ulMaxBaudrate / 10) * ulStallMillis / 1000);  // 8N1, ten bits a byte
+  void*  pRx;
+  void*  pTx;
+
+  stRxBytes = (stRxBytes < MinRxBytes) ? MinRxBytes : stRxBytes;
+  if (m_cPorts >= Ports
+      || (pRx = carve(stRxBytes)) == 0
+      || (pTx = carve(stTxBytes)) == 0) {
+    CTraceDevice().TraceLn(String("CSerialBuffers::attach() out of room for ") + pszName);
+    return false;
+  }
+  rPort.addMemoryForRead(pRx, stRxBytes);
+  rPort.addMemoryForWrite(pTx, stTxBytes);
+
+  SPort& rEntry(m_aPorts[m_cPorts++]);
+
+  rEntry.m_pPort = &rPort;
+  rEntry.m_pszName = pszName;
+  rEntry.m_ulBaudrate = ulMaxBaudrate;
+  rEntry.m_stRxBytes = stRxBytes;
+  rEntry.m_stTxBytes = stTxBytes;
+  rEntry.m_stHighWater = 0;
+  rEntry.m_ulOverruns = 0;
+  rEntry.m_fFull = false;
+  return true;
+}
+
+void* CSerialBuffers::carve(size_t stBytes) {
+  const size_t stAligned((stBytes + Alignment - 1) & ~size_t(Alignment - 1));
+  void*        pReturn(0);
+
+  if (m_stPoolUsed + stAligned <= PoolBytes) {
+    pReturn = &auchPool[m_stPoolUsed];
+    m_stPoolUsed += stAligned;
+  }
+  return pReturn;
+}
+
+void CSerialBuffers::Task(void) {
+  for (size_t nPort(0); nPort < m_cPorts; nPort++) {
+    SPort&       rPort(m_aPorts[nPort]);
+    const size_t stLevel(rPort.m_pPort->available());
+    const bool   fFull(stLevel + 1 >= rPort.m_stRxBytes + CoreRxBytes);  // One slot is kept empty
+
+    if (stLevel > rPort.m_stHighWater) {
+      rPort.m_stHighWater = stLevel;
+    }
+    if (fFull && !rPort.m_fFull) {
+      rPort.m_ulOverruns++;
+    }
+    rPort.m_fFull = fFull;
+  }
+}
+
+void CSerialBuffers::printStatus(Print& rDevice) {
+  for (size_t nPort(0); nPort < m_cPorts; nPort++) {
+    const SPort&   rPort(m_aPorts[nPort]);
+    const uint32_t ulLastsMillis(((rPort.m_stRxBytes + CoreRxBytes) * 10UL * 1000UL) / rPort.m_ulBaudrate);
+
+    rDevice.printf("%-15s rx %u, tx %u, high water %u, %lu overruns, lasts %lu ms at %lu\r\n",
+                   rPort.m_pszName, rPort.m_stRxBytes + CoreRxBytes, rPort.m_stTxBytes, rPort.m_stHighWater,
+                   rPort.m_ulOverruns, ulLastsMillis, rPort.m_ulBaudrate);
+  }
+  rDevice.printf("UART buffers    %u of %u bytes, worst loop stall %lu ms\r\n",
+                 m_stPoolUsed, static_cast<size_t>(PoolBytes), CProfiler::maxMicros(CProfiler::Loop) / 1000);
+}
@@ -0,0 +1,67 @@
+#if !defined SERIALBUFFERS_H_DEFINED
+#define SERIALBUFFERS_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <Print.h>
+
+#include "Hardplace705Plus.h"
+
+/*
+   UART buffers
+
+   The core gives each hardware serial port a 64 byte receive ring, at 115200 that's under 6 ms of data and the loop
+   can stall for far longer (Hardrock write spacing, a synchronous AT command). attach() adds a receive buffer
+   sized to hold the port's fastest rate for StallMillis, and a transmit buffer so a burst doesn't block the loop,
+   both carved from one DMAMEM (RAM2) pool at setup. The core's rings are filled by the UART interrupt, DMAMEM is
+   simply where the room is, nothing here is DMA.
+
+   Task() samples each port's receive level, the high water mark and every time a ring was found full (bytes the
+   UART had nowhere to put) are reported in HPPS, with the loop's worst stall from the profiler to compare against
+   how long each buffer lasts at its rate.
+*/
+
+class CSerialBuffers {
+public:
+  enum {
+    Ports = 8,
+    PoolBytes = 64 * 1024,
+    StallMillis = 200,  // Worst loop stall to ride out, HPPR shows the measured one
+    MinRxBytes = 256,
+    TxBytes = 1024,
+    CoreRxBytes = 64,  // SERIALn_RX_BUFFER_SIZE
+    Alignment = 32
+  };
+
+private:
+  CSerialBuffers();
+  CSerialBuffers(const CSerialBuffers&);
+  CSerialBuffers& operator=(const CSerialBuffers&);
+
+public:
+  static bool attach(HardwareSerial& rPort, const char* pszName, uint32_t ulMaxBaudrate,
+                     unsigned long ulStallMillis = StallMillis, size_t stTxBytes = TxBytes);
+  static void Task(void);
+  static void printStatus(Print& rDevice);
+
+private:
+  struct SPort {
+    HardwareSerial* m_pPort;
+    const char*     m_pszName;
+    uint32_t        m_ulBaudrate;
+    size_t          m_stRxBytes;  // Added to the core's
+    size_t          m_stTxBytes;
+    size_t          m_stHighWater;
+    uint32_t        m_ulOverruns;
+    bool            m_fFull;
+  };
+
+  static void* carve(size_t stBytes);
+
+private:
+  static SPort  m_aPorts[Ports];
+  static size_t m_cPorts;
+  static size_t m_stPoolUsed;
+};
+#endif
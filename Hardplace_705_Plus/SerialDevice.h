@@ -10,6 +10,7 @@
 #include "HardplaceUSBHost.h"
 
 #include "Tracer.h"
+#include "Profiler.h"
 
 #if !defined USB_DUAL_SERIAL && !defined USB_TRIPLE_SERIAL
 #define SerialUSB1 Serial
@@ -33,13 +34,16 @@ protected:
       m_rUsb3Device(SerialUSB2),
       m_rUsbHostDevice((streamType(rStream) == USBSerialHostType) ? static_cast<USBSerialBase&>(rStream) : SerialUSBHost1),
       m_uBaudrate(uBaudrate),
-      m_uFormat(uFormat) {
+      m_uFormat(uFormat),
+      m_uLineBaudrate(uBaudrate),
+      m_fClaimed(false) {
     setTimeout(ulTimeout);
   }
   CSerialStream(const CSerialStream& rhs)
     : m_Type(rhs.m_Type), m_rStream(rhs.m_rStream), m_rHsDevice(rhs.m_rHsDevice),
       m_rUsb1Device(rhs.m_rUsb1Device), m_rUsb2Device(rhs.m_rUsb2Device), m_rUsb3Device(rhs.m_rUsb3Device),
-      m_rUsbHostDevice(rhs.m_rUsbHostDevice), m_uBaudrate(rhs.m_uBaudrate), m_uFormat(rhs.m_uFormat) {
+      m_rUsbHostDevice(rhs.m_rUsbHostDevice), m_uBaudrate(rhs.m_uBaudrate), m_uFormat(rhs.m_uFormat),
+      m_uLineBaudrate(rhs.m_uLineBaudrate), m_fClaimed(false) {
   }
   virtual ~CSerialStream() {}
 
@@ -48,6 +52,7 @@ public:
     begin(m_uBaudrate, m_uFormat);
   }
   virtual void begin(uint32_t baud, uint16_t format = SERIAL_8N1) {
+    m_uLineBaudrate = baud;
     if (m_Type == HardwareSerialDeviceType) {
       m_rHsDevice.begin(baud, format);
     } else if (m_Type == USBSerial1DeviceType) {
@@ -92,6 +97,7 @@ public:
   }
   // Note: This one buffers the terminator unlike the original
   virtual size_t readBytesUntil(uint8_t terminator, uint8_t* buffer, size_t length) {
+    PROFILE_SCOPE(ReadBytesUntil);
     unsigned long ulTimeout(getTimeout());
     bool          fTerminatorFound(false);
     size_t        cBytes(0);
@@ -240,15 +246,27 @@ public:
   virtual uint32_t getBaudrate(void) const {
     return m_uBaudrate;
   }
+  uint32_t lineBaudrate(void) const {  // What begin() last set, a discovery probe can leave it off getBaudrate()
+    return m_uLineBaudrate;
+  }
 
 public:
   virtual void Task(void) {
-    if (available() > 0) {
+    if (!m_fClaimed
+        && available() > 0) {
       onAvailable();
     }
   }
+  void claim(bool fClaim) {  // Someone else is reading the stream, don't call onAvailable()
+    m_fClaimed = fClaim;
+  }
+  bool isClaimed(void) const {
+    return m_fClaimed;
+  }
   virtual void onAvailable(void) {
   }
+  virtual void onSkippedFrame(const uint8_t* puchFrame, size_t stFrame) {  // Read past by a synchronous request
+  }
 
 public:
   String getTypeString(void) const {
@@ -275,6 +293,13 @@ public:
     return sType;
   }
 
+  const Stream& stream(void) const {
+    return m_rStream;
+  }
+  Stream& stream(void) {
+    return m_rStream;
+  }
+
   virtual String deviceName(void) const {
     String sDeviceName("Unknown");
     if (&m_rStream == static_cast<const Stream*>(&Serial1)) {
@@ -299,14 +324,8 @@ public:
       sDeviceName = "SerialUSB1";
     } else if (&m_rStream == static_cast<const Stream*>(&SerialUSB2)) {
       sDeviceName = "SerialUSB2";
-    } else if (&m_rStream == static_cast<const Stream*>(&SerialUSBHost1)) {
-      sDeviceName = "SerialUSBHost1";
-    } else if (&m_rStream == static_cast<const Stream*>(&SerialUSBHost2)) {
-      sDeviceName = "SerialUSBHost2";
-    } else if (&m_rStream == static_cast<const Stream*>(&SerialUSBHost3)) {
-      sDeviceName = "SerialUSBHost3";
-    } else if (&m_rStream == static_cast<const Stream*>(&SerialUSBHost4)) {
-      sDeviceName = "SerialUSBHost4";
+    } else if (CHardplaceUSBHost::isSerialPort(m_rStream)) {
+      sDeviceName = "SerialUSBHost" + String(CHardplaceUSBHost::serialPortIndex(m_rStream) + 1);
     }
     return sDeviceName;
   }
@@ -343,10 +362,7 @@ private:
       StreamType = USBSerial2DeviceType;
     } else if (&rStream == static_cast<const Stream*>(&SerialUSB2)) {
       StreamType = USBSerial3DeviceType;
-    } else if (&rStream == static_cast<const Stream*>(&SerialUSBHost1)
-               || &rStream == static_cast<const Stream*>(&SerialUSBHost2)
-               || &rStream == static_cast<const Stream*>(&SerialUSBHost3)
-               || &rStream == static_cast<const Stream*>(&SerialUSBHost4)) {
+    } else if (CHardplaceUSBHost::isSerialPort(rStream)) {
       StreamType = USBSerialHostType;
     } else {
       StreamType = UnknownDeviceType;
@@ -370,6 +386,8 @@ private:
   USBSerialBase&     m_rUsbHostDevice;
   uint32_t           m_uBaudrate;
   uint16_t           m_uFormat;
+  uint32_t           m_uLineBaudrate;
+  volatile bool      m_fClaimed;
 };
 
 #undef SerialUSB1
@@ -5,6 +5,9 @@
 #include "Teensy41.h"
 #include "ICOM.h"
 #include "IC_705Master.h"
+#include "Profiler.h"
+#include "TraceLog.h"
+#include "Capture.h"
 
 // https://github.com/FrankBoesing/T4_PowerButton
 void CTeensy::reboot(void) const {
@@ -14,36 +17,56 @@ void CTeensy::reboot(void) const {
 }
 
 void CTeensy::onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice) {
+  onNewFrame(CICOMResp(CICOMResp::NoCopy, puPacket, stPacket), rSrcDevice);
+}
+bool CTeensy::onNewFrame(const CICOMResp& Resp, CSerialDevice& rSrcDevice) {
   CIC_705MasterDevice& rIC_705(static_cast<CIC_705MasterDevice&>(rSrcDevice));
-  CICOMResp            Resp(puPacket, stPacket);
+
   if (Resp.isFrequencyResponse()) {
     uint32_t uPrevBand(getFrequencyMeters());
 
     setFrequencyHz(Resp.FrequencyHz());
     setFrequencyMeters(Resp.FrequencyMeters());
 
+    if (!uPrevBand
+        && !m_fModeKnown) {  // First since connecting, the mode class for the power limit, Task() retries it
+      m_ModeRetry = 0;
+      rIC_705.ReadModeFilter();
+    }
     if (uPrevBand != getFrequencyMeters()) {
-      if (getMetersMapIndex(getFrequencyMeters()) >= 0) {
-        digitalWrite(PTT_A_Enable, PTTEnabled(eHardrock::A));
-        digitalWrite(PTT_B_Enable, PTTEnabled(eHardrock::B));
-        rIC_705.ReadRFPower();
-      } else {
-        digitalWrite(PTT_A_Enable, LOW);
-        digitalWrite(PTT_B_Enable, LOW);
+      if (CPowerProfile::bandIndex(getFrequencyMeters()) >= 0) {  // Safe before the radio can transmit on it
+        m_PowerSafety.start();
+        rIC_705.WriteRFPower(safePower());
       }
+      writePTTEnables();
+      rIC_705.ReadRFPower();
     }
   } else if (Resp.isOperatingModeResponse()) {
-
+    if (Resp.Mode() >= 0) {
+      setModeClass(CPowerProfile::modeClass(Resp.Mode()));
+    }
+  } else if (Resp.ResponseType() == 0x1C  // TX state, asked for by onTXPoll()
+             && Resp >= 8
+             && Resp[5] == 0x00) {
+    m_fTransmitting = Resp[6] == 0x01;
+    m_TXSeen = 0;
   } else if (Resp.ResponseType() == 0x14  // RF Power
              && Resp >= 6
              && Resp[5] == 0x0A) {
-    uint8_t uchMaxPower(
-      (HardrockAvailable(eHardrock::A) && PTTEnabled(eHardrock::A))
-        ? getMaxPower(eHardrock::A, m_aCurrentAntenna[eHardrock::A], getFrequencyMeters())
-      : (HardrockAvailable(eHardrock::B) && PTTEnabled(eHardrock::B))
-        ? getMaxPower(eHardrock::B, m_aCurrentAntenna[eHardrock::B], getFrequencyMeters())
-        : getMaxPowerQRP(getFrequencyMeters()));
-    if (NewBand(false)) {
+    const uint8_t uchMaxPower(maxPower());
+
+    onRFLevel(Resp.RFPower());
+    if (m_PowerSafety.pending()) {
+      if (Resp.RFPower() <= uchMaxPower) {
+        const uint32_t ulMicros(m_PowerSafety.acknowledged());
+
+        NewBand();
+        writePTTEnables();
+        TRACE_EVENT(TracePower, TraceInfo, RFPowerSafe, getFrequencyMeters(), ulMicros);
+      } else {
+        rIC_705.WriteRFPower(safePower());
+      }
+    } else if (NewBand(false)) {
       if (rIC_705.WriteRFPower((getInitialPwr() <= uchMaxPower) ? getInitialPwr() : uchMaxPower)) {
         NewBand();
       }
@@ -52,6 +75,7 @@ void CTeensy::onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevic
       rIC_705.WriteRFPower(uchMaxPower);
     }
   }
+  return true;
 }
 void CTeensy::onNewPacket(const String& rsPacket, CSerialDevice& rSrcDevice) {
   String sCmd(rsPacket);
@@ -134,6 +158,20 @@ int CTeensy::getMetersMapIndex(uint32_t ulMeters) {
 // Command support
 extern CIC_705MasterDevice&
      IC705(void);
+void CTeensy::onPowerSafetyRetry(void) {
+  if (m_PowerSafety.retry()) {
+    IC705().WriteRFPower(safePower());
+  }
+  IC705().ReadRFPower();
+}
+void CTeensy::onModeRetry(void) {
+  m_ModeRetry = 0;
+  IC705().ReadModeFilter();
+}
+void CTeensy::onTXPoll(void) {
+  m_TXPoll = 0;
+  IC705().ReadTXState();
+}
 void CTeensy::pair_IC_705(void) {
   IC705().clearPairing();
 }
@@ -185,6 +223,7 @@ void CTeensy::onReboot(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevi
   reinterpret_cast<CTeensy*>(pthis)->onReboot(rsCmd, rSrcDevice);
 }
 void CTeensy::onReboot(const String& rsCmd, CSerialDevice& rSrcDevice) {
+  CEEPROMStream::commitAll();
   rSrcDevice.print("OK (rebooting)");
   for (int iter(0); iter < 10; iter++) {
     Delay(500);
@@ -216,17 +255,11 @@ void CTeensy::onSetMaxPower(const String& rsCmd, CSerialDevice& rSrcDevice) {
 
   uint8_t uchMaxRFPower(ReadRFPower());
 
-  if (uchMaxRFPower != 0
-      || uchRFPower == 0) {
-    if (HardrockAvailable(eHardrock::A)
-        && PTTEnabled(eHardrock::A)) {
-      setMaxPower(eHardrock::A, getCurrentAntenna(eHardrock::A), getFrequencyMeters(), uchMaxRFPower);
-    } else if (HardrockAvailable(eHardrock::B)
-               && PTTEnabled(eHardrock::B)) {
-      setMaxPower(eHardrock::B, getCurrentAntenna(eHardrock::B), getFrequencyMeters(), uchMaxRFPower);
-    } else {
-      setMaxPowerQRP(getFrequencyMeters(), uchMaxRFPower);
-    }
+  if (!modeKnown()) {
+    rSrcDevice.println("FAIL - the IC-705 mode isn't known yet");
+  } else if (uchMaxRFPower != 0
+             || uchRFPower == 0) {
+    setMaxPower(uchMaxRFPower);  // For the mode class in use, the others keep theirs
     rSrcDevice.println("OK");
   } else {
     rSrcDevice.println("FAIL");
@@ -308,6 +341,13 @@ void CTeensy::onHelp(const String& rsCmd, CSerialDevice& rSrcDevice) {
   rSrcDevice.println("HPPT - Display PTT enable/disable settings"), Delay(10);
   rSrcDevice.println("HPPM - Print power maps"), Delay(10);
   rSrcDevice.println("HPPS - Print device status"), Delay(10);
+  rSrcDevice.println("HPBR - Transparent CI-V bridge on this port \"HPBR1;\" off \"HPBR0;\""), Delay(10);
+  rSrcDevice.println("HPCA - Packet capture, start streamed \"HPCAS;\" buffered \"HPCAC;\" end \"HPCAE;\" dump \"HPCAD;\""), Delay(10);
+  rSrcDevice.println("       replay \"HPCAR;\" status \"HPCA;\""), Delay(10);
+  rSrcDevice.println("HPLH - Bluetooth link health \"HPLH;\" reset \"HPLHR;\""), Delay(10);
+  rSrcDevice.println("HPTW - Output target in watts for current band/antenna/amplifier \"HPTW100;\" off \"HPTW0;\""), Delay(10);
+  rSrcDevice.println("HPTL - Dump the trace log \"HPTL;\" binary \"HPTLB;\" previous boot \"HPTLP;\""), Delay(10);
+  rSrcDevice.println("HPPR - Print task profile \"HPPR;\" machine readable \"HPPRM;\" reset \"HPPRR;\""), Delay(10);
   rSrcDevice.println("HPHE - Help");
 }
 void CTeensy::onFlash(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
@@ -319,6 +359,7 @@ void CTeensy::onFlash(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevic
     Delay(0);
   }
   if (toupper(rSrcDevice.read()) == 'Y') {
+    CEEPROMStream::commitAll();
     IC705().DisconnectBoundDevice();
     if (!(HW_OCOTP_CFG5 & 0x02)) {
       asm("bkpt #251");  // run bootloader
@@ -346,35 +387,45 @@ void CTeensy::onPrintPwrMaps(void* pthis, const String& rsCmd, CSerialDevice& rS
   reinterpret_cast<CTeensy*>(pthis)->onPrintPwrMaps(rsCmd, rSrcDevice);
 }
 void CTeensy::onPrintPwrMaps(const String& rsCmd, CSerialDevice& rSrcDevice) {
-  uint32_t aulMeters[] = { 6, 10, 12, 15, 17, 20, 30, 40, 60, 80, 160 };
-
-  rSrcDevice.printf("70CM: Initial %u%% Maximum %u%%\r\n",
-                    percentPower(m_InitialPwr70CM), percentPower(getInitialPower(eHardrock::QRP, 1)));
-  rSrcDevice.printf("2M:   Initial %u%% Maximum %u%%\r\n\r\n",
-                    percentPower(m_InitialPwr2M), percentPower(getInitialPower(eHardrock::QRP, 2)));
-
-  for (size_t nIndex(0); nIndex < sizeof aulMeters / sizeof(uint32_t); nIndex++, Delay(10)) {
-    rSrcDevice.printf(
-      "Hardrock A %3luM: Initial %3u%% Maximum Ant 1/2 %3u/%3u%% QRP Initial %3u%% Max %u%%\r\n",
-      aulMeters[nIndex],
-      percentPower(getInitialPower(eHardrock::A, aulMeters[nIndex])),
-      percentPower(getMaxPower(eHardrock::A, eAntenna::Antenna1, aulMeters[nIndex], true)),
-      percentPower(getMaxPower(eHardrock::A, eAntenna::Antenna2, aulMeters[nIndex], true)),
-      percentPower(getInitialPower(eHardrock::QRP, aulMeters[nIndex])),
-      percentPower(getMaxPowerQRP(aulMeters[nIndex])));
-    rSrcDevice.flush();
-  }
-  rSrcDevice.printf("\r\n");
-  for (size_t nIndex(0); nIndex < sizeof aulMeters / sizeof(uint32_t); nIndex++, Delay(10)) {
-    rSrcDevice.printf(
-      "Hardrock B %3luM: Initial %3u%% Maximum Ant 1/2 %3u/%3u%% QRP Initial %3u%% Max %u%%\r\n",
-      aulMeters[nIndex],
-      percentPower(getInitialPower(eHardrock::B, aulMeters[nIndex])),
-      percentPower(getMaxPower(eHardrock::B, eAntenna::Antenna1, aulMeters[nIndex], true)),
-      percentPower(getMaxPower(eHardrock::B, eAntenna::Antenna2, aulMeters[nIndex], true)),
-      percentPower(getInitialPower(eHardrock::QRP, aulMeters[nIndex])),
-      percentPower(getMaxPowerQRP(aulMeters[nIndex])));
-    rSrcDevice.flush();
+  static const char* const apszAmps[] = { "Hardrock A", "Hardrock B", "QRP" };
+  uint32_t                 aulMeters[] = { 6, 10, 12, 15, 17, 20, 30, 40, 60, 80, 160 };
+  const eHardrock          eActive(activeAmp());
+
+  rSrcDevice.printf("Now %s Ant %u %luM %s: Maximum %u%%\r\n\r\n",
+                    apszAmps[eActive], unsigned(activeAntenna()) + 1, getFrequencyMeters(),
+                    (modeKnown()) ? CPowerProfile::modeClassName(modeClass()) : "mode unknown",
+                    percentPower(maxPower()));
+  rSrcDevice.printf("70CM: Initial %u%% Maximum CW/Phone/Digital %3u/%3u/%3u%%\r\n",
+                    percentPower(m_InitialPwr70CM),
+                    percentPower(getMaxPower(eHardrock::QRP, Antenna1, 1, CPowerProfile::CW)),
+                    percentPower(getMaxPower(eHardrock::QRP, Antenna1, 1, CPowerProfile::Phone)),
+                    percentPower(getMaxPower(eHardrock::QRP, Antenna1, 1, CPowerProfile::Digital)));
+  rSrcDevice.printf("2M:   Initial %u%% Maximum CW/Phone/Digital %3u/%3u/%3u%%\r\n",
+                    percentPower(m_InitialPwr2M),
+                    percentPower(getMaxPower(eHardrock::QRP, Antenna1, 2, CPowerProfile::CW)),
+                    percentPower(getMaxPower(eHardrock::QRP, Antenna1, 2, CPowerProfile::Phone)),
+                    percentPower(getMaxPower(eHardrock::QRP, Antenna1, 2, CPowerProfile::Digital)));
+
+  for (unsigned uAmp(eHardrock::A); uAmp <= eHardrock::QRP; uAmp++) {
+    const eHardrock eAmp(static_cast<eHardrock>(uAmp));
+
+    rSrcDevice.printf("\r\n%s Maximum CW/Phone/Digital\r\n", apszAmps[eAmp]);
+    for (size_t nIndex(0); nIndex < sizeof aulMeters / sizeof(uint32_t); nIndex++, Delay(10)) {
+      rSrcDevice.printf("%3luM: Initial %3u%% Ant 1 %3u/%3u/%3u%%",
+                        aulMeters[nIndex], percentPower(getInitialPower(eAmp, aulMeters[nIndex])),
+                        percentPower(getMaxPower(eAmp, Antenna1, aulMeters[nIndex], CPowerProfile::CW)),
+                        percentPower(getMaxPower(eAmp, Antenna1, aulMeters[nIndex], CPowerProfile::Phone)),
+                        percentPower(getMaxPower(eAmp, Antenna1, aulMeters[nIndex], CPowerProfile::Digital)));
+      if (eAmp != eHardrock::QRP) {
+        rSrcDevice.printf(" Ant 2 %3u/%3u/%3u%% Target Ant 1/2 %u/%u W",
+                          percentPower(getMaxPower(eAmp, Antenna2, aulMeters[nIndex], CPowerProfile::CW)),
+                          percentPower(getMaxPower(eAmp, Antenna2, aulMeters[nIndex], CPowerProfile::Phone)),
+                          percentPower(getMaxPower(eAmp, Antenna2, aulMeters[nIndex], CPowerProfile::Digital)),
+                          targetWatts(eAmp, Antenna1, aulMeters[nIndex]), targetWatts(eAmp, Antenna2, aulMeters[nIndex]));
+      }
+      rSrcDevice.printf("\r\n");
+      rSrcDevice.flush();
+    }
   }
 }
 void CTeensy::onPrintStatus(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
@@ -397,3 +448,80 @@ void CTeensy::onHardrockAvailable(const String& rsCmd, CSerialDevice& rSrcDevice
     rSrcDevice.println("OK");
   }
 }
+void CTeensy::onProfile(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
+  String sCmd(rsCmd);
+
+  sCmd.toUpperCase();
+  if (sCmd.startsWith("HPPRR")) {
+    CProfiler::reset();
+    rSrcDevice.println("OK");
+  } else {
+    CProfiler::print(rSrcDevice, sCmd.startsWith("HPPRM"));
+  }
+}
+void CTeensy::onLinkHealth(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
+  extern void printLinkHealth(CSerialDevice & rPrintDevice, bool fReset);
+  String sCmd(rsCmd);
+
+  sCmd.toUpperCase();
+  printLinkHealth(rSrcDevice, sCmd.startsWith("HPLHR"));
+}
+void CTeensy::onTargetWatts(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
+  reinterpret_cast<CTeensy*>(pthis)->onTargetWatts(rsCmd, rSrcDevice);
+}
+void CTeensy::onTargetWatts(const String& rsCmd, CSerialDevice& rSrcDevice) {
+  refreshPowerProfile();
+  if (rsCmd.length() > 5
+      && isdigit(rsCmd.charAt(4))) {
+    const long lWatts(rsCmd.substring(4).toInt());
+
+    if (lWatts < 0 || lWatts > UINT16_MAX
+        || !m_PowerProfile.setTargetWatts(m_eActiveAmp, activeAntenna(), m_iBand, uint16_t(lWatts))) {
+      rSrcDevice.println("FAIL");  // QRP, or a band the Hardrocks don't cover
+      return;
+    }
+  }
+  rSrcDevice.printf("%u W\r\n", targetWatts());
+}
+void CTeensy::onTraceLog(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
+  String sCmd(rsCmd);
+
+  sCmd.toUpperCase();
+  if (sCmd.startsWith("HPTLP")) {
+    CTraceLog::printPreviousBoot(rSrcDevice);
+  } else {
+    CTraceLog::print(rSrcDevice, sCmd.startsWith("HPTLB"));
+  }
+}
+void CTeensy::onCapture(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
+  String sCmd(rsCmd);
+
+  sCmd.toUpperCase();
+  if (sCmd.startsWith("HPCAS")) {
+    CCapture::start(&rSrcDevice);
+  } else if (sCmd.startsWith("HPCAC")) {
+    CCapture::start(0);
+    rSrcDevice.println("OK");
+  } else if (sCmd.startsWith("HPCAE")) {
+    CCapture::stop();
+  } else if (sCmd.startsWith("HPCAD")) {
+    CCapture::dump(rSrcDevice);
+  } else if (sCmd.startsWith("HPCAR")) {
+    CCapture::replay(rSrcDevice);
+  } else {
+    CCapture::status(rSrcDevice);
+  }
+}
+void CTeensy::onBridge(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice) {
+  if (rsCmd.length() > 4
+      && rsCmd.charAt(4) == '1') {
+    if (IC705().bridge().attach(rSrcDevice)) {
+      rSrcDevice.println("OK");
+    } else {
+      rSrcDevice.println("FAIL");
+    }
+  } else {
+    IC705().bridge().detach(rSrcDevice);
+    rSrcDevice.println("OK");
+  }
+}
@@ -9,6 +9,8 @@
 
 #include "Hardplace705Plus.h"
 #include "EEPromStream.h"
+#include "PowerProfile.h"
+#include "PowerSafety.h"
 #include "BoundDevice.h"
 #include "HardplaceUSBHost.h"
 #include "CommandProcessor.h"
@@ -54,7 +56,8 @@ Interface ITuner {
 
 #undef Interface
 
-#define VER_TEENSY 1
+#define VER_TEENSY 2       // 1 was positional
+#define VER_USBBINDINGS 2  // 1 was positional
 
 class CTeensy : public IBluetooth, public ITuner, private CEEPROMStream, public CBoundDevice {
 public:
@@ -68,13 +71,22 @@ public:
     USBHost
   };
 
+  enum {
+    ModeRetryMillis = 250,  // The mode read, until the radio answers it
+    TXPollMillis = 200,     // The TX state, while power control has a target to trim to, CPowerControl::PollMillis
+    TXStaleMillis = 3 * TXPollMillis
+  };
+
 public:
   CTeensy()
     : CEEPROMStream(TeensyType, VER_TEENSY),
       CBoundDevice(static_cast<CBoundDevice::eDeviceClass>(eBoundDeviceTypes::Teensy)),
       m_uDebounceInterval(5), m_ulFrequencyMeters(0), m_ullFrequency(0), m_InitialPwr2M(255),
       m_InitialPwr70CM(255), m_fDebugEnable(false), m_fTunerEnabled(false), m_isTuning(false),
-      m_fBandChanged(false), m_CmdHandler(18) {
+      m_fBandChanged(false), m_CmdHandler(24), m_uBindingsRevision(0), m_PowerProfile(PowerProfileType), m_eActiveAmp(eHardrock::QRP),
+      m_iBand(-1), m_eModeClass(CPowerProfile::Phone), m_fModeKnown(false), m_fTransmitting(false),
+      m_uchMaxPower(CPowerProfile::Unlimited),
+      m_uchProfileInputs(0), m_fProfileStale(true), m_uchRFLevel(0) {
     // Don't forget to specify the number of commands in the constructor
     // Command specifiers must be unique for the first 4 characters
     uint uCmd(0);
@@ -96,14 +108,53 @@ public:
     m_CmdHandler[uCmd++]("HPPS", onPrintStatus);        // Print device status
     m_CmdHandler[uCmd++]("HPBL", onFlash);              // Activate bootloader (Same as pushing button)
     m_CmdHandler[uCmd++]("HPHA", onHardrockAvailable);  // Report Hardrock availability
+    m_CmdHandler[uCmd++]("HPPR", onProfile);            // Print task profile "HPPR;" machine readable "HPPRM;" reset "HPPRR;"
+    m_CmdHandler[uCmd++]("HPTL", onTraceLog);           // Dump the trace log "HPTL;" binary "HPTLB;" previous boot "HPTLP;"
+    m_CmdHandler[uCmd++]("HPBR", onBridge);             // Transparent CI-V bridge on this port "HPBR1;" off "HPBR0;"
+    m_CmdHandler[uCmd++]("HPCA", onCapture);            // Packet capture, start "HPCAS;" end "HPCAE;" dump "HPCAD;" replay "HPCAR;"
+    m_CmdHandler[uCmd++]("HPLH", onLinkHealth);         // Bluetooth link health "HPLH;" reset "HPLHR;"
+    m_CmdHandler[uCmd++]("HPTW", onTargetWatts);        // Output target for current band/antenna/amplifier "HPTW100;" off "HPTW0;"
 
     Serialize(haveRecord());
+    if (!m_USBBindings.haveRecord()) {  // Bindings moved out of the Teensy record
+      m_USBBindings.migrate(m_aLegacyUSBMap, sizeof m_aLegacyUSBMap / sizeof(SHardrockUSBMap));
+    }
+    if (!m_PowerProfile.haveRecord()) {  // Limits moved out of the Teensy record
+      seedPowerProfile();
+    }
   }
 
 private:
   CTeensy(const CTeensy&);
   CTeensy& operator=(const CTeensy&);
 
+  virtual void Commit(void) {  // setDirty() coalesced
+    Serialize();
+  }
+  void loadVersion1(void) {  // Positional
+    rewind();
+    get(m_fDebugEnable);
+    get(m_fTuningEnabled[0][0]);
+    get(m_fTuningEnabled[0][1]);
+    get(m_fTuningEnabled[1][0]);
+    get(m_fTuningEnabled[1][1]);
+    for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::A] / sizeof(uint8_t); stIndex++) {
+      get(m_aInitialPwr[eHardrock::A][stIndex]);
+    }
+    for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::B] / sizeof(uint8_t); stIndex++) {
+      get(m_aInitialPwr[eHardrock::B][stIndex]);
+    }
+    for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::QRP] / sizeof(uint8_t); stIndex++) {
+      get(m_aInitialPwr[eHardrock::QRP][stIndex]);
+    }
+    get(m_InitialPwr2M);
+    get(m_InitialPwr70CM);
+    m_RFPowerMap.Serialize(*this, true);
+    for (size_t iter(0); iter < sizeof m_aLegacyUSBMap / sizeof(SHardrockUSBMap); iter++) {
+      m_aLegacyUSBMap[iter].Serialize(*this, true);  // Moved to m_USBBindings
+    }
+  }
+
 public:
   enum eTeensy41Pins {
     HR_TX_A,  // 0
@@ -183,7 +234,10 @@ public:
     TeensyType = CEEPROMStream::BeginAvailable,
     IC_705Type,
     HardrockAType,
-    HardrockBType
+    HardrockBType,
+    USBBindingsType,
+    BaudrateCacheType,
+    PowerProfileType
   };
 
   enum eBinding {
@@ -266,6 +320,22 @@ public:
 
   void Task(void) {
     update();
+    if (m_fProfileStale
+        || profileInputs() != m_uchProfileInputs) {  // A Hardrock came or went, a band's PTT switch moved
+      refreshPowerProfile();
+    }
+    if (m_PowerSafety.retryDue()) {
+      onPowerSafetyRetry();
+    }
+    if (!m_fModeKnown
+        && getFrequencyMeters()
+        && m_ModeRetry >= ModeRetryMillis) {  // Connected, the read was refused or its response lost
+      onModeRetry();
+    }
+    if (m_TXPoll >= TXPollMillis
+        && wantsTXState()) {
+      onTXPoll();
+    }
     CHardplaceUSBHost::Task();
     m_Watchdog.reset();
   }
@@ -359,10 +429,8 @@ public:
     return m_Tune.currentDuration();
   }
   virtual void TunerEnablePTT(bool fEnable) {
-    if (fEnable
-        && getMetersMapIndex(getFrequencyMeters()) >= 0) {
-      digitalWrite(PTT_A_Enable, PTTEnabled(eHardrock::A));
-      digitalWrite(PTT_B_Enable, PTTEnabled(eHardrock::B));
+    if (fEnable) {
+      writePTTEnables();
     } else {
       digitalWrite(PTT_A_Enable, LOW);
       digitalWrite(PTT_B_Enable, LOW);
@@ -410,7 +478,7 @@ public:
   void DebugEnable(bool fEnable = true) {
     m_fDebugEnable = fEnable;
     CTraceDevice().Enable(fEnable);
-    Serialize();
+    setDirty();
   }
 
 public:
@@ -421,52 +489,26 @@ public:
 public:
   void reboot(void) const;
   void Serialize(bool bLoad = false) {
-    rewind();
-
-    if (bLoad) {
-      get(m_fDebugEnable);
-      get(m_fTuningEnabled[0][0]);
-      get(m_fTuningEnabled[0][1]);
-      get(m_fTuningEnabled[1][0]);
-      get(m_fTuningEnabled[1][1]);
-      for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::A] / sizeof(uint8_t); stIndex++) {
-        get(m_aInitialPwr[eHardrock::A][stIndex]);
-      }
-      for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::B] / sizeof(uint8_t); stIndex++) {
-        get(m_aInitialPwr[eHardrock::B][stIndex]);
-      }
-      for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::QRP] / sizeof(uint8_t); stIndex++) {
-        get(m_aInitialPwr[eHardrock::QRP][stIndex]);
-      }
-      get(m_InitialPwr2M);
-      get(m_InitialPwr70CM);
-    } else {
-      put(m_fDebugEnable);
-      put(m_fTuningEnabled[0][0]);
-      put(m_fTuningEnabled[0][1]);
-      put(m_fTuningEnabled[1][0]);
-      put(m_fTuningEnabled[1][1]);
-      for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::A] / sizeof(uint8_t); stIndex++) {
-        put(m_aInitialPwr[eHardrock::A][stIndex]);
-      }
-      for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::B] / sizeof(uint8_t); stIndex++) {
-        put(m_aInitialPwr[eHardrock::B][stIndex]);
-      }
-      for (size_t stIndex(0); stIndex < sizeof m_aInitialPwr[eHardrock::QRP] / sizeof(uint8_t); stIndex++) {
-        put(m_aInitialPwr[eHardrock::QRP][stIndex]);
-      }
-      put(m_InitialPwr2M);
-      put(m_InitialPwr70CM);
-    }
-
-    m_RFPowerMap.Serialize(*this, bLoad);
-
-    for (size_t iter(0); iter < sizeof m_USBMap / sizeof(SHardrockUSBMap); iter++) {
-      m_USBMap[iter].Serialize(*this, bLoad);
-    }
+    const SField aFields[] = {
+      field(1, m_fDebugEnable),
+      field(2, m_fTuningEnabled),
+      field(3, m_aInitialPwr[eHardrock::A]),
+      field(4, m_aInitialPwr[eHardrock::B]),
+      field(5, m_aInitialPwr[eHardrock::QRP]),
+      field(6, m_InitialPwr2M),
+      field(7, m_InitialPwr70CM),
+      field(8, m_RFPowerMap.m_uchQRPPwr),  // Limits before m_PowerProfile, kept for older firmware
+      field(9, m_RFPowerMap.m_HRPwrMap[eHardrock::A].m_uchMaxPwrAnt),
+      field(10, m_RFPowerMap.m_HRPwrMap[eHardrock::B].m_uchMaxPwrAnt)
+    };
 
     if (!bLoad) {
-      flush();
+      putFields(aFields, sizeof aFields / sizeof aFields[0]);
+    } else if (Version() < VER_TEENSY) {
+      loadVersion1();
+      setDirty();
+    } else {
+      getFields(aFields, sizeof aFields / sizeof aFields[0]);
     }
   }
 
@@ -480,23 +522,30 @@ public:
   void onConnect(void) {
     m_ulFrequencyMeters = 0;
     m_ullFrequency = 0;
+    m_fModeKnown = m_fTransmitting = false;
+    m_fProfileStale = true;
     digitalWrite(PTT_PWR, HIGH);
   }
   void onDisconnect(void) {
     m_ulFrequencyMeters = 0;
     m_ullFrequency = 0;
+    m_fModeKnown = m_fTransmitting = false;  // The next radio may be in another mode
+    m_fProfileStale = true;
+    m_PowerSafety.cancel();
     digitalWrite(PTT_PWR, LOW);
   }
   void setCurrentAntenna(eHardrock Hardrock, eAntenna Antenna) {
     m_aCurrentAntenna[Hardrock] = Antenna;
+    m_fProfileStale = true;
   }
   eAntenna getCurrentAntenna(eHardrock Hardrock) {
     return m_aCurrentAntenna[Hardrock];
   }
   void setKeyingMode(eHardrock Hardrock, bool fEnabled) {
     m_aKeyingMode[Hardrock] = fEnabled;
+    m_fProfileStale = true;
     if (Hardrock == eHardrock::A || Hardrock == eHardrock::B) {
-      digitalWrite((Hardrock == eHardrock::A) ? PTT_A_Enable : PTT_B_Enable, PTTEnabled(Hardrock));
+      digitalWrite((Hardrock == eHardrock::A) ? PTT_A_Enable : PTT_B_Enable, !m_PowerSafety.pending() && PTTEnabled(Hardrock));
     }
   }
   bool getKeyingMode(eHardrock Hardrock) {
@@ -504,10 +553,29 @@ public:
   }
 private:
   virtual void onNewPacket(const uint8_t* puPacket, size_t stPacket, CSerialDevice& rSrcDevice);
+  virtual bool onNewFrame(const CICOMResp& rFrame, CSerialDevice& rSrcDevice);
   virtual void onNewPacket(const String& rsPacket, CSerialDevice& rSrcDevice);
-  void         setFrequencyMeters(uint32_t ulFrequencyMeters) {
-            m_fBandChanged = m_ulFrequencyMeters != ulFrequencyMeters;
-            m_ulFrequencyMeters = ulFrequencyMeters;
+  virtual void onTextFrame(const char* pchFrame, size_t stFrame, CSerialDevice& rSrcDevice) {
+    if (stFrame > 2
+        && toupper(pchFrame[0]) == 'H'
+        && toupper(pchFrame[1]) == 'P') {  // Only commands for us are worth a String
+      CBoundDevice::onTextFrame(pchFrame, stFrame, rSrcDevice);
+    }
+  }
+  void setFrequencyMeters(uint32_t ulFrequencyMeters) {
+    m_fBandChanged = m_ulFrequencyMeters != ulFrequencyMeters;
+    m_ulFrequencyMeters = ulFrequencyMeters;
+    if (m_fBandChanged) {
+      m_fProfileStale = true;
+    }
+  }
+  void setModeClass(CPowerProfile::eModeClass eModeClass) {
+    if (!m_fModeKnown
+        || m_eModeClass != eModeClass) {
+      m_eModeClass = eModeClass;
+      m_fModeKnown = true;
+      m_fProfileStale = true;
+    }
   }
   void setFrequencyHz(uint64_t ullFrequency) {
     m_ullFrequency = ullFrequency;
@@ -523,7 +591,7 @@ private:
   int        getMetersMapIndex(void) const;
   static int getMetersMapIndex(uint32_t ulMeters);
 
-  struct SRFPowerMap {
+  struct SRFPowerMap {  // The limits before m_PowerProfile, read to seed it
     struct SHardrockPowerMap {
       void Serialize(CEEPROMStream& rSrc, bool bLoad) {
         for (size_t stIndex(0);
@@ -558,50 +626,19 @@ private:
       m_HRPwrMap[1].Serialize(rSrc, bLoad);
     }
 
-    uint8_t getMaxPower(eHardrock eWhichHardrock, eAntenna eWhichAntenna, uint32_t ulMeters) const {
-      int nIndex(getMetersMapIndex(ulMeters));
-
-      if (nIndex >= 0) {
-        return (eWhichHardrock != eHardrock::QRP)
-                 ? m_HRPwrMap[eWhichHardrock].m_uchMaxPwrAnt[eWhichAntenna][nIndex]
-                 : getMaxPowerQRP(ulMeters);
-      }
-      return 255;
-    }
-    void setMaxPower(eHardrock eWhichHardrock, eAntenna eWhichAntenna, uint32_t ulMeters, uint8_t uchMaxPower) {
-      int nIndex(getMetersMapIndex(ulMeters));
-
-      if (nIndex >= 0) {
-        if (eWhichHardrock != eHardrock::QRP) {
-          m_HRPwrMap[eWhichHardrock].m_uchMaxPwrAnt[eWhichAntenna][nIndex] = uchMaxPower;
-        } else {
-          setMaxPowerQRP(ulMeters, uchMaxPower);
-        }
-      }
-    }
-    uint8_t getMaxPowerQRP(uint32_t ulMeters) const {
-      int nIndex(getMetersMapIndex(ulMeters));
-
-      if (nIndex >= 0) {
-        return m_uchQRPPwr[nIndex];
-      }
-      return 255;
-    }
-    void setMaxPowerQRP(uint32_t ulMeters, uint8_t uchMaxPower) {
-      int nIndex(getMetersMapIndex(ulMeters));
-
-      if (nIndex >= 0) {
-        m_uchQRPPwr[nIndex] = uchMaxPower;
-      }
-    }
-
     uint8_t           m_uchQRPPwr[11] = { 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255 };
     SHardrockPowerMap m_HRPwrMap[2];
   };
 
   struct SHardrockUSBMap {
+    enum {
+      MaxSerialNumber = 8,  // Version 1 records, and the fingerprint
+      MaxModelName = 14,
+      Fields = 6
+    };
+
     SHardrockUSBMap()
-      : m_eBinding(Unbound), m_idVendor(0), m_idProduct(0), m_ulBaudrate(0) {}
+      : m_eBinding(Unbound), m_idVendor(0), m_idProduct(0), m_ulBaudrate(0), m_uFingerprint(0) {}
 
     eBinding binding(void) const {
       return m_eBinding;  // Serial Port
@@ -624,11 +661,15 @@ private:
     void setBaudrate(uint32_t ulBaudrate) {
       m_ulBaudrate = ulBaudrate;
     }
+    uint32_t fingerprint(void) const {
+      return m_uFingerprint;
+    }
     void clear(void) {
       m_eBinding = Unbound;
       m_idVendor = 0;
       m_idProduct = 0;
       m_ulBaudrate = 0;
+      m_uFingerprint = 0;
     }
 
     void updateBinding(eBinding binding) {
@@ -640,28 +681,41 @@ private:
       m_idProduct = idProduct;
       m_sSerialNumber = sSerialNumber;
       m_sModelName = sModelName;
+      m_uFingerprint = USBFingerprint(USBIdentity(idVendor, idProduct, sSerialNumber.c_str()), sModelName.c_str());
     }
     void Serialize(CEEPROMStream& rSrc, bool bLoad) {
-      const size_t uMaxSerialNumber(8);
-      const size_t uMaxModelName(14);
-
       if (bLoad) {
         rSrc.get(m_eBinding);
         rSrc.get(m_idVendor);
         rSrc.get(m_idProduct);
         rSrc.get(m_ulBaudrate);
-        rSrc.get(m_sSerialNumber, uMaxSerialNumber);
-        rSrc.get(m_sModelName, uMaxModelName);
+        rSrc.get(m_sSerialNumber, MaxSerialNumber);
+        rSrc.get(m_sModelName, MaxModelName);
+        loaded();
       } else {
         rSrc.put(m_eBinding);
         rSrc.put(m_idVendor);
         rSrc.put(m_idProduct);
         rSrc.put(m_ulBaudrate);
-        rSrc.put(m_sSerialNumber, uMaxSerialNumber);
-        rSrc.put(m_sModelName, uMaxModelName);
+        rSrc.put(m_sSerialNumber, MaxSerialNumber);
+        rSrc.put(m_sModelName, MaxModelName);
       }
     }
 
+    void fields(CEEPROMStream::SField* pFields, size_t nEntry) {  // Ids 8 * nEntry + 1 to 6
+      const uint8_t uchBase(8 * nEntry);
+
+      pFields[0] = CEEPROMStream::field(uchBase + 1, m_eBinding);
+      pFields[1] = CEEPROMStream::field(uchBase + 2, m_idVendor);
+      pFields[2] = CEEPROMStream::field(uchBase + 3, m_idProduct);
+      pFields[3] = CEEPROMStream::field(uchBase + 4, m_ulBaudrate);
+      pFields[4] = CEEPROMStream::field(uchBase + 5, m_sSerialNumber);
+      pFields[5] = CEEPROMStream::field(uchBase + 6, m_sModelName);
+    }
+    void loaded(void) {
+      m_uFingerprint = USBFingerprint(USBIdentity(m_idVendor, m_idProduct, m_sSerialNumber.c_str()), m_sModelName.c_str());
+    }
+
   private:
     eBinding m_eBinding;       // Serial Port
     uint16_t m_idVendor;       // idVendor()
@@ -669,78 +723,207 @@ private:
     String   m_sSerialNumber;  // serialNumber()
     String   m_sModelName;     // Hardrock Model
     uint32_t m_ulBaudrate;     // Baudrate
+    uint32_t m_uFingerprint;   // Not stored
   };
 
-public:
-  void bind(eBinding eBinding, uint16_t idProduct, uint16_t idVendor, const String& sSerialNumber, const String& sModelName) {
-    bool fFound(false);
-    for (size_t nIndex(0); (!fFound && nIndex < sizeof m_USBMap / sizeof(SHardrockUSBMap)); nIndex++) {
-      fFound = (m_USBMap[nIndex].vendor() == idVendor
-                && m_USBMap[nIndex].product() == idProduct
-                && m_USBMap[nIndex].serialNumber() == sSerialNumber
-                && m_USBMap[nIndex].modelName() == sModelName);
-      if (fFound && m_USBMap[nIndex].binding() != eBinding) {
-        m_USBMap[nIndex].updateBinding(eBinding);
-        Serialize();
+  class CUSBBindingMap : public CEEPROMStream {  // USB_BINDINGS bindings in their own record, hashed by fingerprint
+    static_assert(USB_BINDINGS <= 31, "Field ids are 8 per binding");
+
+  public:
+    enum {
+      Bindings = USB_BINDINGS,
+      IndexSlots = 2 * USB_BINDINGS + 1
+    };
+
+  public:
+    CUSBBindingMap()
+      : CEEPROMStream(USBBindingsType, VER_USBBINDINGS) {
+      if (haveRecord()) {
+        Serialize(true);
+      }
+      reindex();
+    }
+
+  private:
+    CUSBBindingMap(const CUSBBindingMap&);
+    CUSBBindingMap& operator=(const CUSBBindingMap&);
+
+    virtual void Commit(void) {
+      Serialize();
+    }
+
+  public:
+    void Serialize(bool bLoad = false) {
+      SField aFields[Bindings * SHardrockUSBMap::Fields];
+
+      for (size_t nIndex(0); nIndex < Bindings; nIndex++) {
+        m_aMap[nIndex].fields(&aFields[nIndex * SHardrockUSBMap::Fields], nIndex);
+      }
+      if (!bLoad) {
+        putFields(aFields, sizeof aFields / sizeof aFields[0]);
+      } else if (Version() < VER_USBBINDINGS) {
+        rewind();
+        for (size_t nIndex(0); nIndex < Bindings; nIndex++) {
+          m_aMap[nIndex].Serialize(*this, true);  // Positional
+        }
+        setDirty();
+      } else {
+        getFields(aFields, sizeof aFields / sizeof aFields[0]);
+        for (size_t nIndex(0); nIndex < Bindings; nIndex++) {
+          m_aMap[nIndex].loaded();
+        }
+      }
+    }
+    void migrate(SHardrockUSBMap* pLegacy, size_t cLegacy) {  // Bindings from the Teensy record, version 1
+      for (size_t nIndex(0); nIndex < cLegacy && nIndex < Bindings; nIndex++) {
+        if (pLegacy[nIndex].binding() != Unbound) {
+          m_aMap[nIndex].bind(pLegacy[nIndex].binding(), pLegacy[nIndex].product(), pLegacy[nIndex].vendor(),
+                              pLegacy[nIndex].serialNumber(), pLegacy[nIndex].modelName());
+          m_aMap[nIndex].setBaudrate(pLegacy[nIndex].getBaudrate());
+        }
+        pLegacy[nIndex].clear();
       }
+      reindex();
+      setDirty();
     }
-    if (!fFound) {
-      for (size_t nIndex(0); nIndex < sizeof m_USBMap / sizeof(SHardrockUSBMap); nIndex++) {
-        if (m_USBMap[nIndex].binding() == eBinding::Unbound) {
-          m_USBMap[nIndex].bind(eBinding, idProduct, idVendor, sSerialNumber, sModelName);
-          Serialize();
+
+    SHardrockUSBMap* find(uint32_t uFingerprint) {
+      for (size_t nSlot(uFingerprint % IndexSlots), nProbe(0); nProbe < IndexSlots; nSlot = (nSlot + 1) % IndexSlots, nProbe++) {
+        if (!m_auchIndex[nSlot]) {
           break;
         }
+        if (m_aMap[m_auchIndex[nSlot] - 1].fingerprint() == uFingerprint) {
+          return &m_aMap[m_auchIndex[nSlot] - 1];
+        }
       }
+      return 0;
     }
-  }
-  eBinding getBinding(
-    uint16_t idProduct, uint16_t idVendor, const String& sSerialNumber, const String& sModelName) {
-    eBinding Binding(eBinding::Unbound);
-
-    for (size_t nIndex(0); nIndex < sizeof m_USBMap / sizeof(SHardrockUSBMap); nIndex++) {
-      if (m_USBMap[nIndex].vendor() == idVendor
-          && m_USBMap[nIndex].product() == idProduct
-          && m_USBMap[nIndex].serialNumber() == sSerialNumber
-          && m_USBMap[nIndex].modelName() == sModelName) {
-        Binding = m_USBMap[nIndex].binding();
-        break;
+    SHardrockUSBMap* find(uint16_t idProduct, uint16_t idVendor, const String& sSerialNumber, const String& sModelName) {
+      SHardrockUSBMap* pEntry(find(USBFingerprint(USBIdentity(idVendor, idProduct, sSerialNumber.c_str()), sModelName.c_str())));
+
+      return (pEntry  // A fingerprint collision is not a match
+              && pEntry->vendor() == idVendor
+              && pEntry->product() == idProduct
+              && pEntry->serialNumber() == sSerialNumber.substring(0, SHardrockUSBMap::MaxSerialNumber)
+              && pEntry->modelName() == sModelName.substring(0, SHardrockUSBMap::MaxModelName))
+               ? pEntry
+               : 0;
+    }
+    SHardrockUSBMap* add(void) {  // An unbound entry, 0 if the map is full
+      for (size_t nIndex(0); nIndex < Bindings; nIndex++) {
+        if (m_aMap[nIndex].binding() == Unbound) {
+          return &m_aMap[nIndex];
+        }
       }
+      return 0;
+    }
+    SHardrockUSBMap& operator[](size_t nIndex) {
+      return m_aMap[nIndex];
     }
-    return Binding;
+    void reindex(void) {
+      memset(m_auchIndex, 0, sizeof m_auchIndex);
+      for (size_t nIndex(0); nIndex < Bindings; nIndex++) {
+        if (m_aMap[nIndex].binding() != Unbound) {
+          size_t nSlot(m_aMap[nIndex].fingerprint() % IndexSlots);
+
+          while (m_auchIndex[nSlot]) {
+            nSlot = (nSlot + 1) % IndexSlots;
+          }
+          m_auchIndex[nSlot] = nIndex + 1;
+        }
+      }
+    }
+
+  private:
+    SHardrockUSBMap m_aMap[Bindings];
+    uint8_t         m_auchIndex[IndexSlots];  // Entry + 1, 0 is empty
+  };
+
+public:
+  // USB identity fingerprint, FNV-1a of the fields as they are stored (serial number and model name truncated to
+  // their record size). The identity part is computed once when a port enumerates, the model is hashed onto it.
+  static uint32_t USBIdentity(uint16_t idVendor, uint16_t idProduct, const char* pszSerialNumber) {
+    uint32_t uHash(2166136261UL);
+
+    for (auto uchByte : { uint8_t(idVendor), uint8_t(idVendor >> 8), uint8_t(idProduct), uint8_t(idProduct >> 8) }) {
+      uHash = (uHash ^ uchByte) * 16777619UL;
+    }
+    for (size_t nIndex(0); nIndex < SHardrockUSBMap::MaxSerialNumber && pszSerialNumber && pszSerialNumber[nIndex]; nIndex++) {
+      uHash = (uHash ^ uint8_t(pszSerialNumber[nIndex])) * 16777619UL;
+    }
+    return (uHash ^ 0xFF) * 16777619UL;
   }
-  void setBaudrate(
-    uint16_t idProduct, uint16_t idVendor, const String& sSerialNumber, uint32_t uBaudrate) {
+  static uint32_t USBFingerprint(uint32_t uIdentity, const char* pszModelName) {
+    uint32_t uHash(uIdentity);
 
-    for (size_t nIndex(0); nIndex < sizeof m_USBMap / sizeof(SHardrockUSBMap); nIndex++) {
-      if (m_USBMap[nIndex].vendor() == idVendor
-          && m_USBMap[nIndex].product() == idProduct
-          && m_USBMap[nIndex].serialNumber() == sSerialNumber) {
-        m_USBMap[nIndex].setBaudrate(uBaudrate);
-        Serialize();
-        break;
-      }
+    for (size_t nIndex(0); nIndex < SHardrockUSBMap::MaxModelName && pszModelName && pszModelName[nIndex]; nIndex++) {
+      uHash = (uHash ^ uint8_t(pszModelName[nIndex])) * 16777619UL;
     }
+    return (uHash) ? uHash : 1;  // 0 is an empty entry
   }
-  uint32_t getBaudrate(
-    uint16_t idProduct, uint16_t idVendor, const String& sSerialNumber, uint32_t ulDefaultBaudrate = 19200) const {
-    uint32_t ulBaudrate(ulDefaultBaudrate);
 
-    for (size_t nIndex(0); nIndex < sizeof m_USBMap / sizeof(SHardrockUSBMap); nIndex++) {
-      if (m_USBMap[nIndex].vendor() == idVendor
-          && m_USBMap[nIndex].product() == idProduct
-          && m_USBMap[nIndex].serialNumber() == sSerialNumber) {
-        ulBaudrate = m_USBMap[nIndex].getBaudrate();
-        break;
+  void bind(eBinding eBinding, uint16_t idProduct, uint16_t idVendor, const String& sSerialNumber, const String& sModelName) {
+    SHardrockUSBMap* pEntry(m_USBBindings.find(idProduct, idVendor, sSerialNumber, sModelName));
+
+    if (pEntry) {
+      if (pEntry->binding() != eBinding) {
+        pEntry->updateBinding(eBinding);
+        m_USBBindings.setDirty();
+        m_uBindingsRevision++;
       }
+    } else if ((pEntry = m_USBBindings.add()) != 0) {
+      pEntry->bind(eBinding, idProduct, idVendor, sSerialNumber, sModelName);
+      m_USBBindings.reindex();
+      m_USBBindings.setDirty();
+      m_uBindingsRevision++;
+    }
+  }
+  uint32_t bindingsRevision(void) const {  // Changes as bind() or eraseBindings() changes the map
+    return m_uBindingsRevision;
+  }
+  eBinding getBinding(
+    uint16_t idProduct, uint16_t idVendor, const String& sSerialNumber, const String& sModelName) {
+    SHardrockUSBMap* pEntry(m_USBBindings.find(idProduct, idVendor, sSerialNumber, sModelName));
+
+    return (pEntry) ? pEntry->binding() : eBinding::Unbound;
+  }
+  eBinding getBinding(uint32_t uFingerprint, uint16_t idProduct, uint16_t idVendor) {  // No Strings, one index probe
+    SHardrockUSBMap* pEntry(m_USBBindings.find(uFingerprint));
+
+    return (pEntry
+            && pEntry->vendor() == idVendor
+            && pEntry->product() == idProduct)
+             ? pEntry->binding()
+             : eBinding::Unbound;
+  }
+  void setBaudrate(uint32_t uFingerprint, uint16_t idProduct, uint16_t idVendor, uint32_t uBaudrate) {  // As getBinding()
+    SHardrockUSBMap* pEntry(m_USBBindings.find(uFingerprint));
+
+    if (pEntry
+        && pEntry->vendor() == idVendor
+        && pEntry->product() == idProduct
+        && pEntry->getBaudrate() != uBaudrate) {
+      pEntry->setBaudrate(uBaudrate);
+      m_USBBindings.setDirty();
     }
-    return (ulBaudrate) ? ulBaudrate : ulDefaultBaudrate;
+  }
+  uint32_t getBaudrate(uint32_t uFingerprint, uint16_t idProduct, uint16_t idVendor, uint32_t ulDefaultBaudrate = 19200) {
+    SHardrockUSBMap* pEntry(m_USBBindings.find(uFingerprint));
+
+    return (pEntry
+            && pEntry->vendor() == idVendor
+            && pEntry->product() == idProduct
+            && pEntry->getBaudrate())
+             ? pEntry->getBaudrate()
+             : ulDefaultBaudrate;
   }
   void eraseBindings(void) {
-    for (size_t nIndex(0); nIndex < sizeof m_USBMap / sizeof(SHardrockUSBMap); nIndex++) {
-      m_USBMap[nIndex].clear();
+    for (size_t nIndex(0); nIndex < CUSBBindingMap::Bindings; nIndex++) {
+      m_USBBindings[nIndex].clear();
     }
-    Serialize();
+    m_USBBindings.reindex();
+    m_USBBindings.setDirty();
+    m_uBindingsRevision++;
   }
   bool PTTEnabled(eHardrock eWhichHardrock) const {
     int nIndex(getMetersMapIndex());
@@ -760,23 +943,77 @@ public:
     }
     return false;
   }
-  uint8_t getMaxPower(eHardrock eWhichHardrock, eAntenna eWhichAntenna, uint32_t ulMeters, bool fAbsolute = false) const {
-    return ((fAbsolute || PTTEnabled(eWhichHardrock)) && eWhichHardrock != eHardrock::QRP)
-             ? m_RFPowerMap.getMaxPower(eWhichHardrock, eWhichAntenna, ulMeters)
-             : getMaxPowerQRP(ulMeters);
+  uint8_t getMaxPower(eHardrock eWhichHardrock, eAntenna eWhichAntenna, uint32_t ulMeters,
+                      CPowerProfile::eModeClass eModeClass) const {
+    return m_PowerProfile.get(eWhichHardrock, (eWhichHardrock != eHardrock::QRP) ? eWhichAntenna : Antenna1,
+                              CPowerProfile::bandIndex(ulMeters), eModeClass);
   }
-  void setMaxPower(eHardrock eWhichHardrock, eAntenna eWhichAntenna, uint32_t ulMeters, uint8_t uchMaxPower) {
-    (PTTEnabled(eWhichHardrock) && eWhichHardrock != eHardrock::QRP)
-      ? m_RFPowerMap.setMaxPower(eWhichHardrock, eWhichAntenna, ulMeters, uchMaxPower)
-      : setMaxPowerQRP(ulMeters, uchMaxPower);
-    Serialize();
+  void setMaxPower(uint8_t uchMaxPower) {  // Where we are, the active amplifier and antenna, the band and mode class
+    refreshPowerProfile();
+    m_PowerProfile.set(m_eActiveAmp, activeAntenna(), m_iBand, m_eModeClass, uchMaxPower);
+    m_fProfileStale = true;
   }
-  uint8_t getMaxPowerQRP(uint32_t ulMeters) const {
-    return m_RFPowerMap.getMaxPowerQRP(ulMeters);
+  uint8_t maxPower(void) {  // The clamp, one byte once the indices are current
+    if (m_fProfileStale) {
+      refreshPowerProfile();
+    }
+    return m_uchMaxPower;
   }
-  void setMaxPowerQRP(uint32_t ulMeters, uint8_t uchMaxPower) {
-    m_RFPowerMap.setMaxPowerQRP(ulMeters, uchMaxPower);
-    Serialize();
+  eHardrock activeAmp(void) {
+    if (m_fProfileStale) {
+      refreshPowerProfile();
+    }
+    return m_eActiveAmp;
+  }
+  CPowerProfile::eModeClass modeClass(void) const {
+    return m_eModeClass;
+  }
+  bool modeKnown(void) const {  // The radio has answered, until then the limit is the lowest of the mode classes
+    return m_fModeKnown;
+  }
+  const CPowerSafety& powerSafety(void) const {
+    return m_PowerSafety;
+  }
+  struct SPowerState {  // What power control needs, taken together
+    eHardrock                 m_eActiveAmp;
+    CPowerProfile::eModeClass m_eModeClass;
+    bool                      m_fModeKnown;
+    bool                      m_fSafetyPending;
+    bool                      m_fTransmitting;  // As the radio last answered, false once that's stale
+    uint16_t                  m_uTargetWatts;
+    uint8_t                   m_uchMaxPower;
+    uint8_t                   m_uchRFLevel;
+  };
+  SPowerState powerState(void) {  // Main loop only, it refreshes the cached profile
+    SPowerState State;
+
+    if (m_fProfileStale) {
+      refreshPowerProfile();
+    }
+    State.m_eActiveAmp = m_eActiveAmp;
+    State.m_eModeClass = m_eModeClass;
+    State.m_fModeKnown = m_fModeKnown;
+    State.m_fSafetyPending = m_PowerSafety.pending();
+    State.m_fTransmitting = m_fTransmitting && m_TXSeen < TXStaleMillis;
+    State.m_uTargetWatts = m_PowerProfile.targetWatts(m_eActiveAmp, activeAntenna(), m_iBand);
+    State.m_uchMaxPower = m_uchMaxPower;
+    State.m_uchRFLevel = m_uchRFLevel;
+    return State;
+  }
+  uint16_t targetWatts(void) {  // The active Hardrock's output target here, 0 is open loop
+    if (m_fProfileStale) {
+      refreshPowerProfile();
+    }
+    return m_PowerProfile.targetWatts(m_eActiveAmp, activeAntenna(), m_iBand);
+  }
+  uint16_t targetWatts(eHardrock eWhichHardrock, eAntenna eWhichAntenna, uint32_t ulMeters) const {
+    return m_PowerProfile.targetWatts(eWhichHardrock, eWhichAntenna, CPowerProfile::bandIndex(ulMeters));
+  }
+  uint8_t rfLevel(void) const {  // The IC-705 RF level, as last read or written
+    return m_uchRFLevel;
+  }
+  void onRFLevel(uint8_t uchLevel) {
+    m_uchRFLevel = uchLevel;
   }
   uint8_t getInitialPower(eHardrock eWhichHardrock, uint32_t ulMeters) const {
     if (ulMeters == 1) {
@@ -787,33 +1024,17 @@ public:
     return m_aInitialPwr[eWhichHardrock][getMetersMapIndex(ulMeters)];
   }
   uint8_t getInitialPwr(void) {
-    uint8_t uchRFLevel(0);
-
     switch (getFrequencyMeters()) {
       case 1:
-        uchRFLevel = m_InitialPwr70CM;
-        break;
+        return m_InitialPwr70CM;
       case 2:
-        uchRFLevel = m_InitialPwr2M;
-        break;
+        return m_InitialPwr2M;
       default:
-        int       nIndex(getMetersMapIndex());
-        eHardrock whichHardrock((HardrockAvailable(eHardrock::A)
-                                 && SendEnabled(eHardrock::A))
-                                  ? eHardrock::A
-                                : (HardrockAvailable(eHardrock::B)
-                                   && SendEnabled(eHardrock::B))
-                                  ? eHardrock::B
-                                  : eHardrock::QRP);
-        if (whichHardrock != eHardrock::QRP && !PTTEnabled(whichHardrock)) {
-          whichHardrock = eHardrock::QRP;
-        }
-        if (nIndex >= 0) {
-          uchRFLevel = m_aInitialPwr[whichHardrock][nIndex];
+        if (m_fProfileStale) {
+          refreshPowerProfile();
         }
-        break;
+        return (m_iBand >= 0 && m_iBand < CPowerProfile::Band2M) ? m_aInitialPwr[m_eActiveAmp][m_iBand] : 0;
     }
-    return uchRFLevel;
   }
   void setInitialPwr(uint8_t uchLevel) {
     switch (getFrequencyMeters()) {
@@ -824,23 +1045,13 @@ public:
         m_InitialPwr2M = uchLevel;
         break;
       default:
-        int       nIndex(getMetersMapIndex());
-        eHardrock whichHardrock((HardrockAvailable(eHardrock::A)
-                                 && PTTEnabled(eHardrock::A))
-                                  ? eHardrock::A
-                                : (HardrockAvailable(eHardrock::B)
-                                   && PTTEnabled(eHardrock::B))
-                                  ? eHardrock::B
-                                  : eHardrock::QRP);
-        if (whichHardrock != eHardrock::QRP && !PTTEnabled(whichHardrock)) {
-          whichHardrock = eHardrock::QRP;
-        }
-        if (nIndex >= 0) {
-          m_aInitialPwr[whichHardrock][nIndex] = uchLevel;
+        refreshPowerProfile();
+        if (m_iBand >= 0 && m_iBand < CPowerProfile::Band2M) {
+          m_aInitialPwr[m_eActiveAmp][m_iBand] = uchLevel;
         }
         break;
     }
-    Serialize();
+    setDirty();
   }
 
 public:
@@ -869,6 +1080,52 @@ protected:
   }
 
 private:
+  void seedPowerProfile(void) {
+    for (int iBand(0); iBand < CPowerProfile::Band2M; iBand++) {
+      for (unsigned uAntenna(Antenna1); uAntenna <= Antenna2; uAntenna++) {
+        m_PowerProfile.seed(eHardrock::A, uAntenna, iBand, m_RFPowerMap.m_HRPwrMap[eHardrock::A].m_uchMaxPwrAnt[uAntenna][iBand]);
+        m_PowerProfile.seed(eHardrock::B, uAntenna, iBand, m_RFPowerMap.m_HRPwrMap[eHardrock::B].m_uchMaxPwrAnt[uAntenna][iBand]);
+      }
+      m_PowerProfile.seed(eHardrock::QRP, Antenna1, iBand, m_RFPowerMap.m_uchQRPPwr[iBand]);
+    }
+  }
+  uint8_t profileInputs(void) {  // What picks the active amplifier besides the band, keying mode and antenna
+    return uint8_t(HardrockAvailable(eHardrock::A)) | (uint8_t(HardrockAvailable(eHardrock::B)) << 1)
+           | (uint8_t(SendEnabled(eHardrock::A)) << 2) | (uint8_t(SendEnabled(eHardrock::B)) << 3);
+  }
+  uint8_t safePower(void) {  // The new band's initial level, never over its limit
+    return (getInitialPwr() <= maxPower()) ? getInitialPwr() : maxPower();
+  }
+  void writePTTEnables(void) {  // Low while a band change waits for the radio to be at a safe level
+    digitalWrite(PTT_A_Enable, !m_PowerSafety.pending() && PTTEnabled(eHardrock::A));
+    digitalWrite(PTT_B_Enable, !m_PowerSafety.pending() && PTTEnabled(eHardrock::B));
+  }
+  void onPowerSafetyRetry(void);
+  void onModeRetry(void);
+  void onTXPoll(void);
+  bool wantsTXState(void) {  // Power control has a target to trim to, main loop only
+    if (m_fProfileStale) {
+      refreshPowerProfile();
+    }
+    return getFrequencyMeters()
+           && m_fModeKnown
+           && m_eModeClass != CPowerProfile::Phone
+           && m_eActiveAmp != eHardrock::QRP
+           && m_PowerProfile.targetWatts(m_eActiveAmp, activeAntenna(), m_iBand);
+  }
+  eAntenna activeAntenna(void) const {
+    return (m_eActiveAmp != eHardrock::QRP) ? m_aCurrentAntenna[m_eActiveAmp] : Antenna1;
+  }
+  void refreshPowerProfile(void) {  // Band, mode, antenna, keying mode or PTT switch changed
+    m_fProfileStale = false;
+    m_uchProfileInputs = profileInputs();
+    m_iBand = CPowerProfile::bandIndex(getFrequencyMeters());
+    m_eActiveAmp = (HardrockAvailable(eHardrock::A) && PTTEnabled(eHardrock::A))   ? eHardrock::A
+                   : (HardrockAvailable(eHardrock::B) && PTTEnabled(eHardrock::B)) ? eHardrock::B
+                                                                                   : eHardrock::QRP;
+    m_uchMaxPower = (m_fModeKnown) ? m_PowerProfile.get(m_eActiveAmp, activeAntenna(), m_iBand, m_eModeClass)
+                                   : m_PowerProfile.lowest(m_eActiveAmp, activeAntenna(), m_iBand);
+  }
   uint percentPower(uint8_t uchPwr) {
     return lround((100.0 / 255.0) * float(uchPwr));
   }
@@ -907,6 +1164,13 @@ private:
   static void onPrintStatus(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
   static void onHardrockAvailable(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
   void        onHardrockAvailable(const String& rsCmd, CSerialDevice& rSrcDevice);
+  static void onProfile(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
+  static void onTraceLog(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
+  static void onCapture(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
+  static void onBridge(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
+  static void onLinkHealth(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
+  static void onTargetWatts(void* pthis, const String& rsCmd, CSerialDevice& rSrcDevice);
+  void        onTargetWatts(const String& rsCmd, CSerialDevice& rSrcDevice);
 
 protected:
   const uint16_t m_uDebounceInterval;
@@ -940,7 +1204,9 @@ protected:
   bool              m_fTuningEnabled[2][2] = { { true, true }, { true, true } };
   bool              m_aKeyingMode[2] = { true, true };
   SRFPowerMap       m_RFPowerMap;
-  SHardrockUSBMap   m_USBMap[4];
+  SHardrockUSBMap   m_aLegacyUSBMap[4];
+  CUSBBindingMap    m_USBBindings;
+  volatile uint32_t m_uBindingsRevision;
   const int         m_aPTTEnableMap[2][11] = {
             { HR_A_6M_PTT_Enable, HR_A_10M_PTT_Enable, HR_A_12M_PTT_Enable,
               HR_A_15M_PTT_Enable, HR_A_17M_PTT_Enable, HR_A_20M_PTT_Enable,
@@ -953,5 +1219,19 @@ protected:
   };
   Watchdog          m_Watchdog;
   Watchdog::Timeout m_eTimeout;
+  CPowerProfile     m_PowerProfile;
+  eHardrock         m_eActiveAmp;  // Cached by refreshPowerProfile(), with the band, mode class and limit
+  int               m_iBand;
+  CPowerProfile::eModeClass m_eModeClass;
+  volatile bool     m_fModeKnown;
+  elapsedMillis     m_ModeRetry;
+  volatile bool     m_fTransmitting;
+  elapsedMillis     m_TXPoll;
+  elapsedMillis     m_TXSeen;
+  uint8_t           m_uchMaxPower;
+  uint8_t           m_uchProfileInputs;
+  volatile bool     m_fProfileStale;
+  CPowerSafety      m_PowerSafety;
+  volatile uint8_t  m_uchRFLevel;
 };
 #endif
@@ -0,0 +1,198 @@
+#if !defined TEXTFRAME_H_DEFINED
+#define TEXTFRAME_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <Arduino.h>
+#include <elapsedMillis.h>
+
+#include "Hardplace705Plus.h"
+
+/*
+   Hardrock text frames without String
+
+   CTextFrameParser assembles "HRBN;" style frames a byte at a time in a fixed buffer, so a port's onAvailable()
+   takes what has arrived and never waits in readStringUntil() for the rest. Anything before the first letter or
+   digit of a frame is junk (line noise, a stray CR), a frame longer than FrameBytes is dropped. The frame handed on
+   keeps its ';' and is NUL terminated.
+
+   CTextFrameBatch collects frames for one destination and writes as many as availableForWrite() allows in one
+   write, the source calls flush() (through CBoundDevice::onBurstEnd()) once it has taken every frame that arrived,
+   and the destination's Task() flushes what didn't fit.
+
+   CFrameRate counts frames and bytes and turns them into per second figures over RateMillis windows.
+*/
+
+class CFrameRate {
+public:
+  enum {
+    RateMillis = 1000
+  };
+
+public:
+  CFrameRate()
+    : m_ulFrames(0), m_ulBytes(0), m_ulWindowFrames(0), m_ulWindowBytes(0), m_ulFramesPerSec(0), m_ulBytesPerSec(0) {}
+
+  void onFrame(size_t stBytes) {
+    m_ulFrames++;
+    m_ulBytes += stBytes;
+    m_ulWindowFrames++;
+    m_ulWindowBytes += stBytes;
+    if (m_Window >= RateMillis) {
+      m_ulFramesPerSec = (m_ulWindowFrames * 1000UL) / m_Window;
+      m_ulBytesPerSec = (m_ulWindowBytes * 1000UL) / m_Window;
+      m_ulWindowFrames = m_ulWindowBytes = 0;
+      m_Window = 0;
+    }
+  }
+  uint32_t frames(void) const {
+    return m_ulFrames;
+  }
+  uint32_t bytes(void) const {
+    return m_ulBytes;
+  }
+  uint32_t framesPerSec(void) const {  // Last full window, 0 once it's gone quiet
+    return (m_Window < 2 * RateMillis) ? m_ulFramesPerSec : 0;
+  }
+  uint32_t bytesPerSec(void) const {
+    return (m_Window < 2 * RateMillis) ? m_ulBytesPerSec : 0;
+  }
+
+private:
+  uint32_t      m_ulFrames;
+  uint32_t      m_ulBytes;
+  uint32_t      m_ulWindowFrames;
+  uint32_t      m_ulWindowBytes;
+  uint32_t      m_ulFramesPerSec;
+  uint32_t      m_ulBytesPerSec;
+  elapsedMillis m_Window;
+};
+
+class CTextFrameParser {
+public:
+  enum {
+    FrameBytes = 64
+  };
+
+  enum eResult {
+    Partial,
+    Frame,
+    Junk
+  };
+
+public:
+  CTextFrameParser()
+    : m_stFrame(0), m_ulDropped(0) {
+    m_achFrame[0] = '\0';
+  }
+
+private:
+  CTextFrameParser(const CTextFrameParser&);
+  CTextFrameParser& operator=(const CTextFrameParser&);
+
+public:
+  eResult feed(int iChar) {
+    if (m_stFrame == 0
+        && !isAlphaNumeric(iChar)
+        && iChar != ';') {
+      return (isspace(iChar)) ? Partial : Junk;
+    }
+    if (m_stFrame >= FrameBytes - 2) {  // Room for ';' and NUL, a frame this long isn't a Hardrock command
+      m_stFrame = 0;
+      m_ulDropped++;
+      return Junk;
+    }
+    m_achFrame[m_stFrame++] = static_cast<char>(iChar);
+    if (iChar == ';') {
+      m_achFrame[m_stFrame] = '\0';
+      return Frame;
+    }
+    return Partial;
+  }
+  void next(void) {  // After a Frame has been handled
+    m_stFrame = 0;
+  }
+  bool isEmpty(void) const {
+    return m_stFrame == 0;
+  }
+  const char* frame(void) const {
+    return m_achFrame;
+  }
+  size_t length(void) const {
+    return m_stFrame;
+  }
+  uint32_t dropped(void) const {
+    return m_ulDropped;
+  }
+
+private:
+  char     m_achFrame[FrameBytes];
+  size_t   m_stFrame;
+  uint32_t m_ulDropped;
+};
+
+class CTextFrameBatch {
+public:
+  enum {
+    BatchBytes = 256
+  };
+
+public:
+  CTextFrameBatch()
+    : m_stBatch(0), m_ulWrites(0), m_ulDropped(0) {}
+
+private:
+  CTextFrameBatch(const CTextFrameBatch&);
+  CTextFrameBatch& operator=(const CTextFrameBatch&);
+
+public:
+  void append(const char* pchFrame, size_t stFrame, Print& rDevice) {
+    if (m_stBatch + stFrame > BatchBytes) {
+      flush(rDevice, true);
+    }
+    if (m_stBatch + stFrame > BatchBytes) {  // The destination isn't taking anything
+      m_ulDropped++;
+      return;
+    }
+    memcpy(&m_auchBatch[m_stBatch], pchFrame, stFrame);
+    m_stBatch += stFrame;
+    m_Rate.onFrame(stFrame);
+  }
+  void flush(Print& rDevice, bool fAll = false) {  // fAll waits for room, append() with a full batch
+    if (m_stBatch) {
+      size_t stWrite(m_stBatch);
+
+      if (!fAll) {
+        const int iRoom(rDevice.availableForWrite());
+
+        if (iRoom <= 0) {
+          return;  // Next Task()
+        } else if (static_cast<size_t>(iRoom) < stWrite) {
+          stWrite = iRoom;
+        }
+      }
+      stWrite = rDevice.write(m_auchBatch, stWrite);
+      m_ulWrites++;
+      memmove(m_auchBatch, &m_auchBatch[stWrite], m_stBatch - stWrite);
+      m_stBatch -= stWrite;
+    }
+  }
+  const CFrameRate& rate(void) const {
+    return m_Rate;
+  }
+  uint32_t writes(void) const {
+    return m_ulWrites;
+  }
+  uint32_t dropped(void) const {
+    return m_ulDropped;
+  }
+
+private:
+  uint8_t    m_auchBatch[BatchBytes];
+  size_t     m_stBatch;
+  uint32_t   m_ulWrites;
+  uint32_t   m_ulDropped;
+  CFrameRate m_Rate;
+};
+#endif
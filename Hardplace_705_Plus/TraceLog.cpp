@@ -0,0 +1,309 @@
+#include <Arduino.h>
+
+#include "TraceLog.h"
+#include "Tracer.h"
+
+#define TRACE_INFO_DATA 0x08
+#define TRACE_INFO(_category_, _level_, _data_) \
+  static_cast<uint8_t>(((_category_) << 4) | ((_data_) ? TRACE_INFO_DATA : 0) | ((_level_)&0x03))
+
+#define TRACE_LOG_MAGIC 0x54524C32  // "TRL2", records with a boot count and check
+
+static DMAMEM CTraceLog::STraceHeader TraceHeader __attribute__((aligned(32)));
+static DMAMEM CTraceLog::STraceRecord aTraceRing[CTraceLog::Records] __attribute__((aligned(32)));  // One record per cache line
+
+volatile uint32_t CTraceLog::m_uHead(0);
+uint32_t          CTraceLog::m_uTail(0);
+uint32_t          CTraceLog::m_uDropped(0);
+CTraceLog::eTraceLevel CTraceLog::m_eDrainLevel(CTraceLog::TraceInfo);
+uint32_t          CTraceLog::m_uBootSlot(0);
+uint32_t          CTraceLog::m_uPreviousFirst(0);
+uint32_t          CTraceLog::m_uBootCount(0);
+
+static const char* apszEventNames[CTraceLog::EndOfList] = {
+  "...",
+  "Boot",
+  "CI-V from radio",
+  "CI-V to radio",
+  "CI-V from client",
+  "Hardrock to amp",
+  "Hardrock from amp",
+  "Bluetooth connected",
+  "Bluetooth disconnected",
+  "AT command",
+  "USB attached",
+  "USB detached",
+  "RF power write",
+  "Clone start",
+  "Clone complete",
+  "USB identified",
+  "RF power safe",
+  "Bluetooth baudrate",
+  "Bluetooth error burst",
+  "Tune start",
+  "Hardrock found",
+  "Hardrock baudrate",
+  "Hardrock bound",
+  "USB not a Hardrock",
+  "EEPROM commit failed"
+};
+
+static const char* apszCategoryNames[] = {
+  "System",
+  "CI-V",
+  "Hardrock",
+  "Bluetooth",
+  "USB",
+  "Config",
+  "Power"
+};
+
+static class CTraceLogInitialize {
+public:
+  CTraceLogInitialize() {
+    CTraceLog::begin();
+  }
+} _traceLogInitialize;
+
+void CTraceLog::begin(void) {
+  const bool fRecovered(recover());
+
+  if (!fRecovered) {
+    memset(aTraceRing, 0, sizeof aTraceRing);  // Power on, DMAMEM isn't initialized by the startup code
+    TraceHeader.m_uMagic = TRACE_LOG_MAGIC;
+    TraceHeader.m_uRecords = Records;
+    TraceHeader.m_uRecordSize = sizeof(STraceRecord);
+    TraceHeader.m_uBootCount = 0;
+    m_uHead = m_uBootSlot = m_uPreviousFirst = 0;
+  }
+  TraceHeader.m_uBootCount++;
+  TraceHeader.m_uCRC = crc32(&TraceHeader, offsetof(STraceHeader, m_uCRC));
+#if defined __IMXRT1062__
+  arm_dcache_flush(&TraceHeader, sizeof TraceHeader);
+  arm_dcache_flush(aTraceRing, sizeof aTraceRing);
+#endif
+  m_uBootCount = TraceHeader.m_uBootCount;
+  m_uTail = m_uHead;  // The previous boot has already been drained, or never will be
+  m_uDropped = 0;
+  TRACE_EVENT(TraceSystem, TraceInfo, Boot, m_uBootCount, fRecovered);
+}
+
+bool CTraceLog::recover(void) {
+  uint32_t uHead(0);
+
+  if (TraceHeader.m_uMagic != TRACE_LOG_MAGIC
+      || TraceHeader.m_uRecords != Records
+      || TraceHeader.m_uRecordSize != sizeof(STraceRecord)
+      || TraceHeader.m_uCRC != crc32(&TraceHeader, offsetof(STraceHeader, m_uCRC))) {
+    return false;
+  }
+  for (uint32_t uIndex(0); uIndex < Records; uIndex++) {  // The newest record has the largest sequence number
+    const uint32_t uSequence(aTraceRing[uIndex].m_uSequence);
+
+    if (uSequence
+        && ((uSequence - 1) & (Records - 1)) == uIndex
+        && uSequence > uHead
+        && valid(aTraceRing[uIndex], uSequence - 1)) {
+      uHead = uSequence;
+    }
+  }
+
+  const uint32_t uLowest((uHead > Records) ? uHead - Records : 0);
+  const uint16_t uPreviousBoot(static_cast<uint16_t>(TraceHeader.m_uBootCount));
+  uint32_t       uFirst(uHead);
+
+  while (uFirst > uLowest  // Back from the head while the records are whole and the previous boot's
+         && valid(aTraceRing[(uFirst - 1) & (Records - 1)], uFirst - 1)
+         && aTraceRing[(uFirst - 1) & (Records - 1)].m_uBoot == uPreviousBoot) {
+    uFirst--;
+  }
+  m_uHead = m_uBootSlot = uHead;
+  m_uPreviousFirst = uFirst;
+  return true;
+}
+
+uint32_t CTraceLog::crc32(const void* pvData, size_t stData) {
+  const uint8_t* puchData(static_cast<const uint8_t*>(pvData));
+  uint32_t       uCRC(0xFFFFFFFF);
+
+  while (stData--) {
+    uCRC ^= *puchData++;
+    for (unsigned nBit(0); nBit < 8; nBit++) {
+      uCRC = (uCRC >> 1) ^ (0xEDB88320 & -(uCRC & 1));
+    }
+  }
+  return ~uCRC;
+}
+
+CTraceLog::STraceRecord* CTraceLog::claim(uint32_t cRecords, uint32_t& ruSlot) {
+  ruSlot = __atomic_fetch_add(&m_uHead, cRecords, __ATOMIC_RELAXED);
+  return &aTraceRing[ruSlot & (Records - 1)];
+}
+
+void CTraceLog::log(eTraceEvent eEvent, eTraceCategory eCategory, eTraceLevel eLevel,
+                    uint32_t uArg0, uint32_t uArg1) {
+  uint32_t      uSlot;
+  STraceRecord* pRecord(claim(1, uSlot));
+
+  pRecord->m_uSequence = 0;
+  pRecord->m_uTimestamp = micros();
+  pRecord->m_uEvent = eEvent;
+  pRecord->m_uchInfo = TRACE_INFO(eCategory, eLevel, false);
+  pRecord->m_uchLength = sizeof uArg0 + sizeof uArg1;
+  memcpy(&pRecord->m_auchData[0], &uArg0, sizeof uArg0);
+  memcpy(&pRecord->m_auchData[sizeof uArg0], &uArg1, sizeof uArg1);
+  publish(pRecord, uSlot);
+}
+
+void CTraceLog::logData(eTraceEvent eEvent, eTraceCategory eCategory, eTraceLevel eLevel,
+                        const uint8_t* puchData, size_t stData) {
+  const uint32_t cRecords((stData) ? (stData + DataBytes - 1) / DataBytes : 1);
+  const uint32_t uTimestamp(micros());
+  uint32_t       uSlot;
+
+  if (cRecords > Records / 4) {  // Don't let one packet flush the log
+    return;
+  }
+  claim(cRecords, uSlot);
+  for (uint32_t uRecord(0); uRecord < cRecords; uRecord++, uSlot++) {
+    STraceRecord* pRecord(&aTraceRing[uSlot & (Records - 1)]);
+    const size_t  stChunk((stData > DataBytes) ? DataBytes : stData);
+
+    pRecord->m_uSequence = 0;
+    pRecord->m_uTimestamp = uTimestamp;
+    pRecord->m_uEvent = (uRecord == 0) ? eEvent : Continuation;
+    pRecord->m_uchInfo = TRACE_INFO(eCategory, eLevel, true);
+    pRecord->m_uchLength = stChunk;
+    memcpy(pRecord->m_auchData, puchData, stChunk);
+    puchData += stChunk, stData -= stChunk;
+    publish(pRecord, uSlot);
+  }
+}
+
+void CTraceLog::Task(void) {
+  CTraceDevice Tracer;
+
+  if (!Tracer.Enabled()) {
+    m_uTail = m_uHead;  // Nobody is listening
+    return;
+  }
+  for (unsigned cRecords(0); cRecords < 8 && m_uTail != m_uHead && Tracer.Available(); cRecords++) {
+    if (m_uHead - m_uTail > Records) {
+      uint32_t uTail(m_uHead - Records);
+
+      m_uDropped += uTail - m_uTail;
+      m_uTail = uTail;
+    }
+
+    const STraceRecord& rRecord(aTraceRing[m_uTail & (Records - 1)]);
+
+    if (__atomic_load_n(&rRecord.m_uSequence, __ATOMIC_ACQUIRE) != m_uTail + 1) {
+      break;  // Still being written
+    }
+    if ((rRecord.m_uchInfo & 0x03) <= m_eDrainLevel) {
+      if (Tracer.availableForWrite() < 96
+          || !format(Tracer, rRecord)) {
+        break;
+      }
+    }
+    m_uTail++;
+  }
+}
+
+bool CTraceLog::format(Print& rDevice, const STraceRecord& rRecord) {
+  const uint8_t uchCategory(rRecord.m_uchInfo >> 4);
+
+  if (rRecord.m_uEvent == Continuation) {
+    rDevice.printf("%33s", "");
+  } else {
+    rDevice.printf("%10lu %-9s %-22s", rRecord.m_uTimestamp, categoryName(uchCategory), eventName(rRecord.m_uEvent));
+  }
+  if (rRecord.m_uchInfo & TRACE_INFO_DATA) {
+    for (size_t nIndex(0); nIndex < rRecord.m_uchLength && nIndex < DataBytes; nIndex++) {
+      rDevice.printf(" %02X", rRecord.m_auchData[nIndex]);
+    }
+    rDevice.printf("\r\n");
+  } else {
+    uint32_t uArg0;
+    uint32_t uArg1;
+
+    memcpy(&uArg0, &rRecord.m_auchData[0], sizeof uArg0);
+    memcpy(&uArg1, &rRecord.m_auchData[sizeof uArg0], sizeof uArg1);
+    rDevice.printf(" %lu %lu\r\n", uArg0, uArg1);
+  }
+  return true;
+}
+
+void CTraceLog::print(Print& rDevice, bool fBinary) {
+  const uint32_t uHead(m_uHead);
+  const uint32_t uFirst((uHead > Records) ? uHead - Records : 0);
+
+  if (fBinary) {
+    const uint16_t uCount(uHead - uFirst);
+    const uint16_t uSize(sizeof(STraceRecord));
+
+    rDevice.write("HPTL", 4);
+    rDevice.write(reinterpret_cast<const uint8_t*>(&uCount), sizeof uCount);
+    rDevice.write(reinterpret_cast<const uint8_t*>(&uSize), sizeof uSize);
+  }
+  for (uint32_t uSlot(uFirst); uSlot != uHead; uSlot++) {
+    const STraceRecord Record(aTraceRing[uSlot & (Records - 1)]);  // Snapshot, writers keep going
+
+    if (fBinary) {
+      rDevice.write(reinterpret_cast<const uint8_t*>(&Record), sizeof Record);
+    } else if (valid(Record, uSlot)) {
+      format(rDevice, Record);
+      if ((uSlot & 0x0F) == 0) {
+        Delay(0);
+      }
+    }
+  }
+  rDevice.flush();
+}
+
+void CTraceLog::printPreviousBoot(Print& rDevice, uint32_t uSeconds) {
+  const uint32_t uHead(m_uHead);
+  uint32_t       uFirst((uHead > Records) ? uHead - Records : 0);
+  uint32_t       uLast(m_uBootSlot);
+
+  if (uFirst < m_uPreviousFirst) {
+    uFirst = m_uPreviousFirst;
+  }
+  while (uLast > uFirst  // Skip over anything half written when the reset hit
+         && !valid(aTraceRing[(uLast - 1) & (Records - 1)], uLast - 1)) {
+    uLast--;
+  }
+  if (uLast <= uFirst) {
+    rDevice.printf("No trace records from the previous boot\r\n");
+    return;
+  }
+  if (uSeconds) {
+    const uint32_t uEnd(aTraceRing[(uLast - 1) & (Records - 1)].m_uTimestamp);
+
+    while (uFirst < uLast
+           && uEnd - aTraceRing[uFirst & (Records - 1)].m_uTimestamp > uSeconds * 1000000) {
+      uFirst++;
+    }
+  }
+  rDevice.printf("Trace records from boot %lu, last %lu\r\n", m_uBootCount - 1, uLast - uFirst);
+  for (uint32_t uSlot(uFirst); uSlot != uLast; uSlot++) {
+    const STraceRecord Record(aTraceRing[uSlot & (Records - 1)]);
+
+    if (valid(Record, uSlot)
+        && Record.m_uBoot == static_cast<uint16_t>(m_uBootCount - 1)) {
+      format(rDevice, Record);
+      if ((uSlot & 0x0F) == 0) {
+        Delay(0);
+      }
+    }
+  }
+  rDevice.flush();
+}
+
+const char* CTraceLog::eventName(uint16_t uEvent) {
+  return (uEvent < EndOfList) ? apszEventNames[uEvent] : "Unknown";
+}
+
+const char* CTraceLog::categoryName(uint8_t uchCategory) {
+  return (uchCategory < sizeof apszCategoryNames / sizeof(const char*)) ? apszCategoryNames[uchCategory] : "Unknown";
+}
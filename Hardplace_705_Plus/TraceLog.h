@@ -0,0 +1,202 @@
+#if !defined TRACELOG_H_DEFINED
+#define TRACELOG_H_DEFINED
+
+#include <cstdint>
+#include <cstddef>
+#include <Arduino.h>
+#include <Print.h>
+
+#include "Hardplace705Plus.h"
+
+/*
+   Binary trace log
+
+   Fixed size records (timestamp, event id, category/level, up to 20 bytes of arguments or packet data)
+   are written lock free into a RAM ring, a writer claims its slot(s) with an atomic add on the head and
+   publishes each record by writing its sequence number last. Nothing is formatted at the call site,
+   CTraceLog::Task() drains the ring to the trace device from loop() when it has room.
+
+   Records filtered out at compile time by TRACE_LOG_LEVEL/TRACE_LOG_CATEGORIES cost nothing, the
+   arguments of TRACE_EVENT/TRACE_DATA are not even evaluated. TRACE_LOG_LEVEL is TraceInfo unless the
+   build says otherwise, the per packet CI-V and Hardrock records are TraceDebug and cost nothing until a
+   build asks for them. Everything compiled in is recorded, the drain task only prints records at or below
+   the drain level (TraceInfo by default).
+
+   The ring lives in DMAMEM (RAM2) which isn't cleared by a warm reset (watchdog, SCB_AIRCR reset, crash),
+   each record is one 32 byte cache line and is flushed to RAM as it's published. Each record carries the
+   low bits of the boot count and a check over its contents and sequence number, a record torn by the reset
+   or left over from an older layout fails it. At boot a valid ring header (magic, layout, CRC) means the
+   records may be from earlier boots, the head is recovered from the newest record that checks and logging
+   continues after it. The previous boot is the run of checked records ending there that carry its boot
+   count, so what the box was doing before a watchdog reset is still there and older boots aren't mixed in.
+   setup() dumps the last seconds of the previous boot after an abnormal reset, "HPTLP;" prints whatever of
+   the previous boot hasn't been overwritten yet.
+
+   "HPTL;" prints the ring, "HPTLB;" dumps it raw: the 8 byte header "HPTL", record count (uint16_t),
+   record size (uint16_t) followed by the records oldest first, little endian STraceRecord layout.
+*/
+
+#if !defined TRACE_LOG_LEVEL
+#define TRACE_LOG_LEVEL TraceInfo
+#endif
+#if !defined TRACE_LOG_CATEGORIES
+#define TRACE_LOG_CATEGORIES 0xFF
+#endif
+
+class CTraceLog {
+public:
+  enum eTraceLevel {
+    TraceError,
+    TraceWarning,
+    TraceInfo,
+    TraceDebug
+  };
+
+  enum eTraceCategory {
+    TraceSystem,
+    TraceCIV,
+    TraceHardrock,
+    TraceBluetooth,
+    TraceUSB,
+    TraceConfig,
+    TracePower
+  };
+
+  enum eTraceEvent {
+    Continuation,  // Packet data that didn't fit in the previous record
+    Boot,
+    CIVFromRadio,
+    CIVToRadio,
+    CIVFromClient,
+    HardrockToAmp,
+    HardrockFromAmp,
+    BluetoothConnected,
+    BluetoothDisconnected,
+    ATCommand,
+    USBAttached,
+    USBDetached,
+    RFPowerWrite,
+    CloneStart,
+    CloneComplete,
+    USBIdentified,
+    RFPowerSafe,
+    BluetoothBaudrate,
+    BluetoothErrorBurst,
+    TuneStart,
+    HardrockFound,
+    HardrockBaudrate,
+    HardrockBound,
+    USBNotHardrock,
+    EEPROMCommitFailed,
+    EndOfList
+  };
+
+  enum {
+    DataBytes = 16,
+    Records = 512,  // Power of 2
+    PreviousBootSeconds = 30
+  };
+
+  struct STraceRecord {
+    uint32_t m_uSequence;  // Slot number + 1, written last, 0 while being written
+    uint32_t m_uTimestamp;  // micros()
+    uint16_t m_uEvent;
+    uint8_t  m_uchInfo;    // Category << 4 | data flag (0x08) | Level
+    uint8_t  m_uchLength;  // Bytes used in m_auchData
+    uint16_t m_uBoot;      // Low 16 bits of the boot count
+    uint8_t  m_auchData[DataBytes];
+    uint16_t m_uCheck;     // check(), over everything after m_uSequence and the sequence it's published with
+  };
+  static_assert(sizeof(STraceRecord) == 32, "A trace record is one cache line");
+
+  struct STraceHeader {
+    uint32_t m_uMagic;
+    uint16_t m_uRecords;
+    uint16_t m_uRecordSize;
+    uint32_t m_uBootCount;
+    uint32_t m_uCRC;  // CRC-32 of the fields above
+  };
+
+private:
+  CTraceLog();
+  CTraceLog(const CTraceLog&);
+  CTraceLog& operator=(const CTraceLog&);
+
+public:
+  static constexpr bool compiled(eTraceCategory eCategory, eTraceLevel eLevel) {
+    return eLevel <= TRACE_LOG_LEVEL && (TRACE_LOG_CATEGORIES & (1 << eCategory)) != 0;
+  }
+
+  static void begin(void);
+  static void Task(void);
+  static void print(Print& rDevice, bool fBinary = false);
+  static void printPreviousBoot(Print& rDevice, uint32_t uSeconds = 0);  // 0, everything still in the ring
+
+  static void log(eTraceEvent eEvent, eTraceCategory eCategory, eTraceLevel eLevel,
+                  uint32_t uArg0 = 0, uint32_t uArg1 = 0);
+  static void logData(eTraceEvent eEvent, eTraceCategory eCategory, eTraceLevel eLevel,
+                      const uint8_t* puchData, size_t stData);
+
+  static const char* eventName(uint16_t uEvent);
+  static const char* categoryName(uint8_t uchCategory);
+
+  static uint32_t dropped(void) {
+    return m_uDropped;
+  }
+  static bool havePreviousBoot(void) {
+    return m_uBootSlot > m_uPreviousFirst;
+  }
+  static uint32_t bootCount(void) {
+    return m_uBootCount;
+  }
+  static void setDrainLevel(eTraceLevel eLevel) {
+    m_eDrainLevel = eLevel;
+  }
+
+private:
+  static STraceRecord* claim(uint32_t cRecords, uint32_t& ruSlot);
+  static void          publish(STraceRecord* pRecord, uint32_t uSlot) {
+    pRecord->m_uBoot = static_cast<uint16_t>(m_uBootCount);
+    pRecord->m_uCheck = check(*pRecord, uSlot + 1);
+    __atomic_store_n(&pRecord->m_uSequence, uSlot + 1, __ATOMIC_RELEASE);
+#if defined __IMXRT1062__
+    arm_dcache_flush(pRecord, sizeof *pRecord);  // Make it to RAM before a watchdog reset can lose it
+#endif
+  }
+  static bool format(Print& rDevice, const STraceRecord& rRecord);
+  static uint16_t check(const STraceRecord& rRecord, uint32_t uSequence) {
+    const uint32_t uCRC(crc32(&rRecord.m_uTimestamp, offsetof(STraceRecord, m_uCheck) - offsetof(STraceRecord, m_uTimestamp)) ^ uSequence);
+
+    return static_cast<uint16_t>(uCRC ^ (uCRC >> 16));
+  }
+  static bool valid(const STraceRecord& rRecord, uint32_t uSlot) {  // Published in this slot, whole
+    return rRecord.m_uSequence == uSlot + 1
+           && rRecord.m_uCheck == check(rRecord, uSlot + 1);
+  }
+  static bool recover(void);
+  static uint32_t crc32(const void* pvData, size_t stData);
+
+private:
+  static volatile uint32_t m_uHead;
+  static uint32_t          m_uTail;
+  static uint32_t          m_uDropped;
+  static eTraceLevel       m_eDrainLevel;
+  static uint32_t          m_uBootSlot;       // First slot written by this boot
+  static uint32_t          m_uPreviousFirst;  // First slot of the previous boot still valid
+  static uint32_t          m_uBootCount;
+};
+
+#define TRACE_EVENT(_category_, _level_, _event_, _arg0_, _arg1_) \
+  do { \
+    if (CTraceLog::compiled(CTraceLog::_category_, CTraceLog::_level_)) { \
+      CTraceLog::log(CTraceLog::_event_, CTraceLog::_category_, CTraceLog::_level_, (_arg0_), (_arg1_)); \
+    } \
+  } while (0)
+
+#define TRACE_DATA(_category_, _level_, _event_, _data_, _length_) \
+  do { \
+    if (CTraceLog::compiled(CTraceLog::_category_, CTraceLog::_level_)) { \
+      CTraceLog::logData(CTraceLog::_event_, CTraceLog::_category_, CTraceLog::_level_, (_data_), (_length_)); \
+    } \
+  } while (0)
+#endif